@@ -0,0 +1,14 @@
+#include "APUAudioOutput.h"
+#include "APU.h"
+
+
+APUAudioOutput::APUAudioOutput(const std::shared_ptr<APUAudioStream>& audio_stream)
+    : m_audio_stream(audio_stream)
+{
+}
+
+
+bool APUAudioOutput::progress(int frame_count, int sample_rate, int channel_count, float* out, float volume, float balance, float pitch)
+{
+    return m_audio_stream->progress(frame_count, sample_rate, channel_count, out);
+}
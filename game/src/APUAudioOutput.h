@@ -0,0 +1,21 @@
+#pragma once
+
+#include <onut/AudioStream.h>
+
+#include <memory>
+
+
+class APUAudioStream;
+
+
+// Feeds the emulator's APU samples to onut's audio engine
+class APUAudioOutput final : public OAudioStream
+{
+public:
+    APUAudioOutput(const std::shared_ptr<APUAudioStream>& audio_stream);
+
+    bool progress(int frame_count, int sample_rate, int channel_count, float* out, float volume = 1.0f, float balance = 0.0f, float pitch = 1.0f) override;
+
+private:
+    std::shared_ptr<APUAudioStream> m_audio_stream;
+};
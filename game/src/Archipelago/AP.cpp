@@ -2902,34 +2902,34 @@ void AP::render()
 }
 
 
-void AP::serialize(FILE* f, int version) const
+void AP::serialize(StateWriter& writer, int version) const
 {
 	{
 		uint32_t count = (uint32_t)m_locations_checked.size();
-		fwrite(&count, 1, 4, f);
+		writer.write(&count, 4);
 		for (auto loc_id : m_locations_checked)
 		{
-			fwrite(&loc_id, 1, sizeof(int64_t), f);
+			writer.write(&loc_id, sizeof(int64_t));
 		}
 	}
 
 	{
 		uint32_t count = (uint32_t)m_queued_items.size();
-		fwrite(&count, 1, 4, f);
-		fwrite(m_queued_items.data(), 1, m_queued_items.size(), f);
+		writer.write(&count, 4);
+		writer.write(m_queued_items.data(), m_queued_items.size());
 	}
 
-	fwrite(&m_item_received_count, 1, 4, f);
+	writer.write(&m_item_received_count, 4);
 
 	{
 		uint32_t count = (uint32_t)m_remote_item_dialog_queue.size();
-		fwrite(&count, 1, 4, f);
-		fwrite(m_remote_item_dialog_queue.data(), sizeof(int64_t), m_remote_item_dialog_queue.size(), f);
+		writer.write(&count, 4);
+		writer.write(m_remote_item_dialog_queue.data(), sizeof(int64_t) * m_remote_item_dialog_queue.size());
 	}
 }
 
 
-void AP::deserialize(FILE* f, int version)
+void AP::deserialize(StateReader& reader, int version)
 {
 	m_locations_checked.clear();
 	m_queued_items.clear();
@@ -2937,12 +2937,12 @@ void AP::deserialize(FILE* f, int version)
 	if (version >= 4)
 	{
 		uint32_t count;
-		fread(&count, 1, 4, f);
+		reader.read(&count, 4);
 
 		for (uint32_t i = 0; i < count; ++i)
 		{
 			int64_t loc_id;
-			fread(&loc_id, 1, sizeof(int64_t), f);
+			reader.read(&loc_id, sizeof(int64_t));
 			m_locations_checked.insert(loc_id);
 		}
 
@@ -2952,22 +2952,22 @@ void AP::deserialize(FILE* f, int version)
 	if (version >= 5)
 	{
 		uint32_t count;
-		fread(&count, 1, 4, f);
+		reader.read(&count, 4);
 		m_queued_items.resize(count);
-		fread(m_queued_items.data(), 1, count, f);
+		reader.read(m_queued_items.data(), count);
 	}
 
 	if (version >= 7)
 	{
-		fread(&m_item_received_count, 1, 4, f);
+		reader.read(&m_item_received_count, 4);
 	}
 
 	if (version >= 8)
 	{
 		uint32_t count;
-		fread(&count, 1, 4, f);
+		reader.read(&count, 4);
 		m_remote_item_dialog_queue.resize(count);
-		fread(m_remote_item_dialog_queue.data(), sizeof(int64_t), count, f);
+		reader.read(m_remote_item_dialog_queue.data(), sizeof(int64_t) * count);
 	}
 }
 
@@ -17,6 +17,8 @@ class CPUBUS;
 class ExternalInterface;
 class Patcher;
 class RAM;
+class StateReader;
+class StateWriter;
 class TileDrawer;
 class WorldData;
 
@@ -87,8 +89,8 @@ public:
     void option_random_monsters(int value);
     void option_random_rewards(int value);
 
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
 
     uint8_t remap_sound(uint8_t sound_id) const;
 
@@ -1,5 +1,7 @@
 #include "APTracker.h"
 #include "APItems.h"
+#include "CHRCache.h"
+#include "PixelKernels.h"
 #include "PPU.h"
 #include "RAM.h"
 #include "TileDrawer.h"
@@ -63,8 +65,8 @@ APTracker::APTracker(uint8_t* rom, RAM* ram, TileDrawer* tile_drawer)
     }
 
     // Load palettes from the ROM file
-    uint8_t palette[4 * 3];
-    uint8_t entity_palette[4 * 3];
+    uint32_t palette[4];
+    uint32_t entity_palette[4];
     uint8_t colors[192];
     load_colors(colors);
 
@@ -72,15 +74,13 @@ APTracker::APTracker(uint8_t* rom, RAM* ram, TileDrawer* tile_drawer)
         uint8_t indexed_palette[4];
         memcpy(indexed_palette, &rom[0x0002C000 + 12], 4);
         for (int i = 0; i < 4; ++i)
-            for (int j = 0; j < 3; ++j)
-                palette[i * 3 + j] = colors[indexed_palette[i] * 3 + j];
+            palette[i] = pack_rgba(colors[indexed_palette[i] * 3 + 0], colors[indexed_palette[i] * 3 + 1], colors[indexed_palette[i] * 3 + 2], 255);
     }
     {
         uint8_t indexed_palette[4];
         memcpy(indexed_palette, &rom[0x0002C000 + 28 * 16 + 2 * 4], 4);
         for (int i = 0; i < 4; ++i)
-            for (int j = 0; j < 3; ++j)
-                entity_palette[i * 3 + j] = colors[indexed_palette[i] * 3 + j];
+            entity_palette[i] = pack_rgba(colors[indexed_palette[i] * 3 + 0], colors[indexed_palette[i] * 3 + 1], colors[indexed_palette[i] * 3 + 2], 255);
     }
 
     // Create tracker spritesheet
@@ -139,10 +139,18 @@ APTracker::APTracker(uint8_t* rom, RAM* ram, TileDrawer* tile_drawer)
 }
 
 
-void APTracker::bake(int dst_id, uint8_t* dst_image, uint8_t* palette, uint8_t tile0, uint8_t tile1, uint8_t tile2, uint8_t tile3, bool flip_green_red)
+void APTracker::bake(int dst_id, uint8_t* dst_image, const uint32_t* palette, uint8_t tile0, uint8_t tile1, uint8_t tile2, uint8_t tile3, bool flip_green_red)
 {
     int dst_x = (dst_id % 4) * 16;
     int dst_y = (dst_id / 4) * 16;
+    const auto& kernels = get_pixel_kernels();
+
+    uint32_t colors[4] = { palette[0], palette[1], palette[2], palette[3] };
+    if (flip_green_red)
+    {
+        colors[1] = palette[2];
+        colors[2] = palette[1];
+    }
 
     const uint8_t* srcs[] = {
         m_rom + 0x00028500 + tile0 * 16,
@@ -153,44 +161,27 @@ void APTracker::bake(int dst_id, uint8_t* dst_image, uint8_t* palette, uint8_t t
 
     for (int i = 0; i < 4; ++i)
     {
-        auto src = srcs[i];
+        uint8_t tile[CHRCache::TILE_SIZE];
+        CHRCache::decode_tile(srcs[i], tile);
         int dst2_x = dst_x + (i % 2) * 8;
         int dst2_y = dst_y + (i / 2) * 8;
 
         for (int y = 0; y < 8; ++y)
         {
-            int dst_y_k = (dst2_y + y) * (4 * 16 * 4);
-            for (int x = 0; x < 8; ++x)
-            {
-                int inv_x = 7 - x;
-                int b1 = (src[y] >> inv_x) & 1;
-                int b2 = (src[y + 8] >> inv_x) & 1;
-                int col = (b1) | (b2 << 1);
-
-                if (flip_green_red)
-                {
-                    if (col == 1) col = 2;
-                    else if (col == 2) col = 1;
-                }
-
-                int dst_k = dst_y_k + ((dst2_x + x) * 4);
-
-                dst_image[dst_k + 0] = palette[col * 3 + 0];
-                dst_image[dst_k + 1] = palette[col * 3 + 1];
-                dst_image[dst_k + 2] = palette[col * 3 + 2];
-                dst_image[dst_k + 3] = 255;
-            }
+            int dst_k = (dst2_y + y) * (4 * 16 * 4) + dst2_x * 4;
+            kernels.expand_row(tile + y * 8, colors, dst_image + dst_k);
         }
     }
 }
 
 
-void APTracker::bake_spring(int dst_id, uint8_t* dst_image, uint8_t* palette, uint8_t tile, bool flip_h)
+void APTracker::bake_spring(int dst_id, uint8_t* dst_image, const uint32_t* palette, uint8_t tile, bool flip_h)
 {
     int dst_x = (dst_id % 4) * 8;
     int dst_y = (dst_id / 4) * 8;
 
-    const uint8_t* src = m_rom + 0x0001CE36 + tile * 16;
+    uint8_t pixels[CHRCache::TILE_SIZE];
+    CHRCache::decode_tile(m_rom + 0x0001CE36 + tile * 16, pixels);
 
     for (int y = 0; y < 8; ++y)
     {
@@ -198,19 +189,8 @@ void APTracker::bake_spring(int dst_id, uint8_t* dst_image, uint8_t* palette, ui
 
         for (int x = 0; x < 8; ++x)
         {
-            int inv_x = 7 - x;
-            if (flip_h) inv_x = x;
-
-            int b1 = (src[y] >> inv_x) & 1;
-            int b2 = (src[y + 8] >> inv_x) & 1;
-            int col = (b1) | (b2 << 1);
-
-            int dst_k = dst_y_k + ((dst_x + x) * 4);
-
-            dst_image[dst_k + 0] = palette[col * 3 + 0];
-            dst_image[dst_k + 1] = palette[col * 3 + 1];
-            dst_image[dst_k + 2] = palette[col * 3 + 2];
-            dst_image[dst_k + 3] = 255;
+            int col = pixels[y * 8 + (flip_h ? 7 - x : x)];
+            memcpy(dst_image + dst_y_k + (dst_x + x) * 4, &palette[col], 4);
         }
     }
 }
@@ -0,0 +1,355 @@
+// Headless benchmarks of the emulator core's hot paths, each checked against the straightforward code
+// it replaced. Run it from the folder holding "Faxanadu (U).nes", like the game.
+//
+// Usage: CoreBench [options]
+//     --frames <n>  Frames the game runs for the PPU benchmark (default: 600)
+//     --rows <n>    Rows of 8 pixels each pixel kernel is timed on, per pass (default: 4000000)
+// Exits with 1 when a check fails.
+//
+// PPU: the game runs twice in lockstep, the PPU catching up with each instruction through run_until()
+// in one and dot by dot through tick() in the other. Every v-blank NMI and sprite 0 hit must land on the
+// same dot. The instruction lengths are then replayed on the PPU alone to time both. Rasterizing at
+// v-blank is the same work either way, it's left out.
+//
+// Pixel kernels: the SIMD ones, when this CPU has them, must write the same bytes as the scalar ones on
+// random rows, blend_pixels() at every length up to a screen row. Then each is timed in pixels/s, and
+// must be at least as fast as its scalar counterpart.
+
+#include "APU.h"
+#include "CPU.h"
+#include "Emulator.h"
+#include "ErrorHandler.h"
+#include "PixelKernels.h"
+#include "PPU.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+static const int MAX_REPORTED_MISMATCHES = 10;
+static const int ROW_POOL_SIZE = 4096; // Rows the kernels cycle through, small enough to stay in cache
+static const int TIMING_PASSES = 5;
+
+
+// Until the next v-blank, like Emulator::run() but with the PPU stepped either way. Keeps the dots each
+// instruction took.
+static void run_frame(Emulator& emulator, bool per_dot, std::vector<int>* out_steps)
+{
+    auto cpu = emulator.get_cpu();
+    auto ppu = emulator.get_ppu();
+    auto apu = emulator.get_apu();
+
+    int64_t frame_end = ppu->get_cycle() + ppu->get_dots_to_vblank();
+    while (ppu->get_cycle() < frame_end)
+    {
+        apu->set_cpu_cycle(ppu->get_cycle() / 3);
+        int dots = cpu->step() * 3;
+        if (per_dot)
+        {
+            for (int i = 0; i < dots; ++i)
+                ppu->tick();
+        }
+        else
+        {
+            ppu->run_until(ppu->get_cycle() + dots);
+        }
+        if (out_steps) out_steps->push_back(dots);
+    }
+}
+
+
+static bool bench_ppu(int frame_count)
+{
+    Emulator skipping;
+    Emulator stepping;
+    std::vector<int> steps;
+    int mismatches = 0;
+    for (int frame = 0; frame < frame_count; ++frame)
+    {
+        run_frame(skipping, false, &steps);
+        run_frame(stepping, true, nullptr);
+
+        auto skipping_ppu = skipping.get_ppu();
+        auto stepping_ppu = stepping.get_ppu();
+        if (skipping_ppu->get_nmi_cycle() != stepping_ppu->get_nmi_cycle() ||
+            skipping_ppu->get_sprite0_cycle() != stepping_ppu->get_sprite0_cycle())
+        {
+            if (mismatches < MAX_REPORTED_MISMATCHES)
+            {
+                fprintf(stderr, "Frame %d: NMI at %lld/%lld, sprite 0 hit at %lld/%lld (run_until/tick)\n", frame,
+                        (long long)skipping_ppu->get_nmi_cycle(), (long long)stepping_ppu->get_nmi_cycle(),
+                        (long long)skipping_ppu->get_sprite0_cycle(), (long long)stepping_ppu->get_sprite0_cycle());
+            }
+            mismatches++;
+        }
+    }
+
+    // The PPU alone, through the same instruction lengths
+    double frame_us[2];
+    for (int per_dot = 0; per_dot < 2; ++per_dot)
+    {
+        Emulator emulator;
+        auto ppu = emulator.get_ppu();
+        ppu->set_skip_screen(true);
+
+        auto start_time = std::chrono::high_resolution_clock::now();
+        for (int dots : steps)
+        {
+            if (per_dot)
+            {
+                for (int i = 0; i < dots; ++i)
+                    ppu->tick();
+            }
+            else
+            {
+                ppu->run_until(ppu->get_cycle() + dots);
+            }
+        }
+        auto end_time = std::chrono::high_resolution_clock::now();
+        frame_us[per_dot] = std::chrono::duration<double, std::micro>(end_time - start_time).count() / (double)frame_count;
+    }
+
+    printf("PPU: run_until %.2f us/frame, tick %.2f us/frame (%.1fx)\n", frame_us[0], frame_us[1], frame_us[0] > 0.0 ? frame_us[1] / frame_us[0] : 0.0);
+    if (mismatches)
+    {
+        printf("PPU: %d of %d frames have their NMI or sprite 0 hit on another dot\n", mismatches, frame_count);
+        return false;
+    }
+    printf("PPU: NMI and sprite 0 hit on the same dots over %d frames\n", frame_count);
+    return true;
+}
+
+
+struct row_pool_t
+{
+    std::vector<uint8_t> indices; // 8 per row
+    std::vector<uint32_t> palettes; // 4 per row
+    std::vector<uint8_t> pixels; // A screen row of RGBA per row, some transparent
+};
+
+
+static row_pool_t make_row_pool()
+{
+    std::mt19937 rng(1234);
+    row_pool_t pool;
+    pool.indices.resize(ROW_POOL_SIZE * 8);
+    pool.palettes.resize(ROW_POOL_SIZE * 4);
+    pool.pixels.resize(ROW_POOL_SIZE * PPU::SCREEN_W * 4);
+    for (auto& index : pool.indices) index = (uint8_t)(rng() & 3);
+    for (auto& color : pool.palettes) color = (uint32_t)rng();
+    for (size_t i = 0; i < pool.pixels.size(); i += 4)
+    {
+        uint32_t color = (uint32_t)rng();
+        if (rng() & 1) color = pack_rgba((uint8_t)color, (uint8_t)(color >> 8), (uint8_t)(color >> 16), 0);
+        memcpy(pool.pixels.data() + i, &color, 4);
+    }
+    return pool;
+}
+
+
+static int count_different_bytes(const uint8_t* a, const uint8_t* b, size_t size)
+{
+    int count = 0;
+    for (size_t i = 0; i < size; ++i)
+        if (a[i] != b[i]) count++;
+    return count;
+}
+
+
+// Bytes where the kernels' output differs from the scalar ones', from the same input
+static int compare_pixel_kernels(const pixel_kernels_t& kernels, const row_pool_t& pool)
+{
+    const auto& scalar = get_scalar_pixel_kernels();
+    int mismatches = 0;
+
+    uint8_t expected[8 * 4];
+    uint8_t actual[8 * 4];
+    for (int row = 0; row < ROW_POOL_SIZE; ++row)
+    {
+        auto indices = pool.indices.data() + row * 8;
+        auto palette = pool.palettes.data() + row * 4;
+        auto background = pool.pixels.data() + row * PPU::SCREEN_W * 4; // What blend_row() draws over
+
+        scalar.expand_row(indices, palette, expected);
+        kernels.expand_row(indices, palette, actual);
+        mismatches += count_different_bytes(expected, actual, sizeof(expected));
+
+        memcpy(expected, background, sizeof(expected));
+        memcpy(actual, background, sizeof(actual));
+        scalar.blend_row(indices, palette, expected);
+        kernels.blend_row(indices, palette, actual);
+        mismatches += count_different_bytes(expected, actual, sizeof(expected));
+    }
+
+    // Every length, for the tails past the last whole vector
+    std::vector<uint8_t> expected_row(PPU::SCREEN_W * 4);
+    std::vector<uint8_t> actual_row(PPU::SCREEN_W * 4);
+    for (int count = 0; count <= PPU::SCREEN_W; ++count)
+    {
+        auto src = pool.pixels.data() + count * PPU::SCREEN_W * 4;
+        auto dst = pool.pixels.data() + (count + 1) * PPU::SCREEN_W * 4;
+        memcpy(expected_row.data(), dst, expected_row.size());
+        memcpy(actual_row.data(), dst, actual_row.size());
+        scalar.blend_pixels(src, expected_row.data(), count);
+        kernels.blend_pixels(src, actual_row.data(), count);
+        mismatches += count_different_bytes(expected_row.data(), actual_row.data(), expected_row.size());
+    }
+
+    return mismatches;
+}
+
+
+static double get_mpixels_per_second(int64_t pixel_count, std::chrono::high_resolution_clock::time_point start_time)
+{
+    auto end_time = std::chrono::high_resolution_clock::now();
+    double seconds = std::chrono::duration<double>(end_time - start_time).count();
+    return seconds > 0.0 ? (double)pixel_count / seconds / 1000000.0 : 0.0;
+}
+
+
+struct kernel_rates_t
+{
+    double expand_row = 0.0; // Mpixels/s
+    double blend_row = 0.0;
+    double blend_pixels = 0.0;
+};
+
+
+// One timing pass, keeps the best rates
+static void time_pixel_kernels(const pixel_kernels_t& kernels, const row_pool_t& pool, int row_count, kernel_rates_t* rates)
+{
+    std::vector<uint8_t> dst(ROW_POOL_SIZE * 8 * 4);
+    std::vector<uint8_t> screen_row(pool.pixels.begin(), pool.pixels.begin() + PPU::SCREEN_W * 4);
+    int64_t pixel_count = (int64_t)row_count * 8;
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < row_count; ++i)
+    {
+        int row = i % ROW_POOL_SIZE;
+        kernels.expand_row(pool.indices.data() + row * 8, pool.palettes.data() + row * 4, dst.data() + row * 8 * 4);
+    }
+    rates->expand_row = std::max(rates->expand_row, get_mpixels_per_second(pixel_count, start_time));
+
+    start_time = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < row_count; ++i)
+    {
+        int row = i % ROW_POOL_SIZE;
+        kernels.blend_row(pool.indices.data() + row * 8, pool.palettes.data() + row * 4, dst.data() + row * 8 * 4);
+    }
+    rates->blend_row = std::max(rates->blend_row, get_mpixels_per_second(pixel_count, start_time));
+
+    // The same pixel count, a screen row at a time
+    int screen_row_count = (int)(pixel_count / PPU::SCREEN_W);
+    start_time = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < screen_row_count; ++i)
+    {
+        int row = i % ROW_POOL_SIZE;
+        kernels.blend_pixels(pool.pixels.data() + row * PPU::SCREEN_W * 4, screen_row.data(), PPU::SCREEN_W);
+    }
+    rates->blend_pixels = std::max(rates->blend_pixels, get_mpixels_per_second((int64_t)screen_row_count * PPU::SCREEN_W, start_time));
+}
+
+
+static void print_kernel_rates(const pixel_kernels_t& kernels, const kernel_rates_t& rates)
+{
+    printf("Pixel kernels: %s expand_row %.0f, blend_row %.0f, blend_pixels %.0f Mpixels/s\n", kernels.name, rates.expand_row, rates.blend_row, rates.blend_pixels);
+}
+
+
+// A SIMD kernel only earns its place by beating the scalar one, get_pixel_kernels() picks them all
+static bool check_kernel_rate(const pixel_kernels_t& kernels, const char* kernel_name, double rate, double scalar_rate)
+{
+    if (rate >= scalar_rate) return true;
+
+    printf("Pixel kernels: %s %s is slower than scalar, %.0f against %.0f Mpixels/s\n", kernels.name, kernel_name, rate, scalar_rate);
+    return false;
+}
+
+
+static bool bench_pixel_kernels(int row_count)
+{
+    auto pool = make_row_pool();
+    auto simd = get_simd_pixel_kernels();
+
+    // Best of a few passes, taking turns, so a cold start or a busy host doesn't pick the winner
+    kernel_rates_t scalar_rates;
+    kernel_rates_t simd_rates;
+    for (int pass = 0; pass < TIMING_PASSES; ++pass)
+    {
+        time_pixel_kernels(get_scalar_pixel_kernels(), pool, row_count, &scalar_rates);
+        if (simd) time_pixel_kernels(*simd, pool, row_count, &simd_rates);
+    }
+
+    print_kernel_rates(get_scalar_pixel_kernels(), scalar_rates);
+    if (!simd)
+    {
+        printf("Pixel kernels: no SIMD kernels on this CPU\n");
+        return true;
+    }
+    print_kernel_rates(*simd, simd_rates);
+
+    bool success = true;
+    int mismatches = compare_pixel_kernels(*simd, pool);
+    if (mismatches)
+    {
+        printf("Pixel kernels: %s writes %d bytes different from scalar\n", simd->name, mismatches);
+        success = false;
+    }
+    else
+    {
+        printf("Pixel kernels: %s matches scalar byte for byte\n", simd->name);
+    }
+
+    success = check_kernel_rate(*simd, "expand_row", simd_rates.expand_row, scalar_rates.expand_row) && success;
+    success = check_kernel_rate(*simd, "blend_row", simd_rates.blend_row, scalar_rates.blend_row) && success;
+    success = check_kernel_rate(*simd, "blend_pixels", simd_rates.blend_pixels, scalar_rates.blend_pixels) && success;
+    return success;
+}
+
+
+static void print_usage()
+{
+    printf("Usage: CoreBench [--frames <n>] [--rows <n>]\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    int frame_count = 600;
+    int row_count = 4000000;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--frames") == 0 && has_value) frame_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rows") == 0 && has_value) row_count = atoi(argv[++i]);
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (frame_count <= 0 || row_count <= 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    set_error_handler([](const std::string& title, const std::string& message)
+    {
+        fprintf(stderr, "%s: %s\n", title.c_str(), message.c_str());
+        exit(1);
+    });
+
+    int result = 0;
+    if (!bench_ppu(frame_count)) result = 1;
+    if (!bench_pixel_kernels(row_count)) result = 1;
+    return result;
+}
@@ -1,9 +1,11 @@
 #include "Daxanadu.h"
 #include "AP.h"
 #include "APU.h"
+#include "APUAudioOutput.h"
 #include "Cart.h"
 #include "Controller.h"
 #include "Emulator.h"
+#include "EmulatorRenderer.h"
 #include "ExternalInterface.h"
 #include "GameplayInputContext.h"
 #include "MenuInputContext.h"
@@ -14,9 +16,11 @@
 #include "RAM.h"
 #include "RoomWatcher.h"
 #include "SoundRenderer.h"
+#include "StateFile.h"
 #include "TileDrawer.h"
 #include "version.h"
 
+#include <onut/AudioEngine.h>
 #include <onut/Files.h>
 #include <onut/Font.h>
 #include <onut/Input.h>
@@ -26,11 +30,16 @@
 #include <onut/Settings.h>
 #include <onut/SpriteBatch.h>
 
+#include <algorithm>
 #include <vector>
 
 
-static const int32_t STATE_VERSION = 8;
+static const int32_t STATE_VERSION = Emulator::STATE_VERSION;
 static const int32_t MIN_STATE_VERSION = 1;
+static const int32_t CHUNKED_STATE_VERSION = 9; // Compressed and split in chunks from then on
+
+static constexpr uint32_t DAXANADU_CHUNK = state_chunk_tag("DAX ");
+static constexpr uint32_t AP_CHUNK = state_chunk_tag("AP  ");
 
 
 Daxanadu::Daxanadu()
@@ -49,6 +58,8 @@ void Daxanadu::init()
 {
     // Reinitialize variables
     m_emulator = nullptr;
+    m_emulator_renderer = nullptr;
+    m_audio_output = nullptr;
     m_patcher = nullptr;
     m_menu_manager = nullptr;
     m_tile_drawer = nullptr;
@@ -71,13 +82,29 @@ void Daxanadu::init()
     m_emulator->get_ram()->cpu_write(0x800, 0xFF); // Input context flag
     m_emulator->get_controller()->set_input_context(nullptr);
 
+    // Rewinding takes back our "registers" and Archipelago's progress with the game: the king's gold
+    // can be collected again, items received are handed out again.
+    m_emulator->set_rewind_state_callbacks([this](StateWriter& writer)
+    {
+        serialize_chunks(writer);
+    },
+    [this](StateReader& reader)
+    {
+        uint32_t tag = 0;
+        StateReader chunk(nullptr, 0);
+        while (reader.read_chunk(&tag, &chunk))
+            deserialize_chunk(tag, chunk, STATE_VERSION);
+    });
+    m_emulator_renderer = new EmulatorRenderer(m_emulator);
+    m_audio_output = OMake<APUAudioOutput>(m_emulator->get_apu()->get_audio_stream());
+    oAudioEngine->addInstance(m_audio_output);
+
     // Create sounds
-    auto sound_renderer = new SoundRenderer(m_emulator->get_cart()->get_prg_rom(), m_emulator->get_cart()->get_prg_rom_size());
+    auto sound_samples = SoundRenderer::render_sounds(m_emulator->get_cart()->get_prg_rom(), m_emulator->get_cart()->get_prg_rom_size(), 16, 28);
     for (int i = 0; i < 28; ++i)
     {
-        m_sounds[i] = sound_renderer->render_sound(i + 16);
+        m_sounds[i] = OSound::createFromData(sound_samples[i].data(), (int)sound_samples[i].size(), 1, SoundRenderer::SAMPLE_RATE);
     }
-    delete sound_renderer;
 
     m_patcher = new Patcher(m_emulator->get_cart()->get_prg_rom());
     m_tile_drawer = new TileDrawer(m_emulator->get_cart()->get_prg_rom(), m_emulator->get_ppu());
@@ -310,7 +337,7 @@ void Daxanadu::init()
     {
         if (m_ap) a = m_ap->remap_sound(a);
         a--;
-        if (a < 28)
+        if (a < 28 && !m_emulator->get_apu()->get_audio_stream()->get_muted()) // Muted along with the music while fast forwarding
         {
             if (m_active_sound)
                 m_active_sound->stop();
@@ -327,6 +354,9 @@ void Daxanadu::init()
 
 void Daxanadu::cleanup()
 {
+    m_emulator->set_threaded(false); // Its callbacks use what's deleted below
+    m_emulator->stop_turbo();
+
     delete m_ap;
     delete m_gameplay_input_context;
     delete m_menu_input_context;
@@ -335,6 +365,7 @@ void Daxanadu::cleanup()
     delete m_menu_manager;
     delete m_tile_drawer;
     delete m_patcher;
+    delete m_emulator_renderer;
     delete m_emulator;
 }
 
@@ -360,30 +391,120 @@ void Daxanadu::update_volumes()
 }
 
 
-void Daxanadu::serialize(FILE* f, int version) const
+void Daxanadu::update_audio_latency()
+{
+    int target_latency = 25;
+    try
+    {
+        target_latency = std::stoi(oSettings->getUserSetting("audio_target_latency"));
+    } catch (...) {}
+
+    // With the audio as the master clock, the emulation does the adjusting. Resampling as well would fight it.
+    bool audio_clock_master = oSettings->getUserSetting("audio_clock_master") == "1";
+    m_emulator->set_audio_clock_master(audio_clock_master, (float)target_latency);
+    m_emulator->get_apu()->get_audio_stream()->set_adaptive_latency(!audio_clock_master && oSettings->getUserSetting("audio_adaptive_latency") == "1", (float)target_latency);
+}
+
+
+void Daxanadu::render_audio_stats()
+{
+    auto stats = m_emulator->get_apu()->get_audio_stream()->get_stats();
+
+    char text[512];
+    snprintf(text, sizeof(text),
+        "Audio latency: %.1f ms\n"
+        "Queued: %d samples, %d writes\n"
+        "Callback: %.0f us (max %.0f us)\n"
+        "Rate adjust: %+.2f%%\n"
+        "Underruns: %u, resyncs: %u, skipped: %u",
+        stats.latency_ms,
+        stats.queued_samples, stats.queued_writes,
+        stats.callback_us, stats.max_callback_us,
+        stats.rate_adjust * 100.0f,
+        stats.underruns, stats.resyncs, stats.skipped_buffers);
+
+    auto font = OGetFont("font.fnt");
+    oSpriteBatch->begin();
+    oSpriteBatch->drawText(font, text, { 0.0f, 0.0f }, OTopLeft);
+    oSpriteBatch->end();
+}
+
+
+void Daxanadu::serialize(StateWriter& writer, int version) const
 {
-    fwrite(&m_king_gave_money, 1, 1, f);
+    writer.write(&m_king_gave_money, 1);
 
     // Useless, legacy
     uint8_t saved_while_medidating = 0;
-    fwrite(&saved_while_medidating, 1, 1, f);
-
-    if (m_ap) m_ap->serialize(f, version);
+    writer.write(&saved_while_medidating, 1);
 }
 
 
-void Daxanadu::deserialize(FILE* f, int version)
+void Daxanadu::deserialize(StateReader& reader, int version)
 {
     if (version < 3) return;
-    fread(&m_king_gave_money, 1, 1, f);
+    reader.read(&m_king_gave_money, 1);
     if (version >= 6)
     {
         // Useless, legacy
         uint8_t saved_while_medidating = 0;
-        fread(&saved_while_medidating, 1, 1, f);
+        reader.read(&saved_while_medidating, 1);
     }
+}
+
 
-    if (m_ap) m_ap->deserialize(f, version);
+bool Daxanadu::deserialize_chunks(StateReader& reader, int version)
+{
+    // Check them all before applying any, so a corrupt file leaves the game as it was
+    std::vector<std::pair<uint32_t, StateReader>> chunks;
+    uint32_t tag = 0;
+    StateReader chunk(nullptr, 0);
+    while (reader.read_chunk(&tag, &chunk))
+        chunks.push_back({ tag, chunk });
+    if (reader.get_position() != reader.get_size()) return false;
+    for (auto required_tag : Emulator::get_required_chunks())
+    {
+        auto it = std::find_if(chunks.begin(), chunks.end(), [required_tag](const auto& tagged_chunk) { return tagged_chunk.first == required_tag; });
+        if (it == chunks.end()) return false; // As bad as corrupt, the game can't go on from what's there
+    }
+
+    // Older chunks are migrated by their component's deserialize(). Unknown ones, from a newer version, are skipped.
+    for (auto& tagged_chunk : chunks)
+    {
+        if (m_emulator->deserialize_chunk(tagged_chunk.first, tagged_chunk.second, version)) continue;
+        if (deserialize_chunk(tagged_chunk.first, tagged_chunk.second, version)) continue;
+        OLog("Skipped unknown state chunk");
+    }
+
+    return true;
+}
+
+
+void Daxanadu::serialize_chunks(StateWriter& writer) const
+{
+    writer.begin_chunk(DAXANADU_CHUNK);
+    serialize(writer, STATE_VERSION);
+    writer.end_chunk();
+    if (m_ap)
+    {
+        writer.begin_chunk(AP_CHUNK);
+        m_ap->serialize(writer, STATE_VERSION);
+        writer.end_chunk();
+    }
+}
+
+
+bool Daxanadu::deserialize_chunk(uint32_t tag, StateReader& reader, int version)
+{
+    if (tag == DAXANADU_CHUNK)
+        deserialize(reader, version);
+    else if (tag == AP_CHUNK)
+    {
+        if (m_ap) m_ap->deserialize(reader, version);
+    }
+    else
+        return false;
+    return true;
 }
 
 
@@ -400,18 +521,13 @@ void Daxanadu::save_state(int slot)
 		onut::createFolder("save_states");
 	}
 
-    FILE* f = fopen(filename.c_str(), "wb");
-    if (!f)
-    {
-        onut::showMessageBox("Error", "Failed to open file: " + filename);
-        return;
-    }
+    // Snapshot in memory, the file is written in the background
+    m_state_writer.clear();
+    m_state_writer.write(&STATE_VERSION, sizeof(STATE_VERSION));
+    m_emulator->serialize_chunks(m_state_writer);
+    serialize_chunks(m_state_writer);
+    m_state_file_writer.write(filename, m_state_writer.get_data(), m_state_writer.get_size());
 
-    fwrite(&STATE_VERSION, sizeof(STATE_VERSION), 1, f);
-    m_emulator->serialize(f, STATE_VERSION);
-    serialize(f, STATE_VERSION);
-    fclose(f);
-    
     OLog("State " + std::to_string(slot) + " saved");
 }
 
@@ -429,6 +545,8 @@ void Daxanadu::load_state(int slot)
 
 void Daxanadu::load_state(int slot, const std::string& filename)
 {
+    m_state_file_writer.flush(); // It could still be on its way
+
     FILE* f = fopen(filename.c_str(), "rb");
     if (!f)
     {
@@ -436,19 +554,48 @@ void Daxanadu::load_state(int slot, const std::string& filename)
         return;
     }
 
-    int32_t version;
-    fread(&version, sizeof(version), 1, f);
+    // Read it whole, then deserialize from memory
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    std::vector<uint8_t> data(size > 0 ? (size_t)size : 0);
+    data.resize(fread(data.data(), 1, data.size(), f));
+    fclose(f);
+    if (StateFile::is_compressed(data.data(), data.size()))
+    {
+        std::vector<uint8_t> state;
+        if (!StateFile::decompress(data.data(), data.size(), &state))
+        {
+            onut::showMessageBox("Error", "Failed to open file: " + filename + "\nThe file is corrupt.");
+            return;
+        }
+        data.swap(state);
+    }
+    StateReader reader(data.data(), data.size());
+
+    int32_t version = 0;
+    reader.read(&version, sizeof(version));
 
     if (version < MIN_STATE_VERSION)
     {
-        fclose(f);
         onut::showMessageBox("Error", "Failed to open file: " + filename + "\nWrong version. File version: " + std::to_string(version) + ", expected: " + std::to_string(STATE_VERSION));
         return;
     }
 
-    m_emulator->deserialize(f, version);
-    deserialize(f, version);
-    fclose(f);
+    if (version >= CHUNKED_STATE_VERSION)
+    {
+        if (!deserialize_chunks(reader, version))
+        {
+            onut::showMessageBox("Error", "Failed to open file: " + filename + "\nThe file is corrupt.");
+            return;
+        }
+    }
+    else
+    {
+        m_emulator->deserialize(reader, version);
+        deserialize(reader, version);
+        if (m_ap) m_ap->deserialize(reader, version);
+    }
 
     //if (m_loading_continue_state)
     //{
@@ -465,13 +612,45 @@ void Daxanadu::load_state(int slot, const std::string& filename)
 void Daxanadu::update(float dt)
 {
     // Reset everything
-    if (OInputJustPressed(OKeyF5) || m_need_reset)
+    bool need_reset = OInputJustPressed(OKeyF5);
+    {
+        auto state_lock = m_emulator->lock_state();
+        need_reset |= m_need_reset;
+    }
+    if (need_reset)
     {
         cleanup();
         init();
         return;
     }
 
+    std::string failed_filename;
+    while (m_state_file_writer.pop_error(&failed_filename))
+    {
+        onut::showMessageBox("Error", "Failed to write file: " + failed_filename);
+    }
+
+    // The emulation thread, and fast forward, read the inputs from their snapshots
+    m_gameplay_input_context->take_snapshot();
+    m_menu_input_context->take_snapshot();
+    m_new_game_input_context->take_snapshot();
+    m_emulator->set_threaded(oSettings->getUserSetting("emulation_thread") == "1");
+    bool turbo = OInputPressed(OKeyLeftShift);
+    if (turbo && !m_emulator->is_turbo())
+    {
+        int render_interval = 8;
+        try
+        {
+            render_interval = std::stoi(oSettings->getUserSetting("turbo_render_interval"));
+        } catch (...) {}
+        m_emulator->start_turbo(render_interval, oSettings->getUserSetting("turbo_audio_stretch") != "1");
+    }
+    else if (!turbo && m_emulator->is_turbo())
+    {
+        m_emulator->stop_turbo();
+    }
+    auto state_lock = m_emulator->lock_state();
+
     if (m_ap)
     {
         m_ap->update(dt);
@@ -508,6 +687,36 @@ void Daxanadu::update(float dt)
         load_state(0);
     }
 
+    m_emulator->set_fast_cpu(oSettings->getUserSetting("fast_cpu") == "1");
+    m_emulator->get_ppu()->set_compose_screen(oSettings->getUserSetting("software_compositor") == "1");
+
+    int frame_skip = 2;
+    try
+    {
+        frame_skip = std::stoi(oSettings->getUserSetting("frame_skip"));
+    } catch (...) {}
+    m_emulator->set_frame_pacing(oSettings->getUserSetting("frame_pacing") == "1", frame_skip);
+
+    // Rewind, while held
+    int rewind_interval = 1;
+    int rewind_buffer_mb = 32;
+    try
+    {
+        rewind_interval = std::stoi(oSettings->getUserSetting("rewind_interval"));
+        rewind_buffer_mb = std::stoi(oSettings->getUserSetting("rewind_buffer_mb"));
+    } catch (...) {}
+    m_emulator->set_rewind(oSettings->getUserSetting("rewind") == "1", rewind_interval, (size_t)std::max(rewind_buffer_mb, 0) * 1024 * 1024);
+    m_emulator->set_rewinding(OInputPressed(OKeyBackspace) && !m_emulator->is_turbo());
+
+    // Run-ahead, in frames
+    int run_ahead = 0;
+    try
+    {
+        run_ahead = std::stoi(oSettings->getUserSetting("run_ahead"));
+    } catch (...) {}
+    m_emulator->set_run_ahead(run_ahead);
+
+    update_audio_latency();
     m_emulator->update(dt);
     m_menu_manager->update(dt);
     m_room_watcher->update(dt);
@@ -518,11 +727,17 @@ void Daxanadu::update(float dt)
 
 void Daxanadu::render()
 {
-    m_emulator->render();
+    // The emulator's screen comes from the last frame it published, no need to hold it
+    m_emulator_renderer->render();
+
+    auto state_lock = m_emulator->lock_state();
     m_menu_manager->render();
     m_room_watcher->render();
     if (m_ap) m_ap->render();
 
+    if (oSettings->getUserSetting("audio_stats") == "1")
+        render_audio_stats();
+
     // Version
     {
         auto font = OGetFont("font.fnt");
@@ -1,16 +1,22 @@
 #pragma once
 
+#include "StateBuffer.h"
+#include "StateFileWriter.h"
+
 #include <onut/ForwardDeclaration.h>
 
 #include <stdio.h>
 #include <cinttypes>
+#include <memory>
 #include <string>
 
 
 OForwardDeclare(Sound);
 OForwardDeclare(SoundInstance);
 class AP;
+class APUAudioOutput;
 class Emulator;
+class EmulatorRenderer;
 class MenuManager;
 class Patcher;
 class RoomWatcher;
@@ -35,15 +41,24 @@ private:
     void init();
     void cleanup();
     void update_volumes();
+    void update_audio_latency();
+    void render_audio_stats();
+
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
+    bool deserialize_chunks(StateReader& reader, int version); // False if corrupt
 
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    // Ours and Archipelago's, after the emulator's in save files and rewind snapshots
+    void serialize_chunks(StateWriter& writer) const;
+    bool deserialize_chunk(uint32_t tag, StateReader& reader, int version); // False for a tag that isn't one of them
 
     void save_state(int slot);
     void load_state(int slot);
     void load_state(int slot, const std::string& filename);
 
     Emulator* m_emulator = nullptr;
+    EmulatorRenderer* m_emulator_renderer = nullptr;
+    std::shared_ptr<APUAudioOutput> m_audio_output;
     Patcher* m_patcher = nullptr;
     MenuManager* m_menu_manager = nullptr;
     TileDrawer* m_tile_drawer = nullptr;
@@ -58,6 +73,8 @@ private:
     float m_music_volume = 1.0f;
     AP* m_ap = nullptr;
     bool m_need_reset = false;
+    StateWriter m_state_writer; // Kept between saves, so they don't allocate
+    StateFileWriter m_state_file_writer; // Kept across resets, so pending saves aren't waited on
 
     // Extra Daxanadu ram "registers"
     uint8_t m_king_gave_money = 0;
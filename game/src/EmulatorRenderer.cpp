@@ -0,0 +1,256 @@
+#include "EmulatorRenderer.h"
+#include "CPU.h"
+#include "Emulator.h"
+#include "PPU.h"
+#include "RAM.h"
+
+#include <onut/Font.h>
+#include <onut/Renderer.h>
+#include <onut/SpriteBatch.h>
+#include <onut/Texture.h>
+
+#include <imgui/imgui.h>
+
+#include <cmath>
+#include <memory.h>
+
+
+EmulatorRenderer::EmulatorRenderer(Emulator* emulator)
+    : m_emulator(emulator)
+{
+    auto ppu = m_emulator->get_ppu();
+
+    m_screen_texture = OTexture::createRenderTarget({ PPU::SCREEN_W, PPU::SCREEN_H });
+    m_frame_texture = OTexture::createDynamic({ PPU::SCREEN_W, PPU::SCREEN_H });
+    m_frame_texture->setData(ppu->get_screen_pixels());
+    for (int i = 0; i < 2; ++i)
+    {
+        m_sprite_textures[i] = OTexture::createDynamic({ PPU::SCREEN_W, PPU::SCREEN_H });
+        m_sprite_textures[i]->setData(ppu->get_sprite_pixels(i));
+        m_chr_textures[i] = OTexture::createDynamic({ 128, 128 });
+        m_chr_textures[i]->setData(ppu->get_pattern_pixels(i));
+        m_nametable_textures[i] = OTexture::createDynamic({ PPU::SCREEN_W, PPU::SCREEN_H });
+        m_nametable_textures[i]->setData(ppu->get_nametable_pixels(i));
+    }
+}
+
+
+void EmulatorRenderer::render()
+{
+    oRenderer->clear(Color(0.1f));
+    oRenderer->renderStates.sampleFiltering = OFilterNearest;
+
+    const PPU::frame_t& frame = m_emulator->get_ppu()->acquire_frame();
+    upload_screen(frame);
+    render_screen(frame);
+    render_ram();
+
+#if 0
+    auto font = OGetFont("font.fnt");
+    oSpriteBatch->begin();
+    char buf[260];
+    snprintf(buf, 260, "PC: 0x%02X", m_emulator->get_cpu()->get_pc());
+    oSpriteBatch->drawText(font, buf, Vector2(50, 0));
+    oSpriteBatch->end();
+#endif
+}
+
+
+void EmulatorRenderer::upload_screen(const PPU::frame_t& frame)
+{
+    if (frame.compose_screen)
+    {
+        // One texture for the whole frame
+        if (frame.screen_version != m_uploaded_screen_version)
+        {
+            m_uploaded_screen_version = frame.screen_version;
+            m_frame_texture->setData(frame.screen_pixels);
+        }
+        return;
+    }
+
+    // Only upload the layers the PPU touched since last render
+    for (int i = 0; i < 2; ++i)
+    {
+        if (frame.sprite_versions[i] != m_uploaded_sprite_versions[i])
+        {
+            m_uploaded_sprite_versions[i] = frame.sprite_versions[i];
+            m_sprite_textures[i]->setData(frame.sprite_pixels[i]);
+        }
+        if (frame.pattern_versions[i] != m_uploaded_chr_versions[i])
+        {
+            m_uploaded_chr_versions[i] = frame.pattern_versions[i];
+            m_chr_textures[i]->setData(frame.pattern_pixels[i]);
+        }
+        if (frame.nametable_versions[i] != m_uploaded_nametable_versions[i])
+        {
+            m_uploaded_nametable_versions[i] = frame.nametable_versions[i];
+            m_nametable_textures[i]->setData(frame.nametable_pixels[i]);
+        }
+    }
+}
+
+
+void EmulatorRenderer::render_screen(const PPU::frame_t& frame)
+{
+    auto res = OScreenf;
+    float scale = std::floor(res.y / (float)PPU::SCREEN_H);
+
+    OTextureRef final_texture = m_frame_texture;
+    if (!frame.compose_screen)
+    {
+        compose_screen(frame);
+        final_texture = m_screen_texture;
+    }
+
+    // Draw final image
+    oSpriteBatch->begin();
+    oSpriteBatch->drawSpriteWithUVs(final_texture, OScreenCenterf, 
+                                    Vector4(0, 8.0f / (float)PPU::SCREEN_H, 1.0f, ((float)PPU::SCREEN_H - 8.0f) / (float)PPU::SCREEN_H),
+                                    Color::White, 0.0f, scale, OCenter);
+#if defined(_DEBUG) // To be safe
+#if 0
+    oSpriteBatch->drawSprite(m_chr_textures[0], Vector2(0, 16), Color::White, 0.0f, 2.0f, OTopLeft);
+    oSpriteBatch->drawSprite(m_chr_textures[1], Vector2(0, 16 + 128 * 2 + 2), Color::White, 0.0f, 2.0f, OTopLeft);
+    oSpriteBatch->drawSprite(m_nametable_textures[0], Vector2(res.x - PPU::SCREEN_W, 16), Color::White, OTopLeft);
+    oSpriteBatch->drawSprite(m_nametable_textures[1], Vector2(res.x - PPU::SCREEN_W, 16 + PPU::SCREEN_H + 2), Color::White, OTopLeft);
+#endif
+#endif
+    oSpriteBatch->end();
+}
+
+
+void EmulatorRenderer::compose_screen(const PPU::frame_t& frame)
+{
+    float display_scroll_h = (float)frame.display_scroll_h;
+    uint8_t clear_color[4]; // Packed RGBA
+    memcpy(clear_color, &frame.clear_color, 4);
+
+    oRenderer->renderStates.renderTargets[0].push(m_screen_texture);
+    oRenderer->clear(OColorRGB(clear_color[0], clear_color[1], clear_color[2]));
+    oSpriteBatch->begin();
+    
+    // Draw background sprites
+    oSpriteBatch->drawSprite(m_sprite_textures[0], Vector2::Zero, Color::White, OTopLeft);
+
+    // Render the nametables to the render target.
+    oSpriteBatch->drawRectWithUVs(m_nametable_textures[0], 
+                                    Rect(-display_scroll_h, 32.0f, (float)PPU::SCREEN_W, (float)PPU::SCREEN_H - 32.0f),
+                                    Vector4(0, 32.0f / (float)PPU::SCREEN_H, 1, 1), Color::White);
+    oSpriteBatch->drawRectWithUVs(m_nametable_textures[1], 
+                                    Rect((float)PPU::SCREEN_W - display_scroll_h, 32.0f, (float)PPU::SCREEN_W, (float)PPU::SCREEN_H - 32.0f),
+                                    Vector4(0, 32.0f / (float)PPU::SCREEN_H, 1, 1), Color::White);
+    oSpriteBatch->drawRectWithUVs(m_nametable_textures[0], 
+                                    Rect(-display_scroll_h + (float)PPU::SCREEN_W * 2, 32.0f, (float)PPU::SCREEN_W, (float)PPU::SCREEN_H - 32.0f),
+                                    Vector4(0, 32.0f / (float)PPU::SCREEN_H, 1, 1), Color::White);
+
+    // The top part is always at scroll 0
+    oSpriteBatch->drawRectWithUVs(m_nametable_textures[0], Rect(0, 0, (float)PPU::SCREEN_W, 32.0f), Vector4(0, 0, 1, 32.0f / (float)PPU::SCREEN_H), Color::White);
+
+    // Draw foreground sprites
+    oSpriteBatch->drawSprite(m_sprite_textures[1], Vector2::Zero, Color::White, OTopLeft);
+
+    oSpriteBatch->end();
+    oRenderer->renderStates.renderTargets[0].pop();
+}
+
+
+void EmulatorRenderer::render_ram()
+{
+#if defined(_DEBUG)
+    auto state_lock = m_emulator->lock_state();
+    auto ram = m_emulator->get_ram();
+
+    if (ImGui::Begin("RAM"))
+    {
+        ImGui::Text("Quests: 0x%02X", (int)ram->get(0x042D));
+        ImGui::Text("Input Context: 0x%02X", (int)ram->get(0x0800));
+
+        ImGui::Separator();
+        ImGui::Text("Weapon: 0x%02X", (int)ram->get(0x03BD));
+        ImGui::Text("Armor: 0x%02X", (int)ram->get(0x03BE));
+        ImGui::Text("Shield: 0x%02X", (int)ram->get(0x03BF));
+        ImGui::Text("Magic: 0x%02X", (int)ram->get(0x03C0));
+        ImGui::Text("Item: 0x%02X", (int)ram->get(0x03C1));
+
+        if (ImGui::TreeNodeEx("Items:", ImGuiTreeNodeFlags_DefaultOpen))
+        {
+            for (int i = 0; i < (int)ram->get(0x03C6); ++i)
+                ImGui::Text("0x%02X", (int)ram->get(0x03AD + i));
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNodeEx("Commons:", ImGuiTreeNodeFlags_DefaultOpen))
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                if (ram->get(0x03B5 + i) == 0) break;
+                ImGui::Text("0x%02X  (%i)", (int)ram->get(0x03B5 + i), (int)ram->get(0x03B9 + i));
+            }
+            ImGui::TreePop();
+        }
+
+        if (ImGui::TreeNodeEx("Active entities:"))
+        {
+            for (int i = 0; i < 8; ++i)
+            {
+                if (ram->get(0x02CC + i) == 0xFF) continue;
+                ImGui::Text("ID: 0x%02X - 0x%02X", (int)ram->get(0x02CC + i), (int)ram->get(0x02D4 + i));
+                ImGui::Text("Position: %i, %i", (int)ram->get(0x00BA + i), (int)ram->get(0x00C2 + i));
+                auto flags = ram->get(0x02DC + i);
+                ImGui::Text("Flags: 0x%02X", (int)flags);
+                ImGui::Text("Visible: %s", (flags & 0x10) ? "false" : "true");
+                ImGui::Text("Phase: 0x%02X - 0x%02X", (int)ram->get(0x02E4 + i), (int)ram->get(0x02EC + i));
+                int behaviour_addr = ((int)ram->get(0x035C + i) << 8) | ram->get(0x0354 + i);
+                ImGui::Text("Behaviour: 0x%04X", behaviour_addr);
+                ImGui::Text("Message: 0x%02X", (int)ram->get(0x036C + i));
+                ImGui::Separator();
+            }
+            ImGui::TreePop();
+        }
+    }
+    ImGui::End();
+
+#if SHOW_RAM
+    // Ram inspection
+    {
+        auto sb = oSpriteBatch.get();
+        float start_x = OScreenWf - 64 * 9 - 8.0f;
+        float x = start_x;
+        float y = 8.0f;
+
+        sb->begin();
+
+        sb->drawRect(nullptr, Rect(x - 1, y - 1, 64 * 9 + 1, 128 * 9 + 1), Color(0.5f, 0.25f, 0.35f, 1.0f));
+        for (int j = 0; j < 32; ++j)
+        {
+            sb->drawRect(nullptr, Rect(x - 1, y + (float)j * 4 * 9 - 1, 64 * 9, 1), Color(0.75f, 0.5f, 0.7f, 1.0f));
+        }
+
+#define WATCH(addr) sb->drawRect(nullptr, Rect(start_x + (float)((addr) % 64) * 9 - 1, y + (float)((addr) / 64) * 9 - 1, 10, 10), Color(1, 1, 0, 1))
+
+        for (int i = 0; i < 8; ++i)
+        {
+            WATCH(0x03B5 + i);
+        }
+
+        const float* usage = ram->get_usage();
+        float r = 0.0f;
+        float gb = 0.0f;
+        for (int j = 0; j < 128; ++j)
+        {
+            for (int i = 0; i < 64; ++i, ++usage, x += 9)
+            {
+                r = *usage;
+                gb = *usage - 1.0f;
+                sb->drawRect(nullptr, Rect(x, y, 8, 8), Color(r, gb, gb, 1.0f));
+            }
+            x = start_x;
+            y += 9;
+        }
+
+        sb->end();
+    }
+#endif
+#endif
+}
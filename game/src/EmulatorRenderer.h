@@ -0,0 +1,39 @@
+#pragma once
+
+#include "PPU.h"
+
+#include <onut/ForwardDeclaration.h>
+
+
+OForwardDeclare(Texture);
+class Emulator;
+
+
+// Presents the emulator core's output with onut. Either uploads the frame
+// the PPU composited in software, or uploads the PPU layers that changed
+// since last render and composites them on the GPU. Reads the frames the
+// PPU publishes, so it doesn't hold up the emulation thread.
+class EmulatorRenderer final
+{
+public:
+    EmulatorRenderer(Emulator* emulator);
+
+    void render();
+
+private:
+    void upload_screen(const PPU::frame_t& frame);
+    void render_screen(const PPU::frame_t& frame);
+    void compose_screen(const PPU::frame_t& frame);
+    void render_ram();
+
+    Emulator* m_emulator = nullptr;
+    int m_uploaded_sprite_versions[2] = { -1, -1 };
+    int m_uploaded_chr_versions[2] = { -1, -1 };
+    int m_uploaded_nametable_versions[2] = { -1, -1 };
+    int m_uploaded_screen_version = -1;
+    OTextureRef m_screen_texture;
+    OTextureRef m_frame_texture; // Composited by the PPU
+    OTextureRef m_sprite_textures[2]; // Background then foreground
+    OTextureRef m_chr_textures[2];
+    OTextureRef m_nametable_textures[2];
+};
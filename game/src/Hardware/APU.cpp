@@ -1,27 +1,35 @@
 #include "APU.h"
 
-#include <onut/AudioEngine.h>
+#include <algorithm>
+#include <chrono>
+#include <memory.h>
 
 
-static const int CPU_CLOCK_SPEED = 1789773;
+static const int CPU_CLOCK_SPEED = APUSynth<BlipBuffer>::CPU_CLOCK_SPEED;
+static const int64_t MAX_WRITE_SKEW = CPU_CLOCK_SPEED / 60; // Re-anchor the write timestamps past one frame of drift
+static const double LATENCY_SMOOTHING = 0.05; // Per buffer
+static const double RATE_PROPORTIONAL_GAIN = 0.5;
+static const double RATE_INTEGRAL_GAIN = 0.002; // Per buffer
 
 
 APU::APU()
 {
-    m_audio_stream = OMake<APUAudioStream>();
-    oAudioEngine->addInstance(m_audio_stream);
+    m_audio_stream = std::make_shared<APUAudioStream>();
 }
 
 
-void APU::serialize(FILE* f, int version) const
+void APU::serialize(StateWriter& writer, int version) const
 {
-    m_audio_stream->serialize(f, version);
+    m_audio_stream->serialize(writer, version);
 }
 
 
-void APU::deserialize(FILE* f, int version)
+void APU::deserialize(StateReader& reader, int version)
 {
-    m_audio_stream->deserialize(f, version);
+    m_audio_stream->deserialize(reader, version);
+
+    for (int i = 0; i < 0x18; ++i)
+        m_registers[i] = m_audio_stream->cpu_read(0x4000 + i);
 }
 
 
@@ -29,7 +37,10 @@ bool APU::cpu_write(uint16_t addr, uint8_t data)
 {
     if ((addr >= 0x4000 && addr <= 0x4017) && addr != 0x4016)
     {
-        m_audio_stream->cpu_write(addr, data);
+        if (addr != 0x4014) // OAM DMA, not ours
+            m_registers[addr - 0x4000] = data;
+        if (!m_skip_stream)
+            m_audio_stream->cpu_write(m_cpu_cycle, addr, data);
         return true;
     }
 
@@ -37,11 +48,25 @@ bool APU::cpu_write(uint16_t addr, uint8_t data)
 }
 
 
+void APU::publish_cpu_cycle(int64_t cpu_cycle)
+{
+    m_audio_stream->set_emulated_cycle(get_audio_cycle(cpu_cycle));
+}
+
+
+void APU::set_time_scale(int64_t cpu_cycle, double scale)
+{
+    m_time_base_audio_cycle = get_audio_cycle(cpu_cycle);
+    m_time_base_cpu_cycle = cpu_cycle;
+    m_time_scale = scale;
+}
+
+
 bool APU::cpu_read(uint16_t addr, uint8_t* out_data)
 {
     if ((addr >= 0x4000 && addr <= 0x4017) && addr != 0x4016)
     {
-        *out_data = m_audio_stream->cpu_read(addr);
+        *out_data = m_registers[addr - 0x4000];
         return true;
     }
 
@@ -50,357 +75,95 @@ bool APU::cpu_read(uint16_t addr, uint8_t* out_data)
 
 
 APUAudioStream::APUAudioStream()
+    : m_synth(&m_blip)
 {
-    m_60hz_rate = (1000000.0 / (double)16666) / (double)CPU_CLOCK_SPEED;
-    m_120hz_rate = m_60hz_rate * 2.0;
-    m_240hz_rate = m_120hz_rate * 2.0;
+    m_max_write_skew = MAX_WRITE_SKEW;
 }
 
 
-static const int LENGTH_COUNTER_TABLE[0x1F + 1] = {
-    10, 254, 20, 2,
-    40, 4, 80, 6,
-    160, 8, 60, 10,
-    14, 12, 26, 14,
-    12, 16, 24, 18,
-    48, 20, 96, 22,
-    192, 24, 72, 26,
-    16, 28, 32, 30
-};
-
-static const double NOISE_FREQUENCY_TABLE[16] = {
-    4, 8, 16, 32, 
-    64, 96, 128, 160, 
-    202, 254, 380, 508, 
-    762, 1016, 2034, 4068
-};
-
-
-void APUAudioStream::serialize(FILE* f, int version)
+void APUAudioStream::serialize(StateWriter& writer, int version)
 {
     std::unique_lock<std::mutex> lock(m_mutex);
+    flush_writes(); // Save what the emulation thread sees, not what was heard so far
 
-    for (int i = 0; i < 2; ++i)
-    {
-        auto pulse = &m_pulses[i];
-        
-        fwrite(&pulse->enabled, sizeof(pulse->enabled), 1, f);
-        fwrite(&pulse->loop, sizeof(pulse->loop), 1, f);
-        fwrite(&pulse->constant_volume, sizeof(pulse->constant_volume), 1, f);
-        fwrite(&pulse->duty, sizeof(pulse->duty), 1, f);
-        fwrite(&pulse->progress, sizeof(pulse->progress), 1, f);
-        fwrite(&pulse->frequency, sizeof(pulse->frequency), 1, f);
-        fwrite(&pulse->volume, sizeof(pulse->volume), 1, f);
-        fwrite(pulse->registers, 1, 4, f);
-        fwrite(&pulse->length_counter, sizeof(pulse->length_counter), 1, f);
-        fwrite(&pulse->timer, sizeof(pulse->timer), 1, f);
-        fwrite(&pulse->time, sizeof(pulse->time), 1, f);
-        fwrite(&pulse->envelope_counter, sizeof(pulse->envelope_counter), 1, f);
-        fwrite(&pulse->envelope_rate, sizeof(pulse->envelope_rate), 1, f);
-        fwrite(&pulse->envelope_progress, sizeof(pulse->envelope_progress), 1, f);
-    }
+    m_synth.serialize(writer);
 
-    fwrite(&m_triangle.enabled, sizeof(m_triangle.enabled), 1, f);
-    fwrite(&m_triangle.reload_flag, sizeof(m_triangle.reload_flag), 1, f);
-    fwrite(&m_triangle.progress, sizeof(m_triangle.progress), 1, f);
-    fwrite(&m_triangle.frequency, sizeof(m_triangle.frequency), 1, f);
-    fwrite(m_triangle.registers, 1, 4, f);
-    fwrite(&m_triangle.length_counter, sizeof(m_triangle.length_counter), 1, f);
-    fwrite(&m_triangle.control_flag, sizeof(m_triangle.control_flag), 1, f);
-    fwrite(&m_triangle.linear_counter, sizeof(m_triangle.linear_counter), 1, f);
-    fwrite(&m_triangle.timer, sizeof(m_triangle.timer), 1, f);
-    fwrite(&m_triangle.time, sizeof(m_triangle.time), 1, f);
-    fwrite(&m_triangle.reload_value, sizeof(m_triangle.reload_value), 1, f);
-
-    fwrite(&m_noise.enabled, sizeof(m_noise.enabled), 1, f);
-    fwrite(&m_noise.loop, sizeof(m_noise.loop), 1, f);
-    fwrite(&m_noise.mode, sizeof(m_noise.mode), 1, f);
-    fwrite(&m_noise.constant_volume, sizeof(m_noise.constant_volume), 1, f);
-    fwrite(&m_noise.progress, sizeof(m_noise.progress), 1, f);
-    fwrite(&m_noise.frequency, sizeof(m_noise.frequency), 1, f);
-    fwrite(&m_noise.volume, sizeof(m_noise.volume), 1, f);
-    fwrite(m_noise.registers, 1, 4, f);
-    fwrite(&m_noise.length_counter, sizeof(m_noise.length_counter), 1, f);
-    fwrite(&m_noise.period, sizeof(m_noise.period), 1, f);
-    fwrite(&m_noise.time, sizeof(m_noise.time), 1, f);
-    fwrite(&m_noise.envelope_counter, sizeof(m_noise.envelope_counter), 1, f);
-    fwrite(&m_noise.envelope_rate, sizeof(m_noise.envelope_rate), 1, f);
-    fwrite(&m_noise.envelope_progress, sizeof(m_noise.envelope_progress), 1, f);
-    fwrite(&m_noise.previous_sample, sizeof(m_noise.previous_sample), 1, f);
-    fwrite(&m_noise.shift_register, sizeof(m_noise.shift_register), 1, f);
-
-    fwrite(&m_dmc.enabled, sizeof(m_dmc.enabled), 1, f);
-    fwrite(&m_dmc.loop, sizeof(m_dmc.loop), 1, f);
-    fwrite(m_dmc.registers, 1, 4, f);
-
-    fwrite(&m_status_register, sizeof(m_status_register), 1, f);
-    fwrite(&m_frame_counter_register, sizeof(m_frame_counter_register), 1, f);
-    fwrite(&m_volume, sizeof(m_volume), 1, f);
-    fwrite(&m_cpu_progress, sizeof(m_cpu_progress), 1, f);
-    fwrite(&m_previous_filtered_sample, sizeof(m_previous_filtered_sample), 1, f);
-    fwrite(&m_previous_unfiltered_sample, sizeof(m_previous_unfiltered_sample), 1, f);
+    float volume = m_volume;
+    writer.write(&volume, sizeof(volume));
+    double sample_offset = m_blip.get_sample_offset();
+    writer.write(&sample_offset, sizeof(sample_offset));
+    writer.write(&m_filter.previous_filtered_sample, sizeof(m_filter.previous_filtered_sample));
+    writer.write(&m_filter.previous_unfiltered_sample, sizeof(m_filter.previous_unfiltered_sample));
 }
 
 
-void APUAudioStream::deserialize(FILE* f, int version)
+void APUAudioStream::deserialize(StateReader& reader, int version)
 {
     std::unique_lock<std::mutex> lock(m_mutex);
 
-    for (int i = 0; i < 2; ++i)
-    {
-        auto pulse = &m_pulses[i];
-        
-        fread(&pulse->enabled, sizeof(pulse->enabled), 1, f);
-        fread(&pulse->loop, sizeof(pulse->loop), 1, f);
-        fread(&pulse->constant_volume, sizeof(pulse->constant_volume), 1, f);
-        fread(&pulse->duty, sizeof(pulse->duty), 1, f);
-        fread(&pulse->progress, sizeof(pulse->progress), 1, f);
-        fread(&pulse->frequency, sizeof(pulse->frequency), 1, f);
-        fread(&pulse->volume, sizeof(pulse->volume), 1, f);
-        fread(pulse->registers, 1, 4, f);
-        fread(&pulse->length_counter, sizeof(pulse->length_counter), 1, f);
-        fread(&pulse->timer, sizeof(pulse->timer), 1, f);
-        fread(&pulse->time, sizeof(pulse->time), 1, f);
-        fread(&pulse->envelope_counter, sizeof(pulse->envelope_counter), 1, f);
-        fread(&pulse->envelope_rate, sizeof(pulse->envelope_rate), 1, f);
-        fread(&pulse->envelope_progress, sizeof(pulse->envelope_progress), 1, f);
-    }
+    // Writes still in flight belong to the state we're replacing
+    while (m_writes.front())
+        m_writes.pop();
+    m_write_clock_synced = false;
+    m_played_cycle = -1;
 
-    fread(&m_triangle.enabled, sizeof(m_triangle.enabled), 1, f);
-    fread(&m_triangle.reload_flag, sizeof(m_triangle.reload_flag), 1, f);
-    fread(&m_triangle.progress, sizeof(m_triangle.progress), 1, f);
-    fread(&m_triangle.frequency, sizeof(m_triangle.frequency), 1, f);
-    fread(m_triangle.registers, 1, 4, f);
-    fread(&m_triangle.length_counter, sizeof(m_triangle.length_counter), 1, f);
-    fread(&m_triangle.control_flag, sizeof(m_triangle.control_flag), 1, f);
-    fread(&m_triangle.linear_counter, sizeof(m_triangle.linear_counter), 1, f);
-    fread(&m_triangle.timer, sizeof(m_triangle.timer), 1, f);
-    fread(&m_triangle.time, sizeof(m_triangle.time), 1, f);
-    fread(&m_triangle.reload_value, sizeof(m_triangle.reload_value), 1, f);
-
-    fread(&m_noise.enabled, sizeof(m_noise.enabled), 1, f);
-    fread(&m_noise.loop, sizeof(m_noise.loop), 1, f);
-    fread(&m_noise.mode, sizeof(m_noise.mode), 1, f);
-    fread(&m_noise.constant_volume, sizeof(m_noise.constant_volume), 1, f);
-    fread(&m_noise.progress, sizeof(m_noise.progress), 1, f);
-    fread(&m_noise.frequency, sizeof(m_noise.frequency), 1, f);
-    fread(&m_noise.volume, sizeof(m_noise.volume), 1, f);
-    fread(m_noise.registers, 1, 4, f);
-    fread(&m_noise.length_counter, sizeof(m_noise.length_counter), 1, f);
-    fread(&m_noise.period, sizeof(m_noise.period), 1, f);
-    fread(&m_noise.time, sizeof(m_noise.time), 1, f);
-    fread(&m_noise.envelope_counter, sizeof(m_noise.envelope_counter), 1, f);
-    fread(&m_noise.envelope_rate, sizeof(m_noise.envelope_rate), 1, f);
-    fread(&m_noise.envelope_progress, sizeof(m_noise.envelope_progress), 1, f);
-    fread(&m_noise.previous_sample, sizeof(m_noise.previous_sample), 1, f);
-    fread(&m_noise.shift_register, sizeof(m_noise.shift_register), 1, f);
-
-    fread(&m_dmc.enabled, sizeof(m_dmc.enabled), 1, f);
-    fread(&m_dmc.loop, sizeof(m_dmc.loop), 1, f);
-    fread(m_dmc.registers, 1, 4, f);
-
-    fread(&m_status_register, sizeof(m_status_register), 1, f);
-    fread(&m_frame_counter_register, sizeof(m_frame_counter_register), 1, f);
-    fread(&m_volume, sizeof(m_volume), 1, f);
-    fread(&m_cpu_progress, sizeof(m_cpu_progress), 1, f);
-    fread(&m_previous_filtered_sample, sizeof(m_previous_filtered_sample), 1, f);
-    fread(&m_previous_unfiltered_sample, sizeof(m_previous_unfiltered_sample), 1, f);
-}
+    m_synth.deserialize(reader);
 
+    float volume = 1.0f;
+    reader.read(&volume, sizeof(volume));
+    double sample_offset = 0.0;
+    reader.read(&sample_offset, sizeof(sample_offset));
+    reader.read(&m_filter.previous_filtered_sample, sizeof(m_filter.previous_filtered_sample));
+    reader.read(&m_filter.previous_unfiltered_sample, sizeof(m_filter.previous_unfiltered_sample));
+    m_volume = volume;
 
-void APUAudioStream::cpu_write(int addr, uint8_t val)
-{
-    std::unique_lock<std::mutex> lock(m_mutex);
+    // Glide to the loaded state's level instead of popping
+    m_blip.set_sample_offset(sample_offset);
+    m_synth.resync(m_cycle);
+}
 
-    if (addr == 0x4000 || addr == 0x4004) // Pulse reg 0
-    {
-        auto pulse = &m_pulses[(addr - 0x4000) / 4];
-        pulse->registers[0] = val;
-
-        int duty = (val >> 6) & 0b11;
-        int loop = (val & 0b100000) ? 1 : 0;
-        int constant_volume = (val & 0b10000) ? 1 : 0;
-        int volume = (val & 0b1111);
-
-        pulse->constant_volume = constant_volume ? true : false;
-        pulse->duty = duty;
-        pulse->loop = loop ? true : false;
-        if (constant_volume)
-        {
-            pulse->volume = (float)volume / 15.0f;
-            pulse->envelope_counter = 0;
-            pulse->envelope_rate = 0.0;
-            pulse->envelope_progress = 0.0;
-        }
-        else
-        {
-            pulse->volume = 1.0f;
-            pulse->envelope_counter = 15;
-            pulse->envelope_rate = 1.0 / (double)(volume + 1);
-            pulse->envelope_progress = 0.0;
-        }
-    }
-    else if (addr == 0x4001 || addr == 0x4005) // Pulse reg 1
-    {
-        auto pulse = &m_pulses[(addr - 0x4001) / 4];
-        pulse->registers[1] = val;
 
-        int sweep = (val & 0b10000000) ? 1 : 0;
-        int period = (val >> 4) & 0b111;
-        int negate = (val & 0b1000) ? 1 : 0;
-        int shift = val & 0b111;
-    }
-    else if (addr == 0x4002 || addr == 0x4006) // Pulse reg 2
-    {
-        auto pulse = &m_pulses[(addr - 0x4002) / 4];
-        pulse->registers[2] = val;
+void APUAudioStream::cpu_write(int64_t cpu_cycle, int addr, uint8_t val)
+{
+    // If the audio thread stalled long enough to fill the queue, the write is dropped
+    m_writes.push({ cpu_cycle, (uint16_t)addr, val });
+}
 
-        int timer_low = val;
 
-        pulse->timer = timer_low;
-    }
-    else if (addr == 0x4003 || addr == 0x4007) // Pulse reg 3
+int64_t APUAudioStream::apply_writes()
+{
+    while (const register_write_t* write = m_writes.front())
     {
-        auto pulse = &m_pulses[(addr - 0x4003) / 4];
-        pulse->registers[3] = val;
-
-        int length_counter = (val >> 3) & 0b11111;
-        int timer_high = val & 0b111;
-
-        pulse->length_counter = LENGTH_COUNTER_TABLE[length_counter];
-        pulse->timer = pulse->timer | (timer_high << 8);
-        pulse->progress = 0.0;
-        pulse->time = 0;
-        pulse->frequency = (double)CPU_CLOCK_SPEED / (16.0 * ((double)pulse->timer + 1.0));
-        
-        if (pulse->enabled && !pulse->constant_volume)
+        int64_t cycle = write->cpu_cycle + m_write_cycle_offset;
+        if (!m_write_clock_synced || cycle < m_cycle - m_max_write_skew || cycle > m_cycle + m_max_write_skew)
         {
-            pulse->envelope_counter = 15;
-            pulse->envelope_rate = 1.0 / (double)(pulse->volume * 15.0f + 1);
-            pulse->envelope_progress = 0.0;
+            // The emulation and audio clocks drifted apart (start, pause, reset, speed change). Play this write now
+            // and keep the following ones relative to it.
+            if (m_write_clock_synced)
+                m_stats.resyncs++;
+            m_write_cycle_offset = m_cycle - write->cpu_cycle;
+            m_write_clock_synced = true;
+            m_latency_average_valid = false;
+            cycle = m_cycle;
         }
-    }
-    else if (addr == 0x4008) // Triangle reg 0
-    {
-        m_triangle.registers[0] = val;
-
-        int control_flag = (val & 0b10000000) ? 1 : 0;
-        int counter_reload = val & 0b01111111;
-
-        m_triangle.control_flag = control_flag ? true : false;
-        m_triangle.reload_value = counter_reload + 1;
-    }
-    else if (addr == 0x4009) // Triangle reg 1
-    {
-        m_triangle.registers[1] = val;
-    }
-    else if (addr == 0x400A) // Triangle reg 2
-    {
-        m_triangle.registers[2] = val;
-
-        int timer_low = val;
-
-        m_triangle.timer = timer_low;
-    }
-    else if (addr == 0x400B) // Triangle reg 3
-    {
-        m_triangle.registers[3] = val;
 
-        int length_counter = (val >> 3) & 0b11111;
-        int timer_high = val & 0b111;
+        if (cycle > m_cycle)
+            return cycle;
 
-        m_triangle.length_counter = LENGTH_COUNTER_TABLE[length_counter];
-        m_triangle.timer = m_triangle.timer | (timer_high << 8);
-        m_triangle.frequency = (double)CPU_CLOCK_SPEED / (32.0 * ((double)m_triangle.timer + 1.0));
-        m_triangle.reload_flag = true;
+        m_synth.write_register(m_cycle, write->addr, write->val);
+        m_writes.pop();
     }
-    else if (addr == 0x400C) // Noise reg 0
-    {
-        m_noise.registers[0] = val;
-
-        int loop = (val & 0b100000) ? 1 : 0;
-        int constant_volume = (val & 0b10000) ? 1 : 0;
-        int volume = (val & 0b1111);
-
-        m_noise.constant_volume = constant_volume ? true : false;
-        m_noise.loop = loop ? true : false;
-        if (constant_volume)
-        {
-            m_noise.volume = (float)volume / 15.0f;
-            m_noise.envelope_counter = 0;
-            m_noise.envelope_rate = 0.0;
-            m_noise.envelope_progress = 0.0;
-        }
-        else
-        {
-            m_noise.volume = (float)volume / 15.0f;
-            m_noise.envelope_counter = 15;
-            m_noise.envelope_rate = 1.0 / (double)(volume + 1);
-            m_noise.envelope_progress = 0.0;
-        }
-    }
-    else if (addr == 0x400D) // Noise reg 1
-    {
-        m_noise.registers[1] = val;
-    }
-    else if (addr == 0x400E) // Noise reg 2
-    {
-        m_noise.registers[2] = val;
-
-        int mode = (val & 0b10000000) ? 1 : 0;
-        int period = val & 0b1111;
 
-        m_noise.frequency = (double)CPU_CLOCK_SPEED / NOISE_FREQUENCY_TABLE[period];
-        m_noise.mode = mode ? true : false;
-    }
-    else if (addr == 0x400F) // Noise reg 3
-    {
-        m_noise.registers[3] = val;
+    return INT64_MAX;
+}
 
-        int length_counter = (val >> 3) & 0b11111;
 
-        m_noise.length_counter = LENGTH_COUNTER_TABLE[length_counter];
-        if (m_noise.enabled && !m_noise.constant_volume)
-        {
-            m_noise.envelope_counter = 15;
-            m_noise.envelope_rate = 1.0 / (double)(m_noise.volume * 15.0f + 1);
-            m_noise.envelope_progress = 0.0;
-        }
-    }
-    else if (addr == 0x4010) // DCM reg 0
-    {
-        m_dmc.registers[0] = val;
-    }
-    else if (addr == 0x4011) // DCM reg 1
-    {
-        m_dmc.registers[1] = val;
-    }
-    else if (addr == 0x4012) // DCM reg 2
-    {
-        m_dmc.registers[2] = val;
-    }
-    else if (addr == 0x4013) // DCM reg 3
-    {
-        m_dmc.registers[3] = val;
-    }
-    else if (addr == 0x4015)
-    {
-        m_status_register = val;
-
-        m_pulses[0].enabled = (val & 0b1) != 0;
-        m_pulses[1].enabled = (val & 0b10) != 0;
-        m_triangle.enabled = (val & 0b100) != 0;
-        m_noise.enabled = (val & 0b1000) != 0;
-        m_dmc.enabled = (val & 0b10000) != 0;
-
-        if (!m_pulses[0].enabled) m_pulses[0].length_counter = 0;
-        if (!m_pulses[1].enabled) m_pulses[1].length_counter = 0;
-        if (!m_triangle.enabled) m_triangle.length_counter = 0;
-        if (!m_noise.enabled) m_noise.length_counter = 0;
-    }
-    else if (addr == 0x4017)
+void APUAudioStream::flush_writes()
+{
+    while (const register_write_t* write = m_writes.front())
     {
-        m_frame_counter_register = val;
+        m_synth.write_register(m_cycle, write->addr, write->val);
+        m_writes.pop();
     }
 }
 
@@ -408,314 +171,137 @@ void APUAudioStream::cpu_write(int addr, uint8_t val)
 uint8_t APUAudioStream::cpu_read(int addr)
 {
     std::unique_lock<std::mutex> lock(m_mutex);
-
-    if (addr == 0x4000 || addr == 0x4004)
-    {
-        auto pulse = &m_pulses[(addr - 0x4000) / 4];
-        return pulse->registers[0];
-    }
-    else if (addr == 0x4001 || addr == 0x4005)
-    {
-        auto pulse = &m_pulses[(addr - 0x4000) / 4];
-        return pulse->registers[1];
-    }
-    else if (addr == 0x4002 || addr == 0x4006)
-    {
-        auto pulse = &m_pulses[(addr - 0x4000) / 4];
-        return pulse->registers[2];
-    }
-    else if (addr == 0x4003 || addr == 0x4007)
-    {
-        auto pulse = &m_pulses[(addr - 0x4000) / 4];
-        return pulse->registers[3];
-    }
-    else if (addr == 0x4008)
-    {
-        return m_triangle.registers[0];
-    }
-    else if (addr == 0x4009)
-    {
-        return m_triangle.registers[1];
-    }
-    else if (addr == 0x400A)
-    {
-        return m_triangle.registers[2];
-    }
-    else if (addr == 0x400B)
-    {
-        return m_triangle.registers[3];
-    }
-    else if (addr == 0x400C)
-    {
-        return m_noise.registers[0];
-    }
-    else if (addr == 0x400D)
-    {
-        return m_noise.registers[1];
-    }
-    else if (addr == 0x400E)
-    {
-        return m_noise.registers[2];
-    }
-    else if (addr == 0x400F)
-    {
-        return m_noise.registers[3];
-    }
-    else if (addr == 0x4010)
-    {
-        return m_dmc.registers[0];
-    }
-    else if (addr == 0x4011)
-    {
-        return m_dmc.registers[1];
-    }
-    else if (addr == 0x4012)
-    {
-        return m_dmc.registers[2];
-    }
-    else if (addr == 0x4013)
-    {
-        return m_dmc.registers[3];
-    }
-    else if (addr == 0x4015)
-    {
-        return m_status_register;
-    }
-    else if (addr == 0x4017)
-    {
-        return m_frame_counter_register;
-    }
-
-    return 0;
+    return m_synth.read_register(addr);
 }
 
 
-void APUAudioStream::emulate()
+bool APUAudioStream::progress(int frame_count, int sample_rate, int channel_count, float* out)
 {
-    m_240hz_progress += m_240hz_rate;
-    while (m_240hz_progress >= 1.0)
-    {
-        m_240hz_progress -= 1.0;
-
-        // Envelopes on pulses
-        for (int i = 0; i < 2; ++i)
-        {
-            auto pulse = &m_pulses[i];
-
-            if (!pulse->constant_volume)
-            {
-                if (pulse->envelope_counter > 0 || pulse->loop)
-                {
-                    pulse->envelope_progress += pulse->envelope_rate;
-                    while (pulse->envelope_progress >= 1.0)
-                    {
-                        pulse->envelope_progress -= 1.0;
-                        pulse->envelope_counter--;
-                        pulse->volume = (float)pulse->envelope_counter / 15.0f;
-                        if (pulse->envelope_counter == 0 && pulse->loop)
-                        {
-                            pulse->envelope_counter = 15;
-                            pulse->volume = 1.0f;
-                        }
-                    }
-                }
-            }
-        }
+    auto start_time = std::chrono::steady_clock::now();
 
-        // Envelope on noise
-        if (!m_noise.constant_volume)
-        {
-            if (m_noise.envelope_counter > 0 || m_noise.loop)
-            {
-                m_noise.envelope_progress += m_noise.envelope_rate;
-                while (m_noise.envelope_progress >= 1.0)
-                {
-                    m_noise.envelope_progress -= 1.0;
-                    m_noise.envelope_counter--;
-                    m_noise.volume = (float)m_noise.envelope_counter / 15.0f;
-                    if (m_noise.envelope_counter == 0 && m_noise.loop)
-                    {
-                        m_noise.envelope_counter = 15;
-                        m_noise.volume = 1.0f;
-                    }
-                }
-            }
-        }
+    // The emulation thread only holds the lock while saving or loading. Rather than waiting on it, output
+    // silence for this buffer.
+    std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+    if (!lock.owns_lock())
+    {
+        memset(out, 0, sizeof(float) * frame_count * channel_count);
+        m_stats.skipped_buffers++;
+        return true;
     }
 
-    m_120hz_progress += m_120hz_rate;
-    while (m_120hz_progress >= 1.0)
+    // Adaptive mode plays slightly more or less emulated time per second, by pretending the CPU runs at a
+    // slightly different speed
+    if (sample_rate != m_sample_rate || m_rate_adjust != m_blip_rate_adjust)
     {
-        m_120hz_progress -= 1.0;
-
-        // Pulses
-        for (int i = 0; i < 2; ++i)
-        {
-            auto pulse = &m_pulses[i];
-
-            if (pulse->length_counter > 0 && !pulse->loop)
-                pulse->length_counter--;
-        }
-
-        // Triangle
-        if (m_triangle.length_counter > 0 && !m_triangle.control_flag)
-            m_triangle.length_counter--;
-
-        if (m_triangle.reload_flag)
-        {
-            m_triangle.linear_counter = m_triangle.reload_value;
-        }
-        else if (m_triangle.linear_counter > 0)
-        {
-            m_triangle.linear_counter--;
-        }
-        if (!m_triangle.control_flag)
-        {
-            m_triangle.reload_flag = false;
-        }
-
-        // Noise
-        if (m_noise.length_counter > 0 && !m_noise.loop)
-            m_noise.length_counter--;
+        m_sample_rate = sample_rate;
+        m_blip_rate_adjust = m_rate_adjust;
+        m_blip.set_rates((double)CPU_CLOCK_SPEED * (1.0 + m_rate_adjust), (double)sample_rate);
     }
 
-    // Call "NMI" every frame
-    m_60hz_progress += m_60hz_rate;
-    while (m_60hz_progress >= 1.0)
+    // The blip buffer holds a bounded number of samples, render in blocks that fit
+    for (int done = 0; done < frame_count;)
     {
-        m_60hz_progress -= 1.0;
+        int count = std::min(frame_count - done, BlipBuffer::MAX_SAMPLES);
+        int64_t end_cycle = m_cycle + m_blip.clocks_needed(count);
+        int64_t next_write_cycle = apply_writes();
+        while (m_cycle < end_cycle)
+        {
+            if (m_cycle >= next_write_cycle)
+                next_write_cycle = apply_writes();
+
+            // Nothing happens until the next sequencer tick, queued write or the end of the block. Jump
+            // there and clock the sequencer on that cycle for all the cycles skipped.
+            int64_t cycles = m_synth.get_cycles_to_next_tick();
+            cycles = std::min(cycles, next_write_cycle - m_cycle);
+            cycles = std::min(cycles, end_cycle - m_cycle);
+
+            m_cycle += cycles - 1;
+            m_synth.clock_sequencer(m_cycle, cycles);
+            m_cycle++;
+        }
+        m_synth.run(end_cycle);
+        m_blip.end_block(end_cycle);
+        m_blip.read_samples(out + done, count);
+        done += count;
     }
-}
-
 
-bool APUAudioStream::progress(int frame_count, int sample_rate, int channel_count, float* out, float volume, float balance, float pitch)
-{
-    const double cpu_progress_speed = (double)CPU_CLOCK_SPEED / (double)sample_rate;
+    update_latency(frame_count);
+    m_played_cycle.store(m_write_clock_synced ? m_cycle - m_write_cycle_offset : -1, std::memory_order_relaxed);
 
+    // Filter, then spread over the channels (from the back, in place)
+    const float volume = m_muted.load(std::memory_order_relaxed) ? 0.0f : m_volume.load(std::memory_order_relaxed);
     for (int i = 0; i < frame_count; ++i)
+        out[i] = m_filter.process(out[i]) * volume;
+    for (int i = frame_count - 1; i >= 0; --i)
     {
-        m_cpu_progress += cpu_progress_speed;
-        while (m_cpu_progress >= 1.0)
-        {
-            std::unique_lock<std::mutex> lock(m_mutex);
-            emulate();
-            m_cpu_progress--;
-        }
-
-        float sample = render_frame(sample_rate);
-        for (int c = 0; c < channel_count; ++c)
+        float sample = out[i];
+        for (int c = channel_count - 1; c >= 0; --c)
             out[i * channel_count + c] = sample;
     }
 
+    m_stats.callback_us = (float)std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start_time).count();
+    m_stats.max_callback_us = std::max(m_stats.max_callback_us, m_stats.callback_us);
+    std::unique_lock<std::mutex> stats_lock(m_stats_mutex, std::try_to_lock);
+    if (stats_lock.owns_lock())
+        m_published_stats = m_stats;
+
     return true;
 }
 
 
-static const int TRIANGLE_WAVE_DATA[32] = {
-    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
-    15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
-};
-
-static const int PULSE_WAVE_DATA[4][8] = {
-    {0, 1, 0, 0, 0, 0, 0, 0},
-    {0, 1, 1, 0, 0, 0, 0, 0},
-    {0, 1, 1, 1, 1, 0, 0, 0},
-    {1, 0, 0, 1, 1, 1, 1, 1}
-};
-
-
-float APUAudioStream::render_frame(int sample_rate)
+void APUAudioStream::update_latency(int frame_count)
 {
-    float pulse_samples[2] = { 0.0f, 0.0f };
-    float triangle_sample = 0.0;
-    float noise_sample = 0.0;
-    float dmc_sample = 0.0;
-
-    // Pulses
-    for (int i = 0; i < 2; ++i)
-    {
-        auto pulse = &m_pulses[i];
-        if (pulse->length_counter > 0 && pulse->timer >= 8)
-        {
-            float volume = pulse->volume;
-            pulse_samples[i] = (float)PULSE_WAVE_DATA[pulse->duty][pulse->time] * volume;
-            double pulse_rate = pulse->frequency / (double)sample_rate;
-            pulse->progress += pulse_rate * 8.0f;
-            while (pulse->progress >= 1.0)
-            {
-                pulse->progress--;
-                pulse->time++;
-                if (pulse->time == 8)
-                    pulse->time = 0;
-            }
-        }
-    }
-
-    // Triangle
-    if ((m_triangle.enabled && m_triangle.length_counter > 0 && m_triangle.linear_counter > 0 && m_triangle.timer > 0) || m_triangle.time != 0)
-    {
-        if ((m_triangle.length_counter > 0 && m_triangle.linear_counter > 0) || m_triangle.time != 0)
-        {
-            triangle_sample = (float)TRIANGLE_WAVE_DATA[m_triangle.time] / 15.0f;
-        }
-        double triangle_rate = m_triangle.frequency / (double)sample_rate;
-        m_triangle.progress += triangle_rate * 32.0f;
-        while (m_triangle.progress >= 1.0)
-        {
-            m_triangle.progress--;
-            m_triangle.time++;
-            if (m_triangle.time == 32)
-                m_triangle.time = 0;
-        }
-    }
-
-    // Noise
-    if (m_noise.enabled && m_noise.length_counter > 0)
-    {
-        noise_sample = m_noise.previous_sample;
-        double noise_rate = m_noise.frequency / (double)sample_rate;
-        m_noise.progress += noise_rate;
-        while (m_noise.progress >= 1.0)
-        {
-            m_noise.progress--;
-
-            int bit_a = m_noise.shift_register & 0b1;
-            int bit_b = (m_noise.shift_register >> 1) & 0b1;
-            if (m_noise.mode)
-                bit_b = (m_noise.shift_register >> 6) & 0b1;
-            int feedback = bit_a ^ bit_b;
-            m_noise.shift_register >>= 1;
-            m_noise.shift_register = (m_noise.shift_register & 0b11111111111111) | (feedback << 14);
-
-            noise_sample = (float)(!(m_noise.shift_register & 0b1)) * m_noise.volume;
-            m_noise.previous_sample = noise_sample;
-        }
-        noise_sample *= m_noise.volume * 1.0f; // Why is this too loud?
-    }
-
-    // Mixing
-    float sample = 0.0f;
-
-    // DACs
-    float pulse_group = pulse_samples[0] * 15.0f + pulse_samples[1] * 15.0f;
-    if (pulse_group > 0.0f)
-        sample += 95.88f / ((8128.0f / pulse_group) + 100.0f);
-
-    float tnd_group = (triangle_sample * 15.0f / 8227.0f) + (noise_sample * 15.0f / 12241.0f) + (dmc_sample * 127.0f / 22638.0f);
-    if (tnd_group > 0.0f)
-        sample += 159.79f / (1.0f / tnd_group + 100.0f);
-
-    // Filtering (I don't fully understand this)
-    float filtered_sample = sample;
-    filtered_sample = m_previous_filtered_sample * 0.999835f + filtered_sample - m_previous_unfiltered_sample;
-    filtered_sample = m_previous_filtered_sample * 0.996039f + filtered_sample - m_previous_unfiltered_sample;
-    filtered_sample = (filtered_sample - m_previous_filtered_sample) * 0.815686f;
-    filtered_sample *= 0.70f; // Somehow this makes it too loud
-
-    m_previous_filtered_sample = filtered_sample;
-    m_previous_unfiltered_sample = sample;
-
-    return filtered_sample * m_volume;
+    const double samples_per_cycle = (double)m_sample_rate / (double)CPU_CLOCK_SPEED;
+    const bool adaptive = m_adaptive_latency.load(std::memory_order_relaxed);
+    const double target = (double)m_target_latency_ms.load(std::memory_order_relaxed) * (double)m_sample_rate / 1000.0;
+
+    // Writes can be queued up to twice the target ahead before they're considered drifted. The emulation
+    // can also keep that far ahead on purpose, when it follows the audio clock.
+    m_max_write_skew = std::max(MAX_WRITE_SKEW, (int64_t)(target * 2.0 / samples_per_cycle));
+
+    m_rate_adjust = 0.0;
+    m_stats.rate_adjust = 0.0f;
+    m_stats.queued_writes = (int)m_writes.size();
+    if (!m_write_clock_synced)
+        return; // No write yet to relate the two clocks
+
+    int64_t queued_cycles = m_emulated_cycle.load(std::memory_order_relaxed) + m_write_cycle_offset - m_cycle;
+    if (queued_cycles > m_max_write_skew)
+    {
+        // The emulation got too far ahead, the device plays slower than it. Catch up at once, the next write
+        // re-anchors the clocks.
+        flush_writes();
+        m_write_clock_synced = false;
+        m_latency_average_valid = false;
+        m_stats.resyncs++;
+        return;
+    }
+    if (queued_cycles < -m_max_write_skew)
+        return; // Paused, reset or loaded. The next write re-anchors the clocks.
+
+    m_stats.queued_samples = (int)((double)queued_cycles * samples_per_cycle);
+    if (queued_cycles < 0)
+        m_stats.underruns++;
+
+    // The emulation runs in bursts, once per video frame. Smooth that out.
+    double latency = (double)m_stats.queued_samples + (double)frame_count;
+    if (!m_latency_average_valid)
+    {
+        m_latency_average = latency;
+        m_latency_average_valid = true;
+    }
+    m_latency_average += (latency - m_latency_average) * LATENCY_SMOOTHING;
+    m_stats.latency_ms = (float)(m_latency_average * 1000.0 / (double)m_sample_rate);
+
+    if (!adaptive || target <= 0.0)
+        return;
+
+    // Proportional-integral. The integral settles on the drift between the two clocks, the proportional
+    // part pulls the latency back to the target.
+    double error = std::clamp((m_latency_average - target) / target, -1.0, 1.0);
+    m_rate_integral = std::clamp(m_rate_integral + error * RATE_INTEGRAL_GAIN, -1.0, 1.0);
+    m_rate_adjust = std::clamp(error * RATE_PROPORTIONAL_GAIN + m_rate_integral, -1.0, 1.0) * MAX_RATE_ADJUST;
+    m_stats.rate_adjust = (float)m_rate_adjust;
 }
 
 
@@ -733,14 +319,31 @@ float APU::get_volume() const
 
 float APUAudioStream::get_volume()
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
     return m_volume;
 }
 
 
 void APUAudioStream::set_volume(float volume)
 {
-    std::unique_lock<std::mutex> lock(m_mutex);
-
     m_volume = volume;
 }
+
+
+void APUAudioStream::set_emulated_cycle(int64_t cpu_cycle)
+{
+    m_emulated_cycle.store(cpu_cycle, std::memory_order_relaxed);
+}
+
+
+apu_audio_stats_t APUAudioStream::get_stats()
+{
+    std::unique_lock<std::mutex> lock(m_stats_mutex);
+    return m_published_stats;
+}
+
+
+void APUAudioStream::set_adaptive_latency(bool enabled, float target_ms)
+{
+    m_adaptive_latency = enabled;
+    m_target_latency_ms = target_ms;
+}
@@ -1,15 +1,32 @@
 #pragma once
 
+#include "APUSynth.h"
+#include "BlipBuffer.h"
 #include "CPUPeripheral.h"
-
-#include <onut/AudioStream.h>
+#include "SPSCQueue.h"
+#include "StateBuffer.h"
 
 #include <atomic>
-#include <stdio.h>
+#include <memory>
 #include <mutex>
 
 
-ForwardDeclare(APUAudioStream);
+class APUAudioStream;
+
+
+// Audio timing, as measured by the audio thread
+struct apu_audio_stats_t
+{
+    int queued_samples = 0; // Emulated audio not played yet. Negative when the audio ran ahead of the emulation.
+    int queued_writes = 0; // Register writes waiting for the audio clock
+    float latency_ms = 0.0f; // Emulation to output: queued samples plus the device buffer, smoothed
+    float callback_us = 0.0f; // Time spent rendering the last buffer
+    float max_callback_us = 0.0f;
+    float rate_adjust = 0.0f; // Adaptive resampling, 0.001 plays 0.1% more emulated time per second
+    uint32_t underruns = 0; // Buffers that caught up with the emulation and played stale state
+    uint32_t resyncs = 0; // Times the write timestamps drifted too far and were re-anchored
+    uint32_t skipped_buffers = 0; // Silent buffers, output while a save or load held the state
+};
 
 
 class APU final : public CPUPeripheral
@@ -19,117 +36,123 @@ public:
 
     bool cpu_write(uint16_t addr, uint8_t data) override;
     bool cpu_read(uint16_t addr, uint8_t* out_data) override;
+    std::vector<cpu_range_t> get_cpu_ranges() const override { return { { 0x4000, 0x4017 } }; }
+
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
 
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    // Only what the emulation reads back, for snapshots that leave the audio thread alone
+    void serialize_registers(StateWriter& writer) const { writer.write(m_registers, sizeof(m_registers)); }
+    void deserialize_registers(StateReader& reader) { reader.read(m_registers, sizeof(m_registers)); }
 
     float get_volume() const;
     void set_volume(float volume);
 
+    // For frames that will be thrown away, like run-ahead: the writes only reach the registers read back
+    void set_skip_stream(bool skip_stream) { m_skip_stream = skip_stream; }
+
+    // Timestamp, in CPU cycles, of the register writes that follow
+    void set_cpu_cycle(int64_t cpu_cycle) { m_cpu_cycle = get_audio_cycle(cpu_cycle); }
+
+    // How far the emulation got, so the audio thread can measure how far behind it plays
+    void publish_cpu_cycle(int64_t cpu_cycle);
+
+    // The audio stream's clock runs 1:1 with the emulation, except while fast forwarding squeezes it:
+    // from cpu_cycle on, each emulated cycle lasts scale audio cycles
+    void set_time_scale(int64_t cpu_cycle, double scale);
+    int64_t get_audio_cycle(int64_t cpu_cycle) const { return m_time_base_audio_cycle + (int64_t)((double)(cpu_cycle - m_time_base_cpu_cycle) * m_time_scale); }
+
+    // Sample output. The front-end pulls from this on its audio thread.
+    const std::shared_ptr<APUAudioStream>& get_audio_stream() const { return m_audio_stream; }
+
 private:
-    APUAudioStreamRef m_audio_stream;
+    std::shared_ptr<APUAudioStream> m_audio_stream;
+    uint8_t m_registers[0x18] = { 0 }; // Last written values, so reads never touch the audio thread
+    int64_t m_cpu_cycle = 0;
+    int64_t m_time_base_cpu_cycle = 0;
+    int64_t m_time_base_audio_cycle = 0;
+    double m_time_scale = 1.0;
+    bool m_skip_stream = false;
 };
 
 
-class APUAudioStream final : public OAudioStream, public std::enable_shared_from_this<APUAudioStream>
+class APUAudioStream final
 {
 public:
     APUAudioStream();
 
-    bool progress(int frame_count, int sample_rate, int channel_count, float* out, float volume = 1.0f, float balance = 0.0f, float pitch = 1.0f) override;
+    // Renders frame_count interleaved frames into out
+    bool progress(int frame_count, int sample_rate, int channel_count, float* out);
 
-    float render_frame(int sample_rate);
-
-    void cpu_write(int addr, uint8_t val);
+    // Queues a register write from the emulation thread. It is applied by the audio thread
+    // once its own clock reaches cpu_cycle.
+    void cpu_write(int64_t cpu_cycle, int addr, uint8_t val);
     uint8_t cpu_read(int addr);
 
-    void serialize(FILE* f, int version);
-    void deserialize(FILE* f, int version);
+    void serialize(StateWriter& writer, int version);
+    void deserialize(StateReader& reader, int version);
 
     float get_volume();
     void set_volume(float volume);
+    void set_muted(bool muted) { m_muted = muted; } // Output silence, the state still follows the writes
+    bool get_muted() const { return m_muted; }
 
-private:
-    void emulate();
+    void set_emulated_cycle(int64_t cpu_cycle);
+    apu_audio_stats_t get_stats();
 
-    // Music stuff
-    struct pulse_t
-    {
-        bool enabled = false;
-        bool loop = false;
-        bool constant_volume = false;
-        int duty = 0;
-        double progress = 0.0;
-        double frequency = 261.63;
-        float volume = 0.0f;
-        uint8_t registers[4] = {0};
-        int length_counter = 0;
-        int timer = 0;
-        int time = 0;
-        int envelope_counter = 0;
-        double envelope_rate = 0.0;
-        double envelope_progress = 0.0;
-    };
+    // How far the audio rendered, in the emulation's CPU cycles. -1 until a write relates the two clocks.
+    // Lets the emulation follow the audio device's clock instead of wall time.
+    int64_t get_played_cycle() const { return m_played_cycle.load(std::memory_order_relaxed); }
 
-    struct triangle_t
-    {
-        bool enabled = false;
-        bool reload_flag = false;
-        double progress = 0.0;
-        double frequency = 329.63;
-        uint8_t registers[4] = {0};
-        int length_counter = 0;
-        bool control_flag = false;
-        int linear_counter = 0;
-        int timer = 0;
-        int time = 0;
-        int reload_value = 0;
-    };
+    // Resamples by up to MAX_RATE_ADJUST to keep the emulation to output latency around target_ms,
+    // instead of letting the two clocks drift apart until the write timestamps get re-anchored
+    void set_adaptive_latency(bool enabled, float target_ms);
 
-    struct noise_t
-    {
-        bool enabled = false;
-        bool loop = false;
-        bool mode = false;
-        bool constant_volume = false;
-        double progress = 0.0;
-        double frequency = 261.63;
-        float volume = 0.0f;
-        uint8_t registers[4] = {0};
-        int length_counter = 0;
-        int period = 0;
-        int time = 0;
-        int envelope_counter = 0;
-        double envelope_rate = 0.0;
-        double envelope_progress = 0.0;
-        float previous_sample = 0.0f;
-        int shift_register = 1;
-    };
+    static constexpr double MAX_RATE_ADJUST = 0.005;
 
-    struct dmc_t
+private:
+    struct register_write_t
     {
-        bool enabled = false;
-        bool loop = false;
-        uint8_t registers[4] = {0};
+        int64_t cpu_cycle;
+        uint16_t addr;
+        uint8_t val;
     };
 
-    pulse_t m_pulses[2];
-    triangle_t m_triangle;
-    noise_t m_noise;
-    dmc_t m_dmc;
-    uint8_t m_status_register = 0;
-    uint8_t m_frame_counter_register = 0;
-    float m_volume = 1.0f;
+    int64_t apply_writes(); // Returns the cycle the next queued write is due
+    void flush_writes();
+    void update_latency(int frame_count); // After rendering a buffer
+
+    // Waveforms are stepped at exact CPU cycles, and every change of the mixed output goes into
+    // the blip buffer as a band-limited delta
+    BlipBuffer m_blip;
+    APUSynth<BlipBuffer> m_synth;
+    apu_filter_t m_filter;
+    std::atomic<float> m_volume = 1.0f;
+    std::atomic<bool> m_muted = false;
+
+    // Register writes in flight from the emulation thread. Only the holder of m_mutex consumes
+    // them: the audio thread, or the emulation thread while saving/loading. The audio thread
+    // only try-locks it, so it never waits on the emulation thread.
+    SPSCQueue<register_write_t, 4096> m_writes;
     std::mutex m_mutex;
-
-    double m_cpu_progress = 0.0;
-    double m_60hz_rate = 0.0;
-    double m_60hz_progress = 0.0;
-    double m_120hz_rate = 0.0;
-    double m_120hz_progress = 0.0;
-    double m_240hz_rate = 0.0;
-    double m_240hz_progress = 0.0;
-
-    float m_previous_filtered_sample = 0.0f;
-    float m_previous_unfiltered_sample = 0.0f;
+    int64_t m_cycle = 0; // CPU cycles rendered
+    int64_t m_write_cycle_offset = 0; // Maps write timestamps onto m_cycle
+    bool m_write_clock_synced = false;
+
+    int m_sample_rate = 0;
+
+    // Latency. Stats are published with a try-lock too, the audio thread skips it if they're being read.
+    std::atomic<int64_t> m_emulated_cycle = 0;
+    std::atomic<int64_t> m_played_cycle = -1;
+    std::atomic<bool> m_adaptive_latency = false;
+    std::atomic<float> m_target_latency_ms = 25.0f;
+    int64_t m_max_write_skew = 0;
+    double m_latency_average = 0.0; // In samples
+    bool m_latency_average_valid = false;
+    double m_rate_adjust = 0.0;
+    double m_rate_integral = 0.0;
+    double m_blip_rate_adjust = 0.0; // What the blip buffer runs at
+    apu_audio_stats_t m_stats;
+    apu_audio_stats_t m_published_stats;
+    std::mutex m_stats_mutex;
 };
@@ -0,0 +1,880 @@
+#pragma once
+
+#include "StateBuffer.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <float.h>
+#include <math.h>
+
+
+// APU synthesis, shared by the emulated APU, the SFX renderer and the tool's music player.
+// Register writes and the 240/120/60hz frame sequencer happen at CPU cycle timestamps. The
+// channels step their waveforms at exact cycles in between, and every change of the mixed output
+// is handed to the sink, which must provide:
+//     static const int LEVEL_SCALE; // Units for an amplitude of 1.0
+//     void add_delta(double cycle, int delta);
+// Header-only and allocation free, so each sink gets its own inlined loops.
+template<typename Sink>
+class APUSynth final
+{
+public:
+    static const int CPU_CLOCK_SPEED = 1789773;
+    static const int FRAME_PERIOD_US = 16666;
+
+    APUSynth(Sink* sink);
+
+    // Channel and register state, in the save state layout
+    void serialize(StateWriter& writer) const;
+    void deserialize(StateReader& reader);
+
+    void write_register(int64_t cycle, int addr, uint8_t val);
+    uint8_t read_register(int addr) const;
+
+    // Frame sequencer. Accumulators advance by their rate every cycle and tick when they reach 1.
+    int64_t get_cycles_to_next_tick() const; // At least 1
+    int clock_sequencer(int64_t cycle, int64_t cycles); // Advances it by cycles, ticking on cycle. Returns the 60hz frames ticked.
+    void reset_sequencer();
+
+    void run(int64_t cycle); // Steps the channels up to cycle
+    void resync(int64_t cycle); // After loading, continues from cycle and glides to the loaded level
+
+private:
+    struct pulse_t
+    {
+        bool enabled = false;
+        bool loop = false;
+        bool constant_volume = false;
+        int duty = 0;
+        double progress = 0.0;
+        double frequency = 261.63;
+        float volume = 0.0f;
+        uint8_t registers[4] = {0};
+        int length_counter = 0;
+        int timer = 0;
+        int time = 0;
+        int envelope_counter = 0;
+        double envelope_rate = 0.0;
+        double envelope_progress = 0.0;
+    };
+
+    struct triangle_t
+    {
+        bool enabled = false;
+        bool reload_flag = false;
+        double progress = 0.0;
+        double frequency = 329.63;
+        uint8_t registers[4] = {0};
+        int length_counter = 0;
+        bool control_flag = false;
+        int linear_counter = 0;
+        int timer = 0;
+        int time = 0;
+        int reload_value = 0;
+    };
+
+    struct noise_t
+    {
+        bool enabled = false;
+        bool loop = false;
+        bool mode = false;
+        bool constant_volume = false;
+        double progress = 0.0;
+        double frequency = 261.63;
+        float volume = 0.0f;
+        uint8_t registers[4] = {0};
+        int length_counter = 0;
+        int period = 0;
+        int time = 0;
+        int envelope_counter = 0;
+        double envelope_rate = 0.0;
+        double envelope_progress = 0.0;
+        float previous_sample = 0.0f;
+        int shift_register = 1;
+    };
+
+    struct dmc_t
+    {
+        bool enabled = false;
+        bool loop = false;
+        uint8_t registers[4] = {0};
+    };
+
+    static constexpr int LENGTH_COUNTER_TABLE[0x1F + 1] = {
+        10, 254, 20, 2,
+        40, 4, 80, 6,
+        160, 8, 60, 10,
+        14, 12, 26, 14,
+        12, 16, 24, 18,
+        48, 20, 96, 22,
+        192, 24, 72, 26,
+        16, 28, 32, 30
+    };
+
+    static constexpr double NOISE_FREQUENCY_TABLE[16] = {
+        4, 8, 16, 32, 
+        64, 96, 128, 160, 
+        202, 254, 380, 508, 
+        762, 1016, 2034, 4068
+    };
+
+    static constexpr int TRIANGLE_WAVE_DATA[32] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+        15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+    };
+
+    static constexpr int PULSE_WAVE_DATA[4][8] = {
+        {0, 1, 0, 0, 0, 0, 0, 0},
+        {0, 1, 1, 0, 0, 0, 0, 0},
+        {0, 1, 1, 1, 1, 0, 0, 0},
+        {1, 0, 0, 1, 1, 1, 1, 1}
+    };
+
+    bool is_pulse_playing(int idx) const;
+    bool is_triangle_playing() const;
+    bool is_noise_playing() const;
+    void clock_noise();
+    void update_output(double cycle);
+    int get_output_level() const; // Mixed, in Sink::LEVEL_SCALE units
+
+    Sink* m_sink = nullptr;
+    pulse_t m_pulses[2];
+    triangle_t m_triangle;
+    noise_t m_noise;
+    dmc_t m_dmc;
+    uint8_t m_status_register = 0;
+    uint8_t m_frame_counter_register = 0;
+
+    double m_60hz_rate = 0.0;
+    double m_60hz_progress = 0.0;
+    double m_120hz_rate = 0.0;
+    double m_120hz_progress = 0.0;
+    double m_240hz_rate = 0.0;
+    double m_240hz_progress = 0.0;
+
+    int64_t m_synth_cycle = 0; // Channels were run up to here
+    int m_output_level = 0;
+};
+
+
+// The NES output filters, applied to the mixed samples
+struct apu_filter_t
+{
+    float previous_filtered_sample = 0.0f;
+    float previous_unfiltered_sample = 0.0f;
+
+    float process(float sample)
+    {
+        // Filtering (I don't fully understand this)
+        float filtered_sample = sample;
+        filtered_sample = previous_filtered_sample * 0.999835f + filtered_sample - previous_unfiltered_sample;
+        filtered_sample = previous_filtered_sample * 0.996039f + filtered_sample - previous_unfiltered_sample;
+        filtered_sample = (filtered_sample - previous_filtered_sample) * 0.815686f;
+        filtered_sample *= 0.70f; // Somehow this makes it too loud
+
+        previous_filtered_sample = filtered_sample;
+        previous_unfiltered_sample = sample;
+
+        return filtered_sample;
+    }
+};
+
+
+template<typename Sink>
+APUSynth<Sink>::APUSynth(Sink* sink)
+    : m_sink(sink)
+{
+    m_60hz_rate = (1000000.0 / (double)FRAME_PERIOD_US) / (double)CPU_CLOCK_SPEED;
+    m_120hz_rate = m_60hz_rate * 2.0;
+    m_240hz_rate = m_120hz_rate * 2.0;
+}
+
+
+template<typename Sink>
+void APUSynth<Sink>::serialize(StateWriter& writer) const
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        auto pulse = &m_pulses[i];
+        
+        writer.write(&pulse->enabled, sizeof(pulse->enabled));
+        writer.write(&pulse->loop, sizeof(pulse->loop));
+        writer.write(&pulse->constant_volume, sizeof(pulse->constant_volume));
+        writer.write(&pulse->duty, sizeof(pulse->duty));
+        writer.write(&pulse->progress, sizeof(pulse->progress));
+        writer.write(&pulse->frequency, sizeof(pulse->frequency));
+        writer.write(&pulse->volume, sizeof(pulse->volume));
+        writer.write(pulse->registers, 4);
+        writer.write(&pulse->length_counter, sizeof(pulse->length_counter));
+        writer.write(&pulse->timer, sizeof(pulse->timer));
+        writer.write(&pulse->time, sizeof(pulse->time));
+        writer.write(&pulse->envelope_counter, sizeof(pulse->envelope_counter));
+        writer.write(&pulse->envelope_rate, sizeof(pulse->envelope_rate));
+        writer.write(&pulse->envelope_progress, sizeof(pulse->envelope_progress));
+    }
+
+    writer.write(&m_triangle.enabled, sizeof(m_triangle.enabled));
+    writer.write(&m_triangle.reload_flag, sizeof(m_triangle.reload_flag));
+    writer.write(&m_triangle.progress, sizeof(m_triangle.progress));
+    writer.write(&m_triangle.frequency, sizeof(m_triangle.frequency));
+    writer.write(m_triangle.registers, 4);
+    writer.write(&m_triangle.length_counter, sizeof(m_triangle.length_counter));
+    writer.write(&m_triangle.control_flag, sizeof(m_triangle.control_flag));
+    writer.write(&m_triangle.linear_counter, sizeof(m_triangle.linear_counter));
+    writer.write(&m_triangle.timer, sizeof(m_triangle.timer));
+    writer.write(&m_triangle.time, sizeof(m_triangle.time));
+    writer.write(&m_triangle.reload_value, sizeof(m_triangle.reload_value));
+
+    writer.write(&m_noise.enabled, sizeof(m_noise.enabled));
+    writer.write(&m_noise.loop, sizeof(m_noise.loop));
+    writer.write(&m_noise.mode, sizeof(m_noise.mode));
+    writer.write(&m_noise.constant_volume, sizeof(m_noise.constant_volume));
+    writer.write(&m_noise.progress, sizeof(m_noise.progress));
+    writer.write(&m_noise.frequency, sizeof(m_noise.frequency));
+    writer.write(&m_noise.volume, sizeof(m_noise.volume));
+    writer.write(m_noise.registers, 4);
+    writer.write(&m_noise.length_counter, sizeof(m_noise.length_counter));
+    writer.write(&m_noise.period, sizeof(m_noise.period));
+    writer.write(&m_noise.time, sizeof(m_noise.time));
+    writer.write(&m_noise.envelope_counter, sizeof(m_noise.envelope_counter));
+    writer.write(&m_noise.envelope_rate, sizeof(m_noise.envelope_rate));
+    writer.write(&m_noise.envelope_progress, sizeof(m_noise.envelope_progress));
+    writer.write(&m_noise.previous_sample, sizeof(m_noise.previous_sample));
+    writer.write(&m_noise.shift_register, sizeof(m_noise.shift_register));
+
+    writer.write(&m_dmc.enabled, sizeof(m_dmc.enabled));
+    writer.write(&m_dmc.loop, sizeof(m_dmc.loop));
+    writer.write(m_dmc.registers, 4);
+
+    writer.write(&m_status_register, sizeof(m_status_register));
+    writer.write(&m_frame_counter_register, sizeof(m_frame_counter_register));
+}
+
+
+template<typename Sink>
+void APUSynth<Sink>::deserialize(StateReader& reader)
+{
+    for (int i = 0; i < 2; ++i)
+    {
+        auto pulse = &m_pulses[i];
+        
+        reader.read(&pulse->enabled, sizeof(pulse->enabled));
+        reader.read(&pulse->loop, sizeof(pulse->loop));
+        reader.read(&pulse->constant_volume, sizeof(pulse->constant_volume));
+        reader.read(&pulse->duty, sizeof(pulse->duty));
+        reader.read(&pulse->progress, sizeof(pulse->progress));
+        reader.read(&pulse->frequency, sizeof(pulse->frequency));
+        reader.read(&pulse->volume, sizeof(pulse->volume));
+        reader.read(pulse->registers, 4);
+        reader.read(&pulse->length_counter, sizeof(pulse->length_counter));
+        reader.read(&pulse->timer, sizeof(pulse->timer));
+        reader.read(&pulse->time, sizeof(pulse->time));
+        reader.read(&pulse->envelope_counter, sizeof(pulse->envelope_counter));
+        reader.read(&pulse->envelope_rate, sizeof(pulse->envelope_rate));
+        reader.read(&pulse->envelope_progress, sizeof(pulse->envelope_progress));
+    }
+
+    reader.read(&m_triangle.enabled, sizeof(m_triangle.enabled));
+    reader.read(&m_triangle.reload_flag, sizeof(m_triangle.reload_flag));
+    reader.read(&m_triangle.progress, sizeof(m_triangle.progress));
+    reader.read(&m_triangle.frequency, sizeof(m_triangle.frequency));
+    reader.read(m_triangle.registers, 4);
+    reader.read(&m_triangle.length_counter, sizeof(m_triangle.length_counter));
+    reader.read(&m_triangle.control_flag, sizeof(m_triangle.control_flag));
+    reader.read(&m_triangle.linear_counter, sizeof(m_triangle.linear_counter));
+    reader.read(&m_triangle.timer, sizeof(m_triangle.timer));
+    reader.read(&m_triangle.time, sizeof(m_triangle.time));
+    reader.read(&m_triangle.reload_value, sizeof(m_triangle.reload_value));
+
+    reader.read(&m_noise.enabled, sizeof(m_noise.enabled));
+    reader.read(&m_noise.loop, sizeof(m_noise.loop));
+    reader.read(&m_noise.mode, sizeof(m_noise.mode));
+    reader.read(&m_noise.constant_volume, sizeof(m_noise.constant_volume));
+    reader.read(&m_noise.progress, sizeof(m_noise.progress));
+    reader.read(&m_noise.frequency, sizeof(m_noise.frequency));
+    reader.read(&m_noise.volume, sizeof(m_noise.volume));
+    reader.read(m_noise.registers, 4);
+    reader.read(&m_noise.length_counter, sizeof(m_noise.length_counter));
+    reader.read(&m_noise.period, sizeof(m_noise.period));
+    reader.read(&m_noise.time, sizeof(m_noise.time));
+    reader.read(&m_noise.envelope_counter, sizeof(m_noise.envelope_counter));
+    reader.read(&m_noise.envelope_rate, sizeof(m_noise.envelope_rate));
+    reader.read(&m_noise.envelope_progress, sizeof(m_noise.envelope_progress));
+    reader.read(&m_noise.previous_sample, sizeof(m_noise.previous_sample));
+    reader.read(&m_noise.shift_register, sizeof(m_noise.shift_register));
+
+    reader.read(&m_dmc.enabled, sizeof(m_dmc.enabled));
+    reader.read(&m_dmc.loop, sizeof(m_dmc.loop));
+    reader.read(m_dmc.registers, 4);
+
+    reader.read(&m_status_register, sizeof(m_status_register));
+    reader.read(&m_frame_counter_register, sizeof(m_frame_counter_register));
+}
+
+
+template<typename Sink>
+void APUSynth<Sink>::write_register(int64_t cycle, int addr, uint8_t val)
+{
+    run(cycle); // Play up to the write with the old settings
+
+    if (addr == 0x4000 || addr == 0x4004) // Pulse reg 0
+    {
+        auto pulse = &m_pulses[(addr - 0x4000) / 4];
+        pulse->registers[0] = val;
+
+        int duty = (val >> 6) & 0b11;
+        int loop = (val & 0b100000) ? 1 : 0;
+        int constant_volume = (val & 0b10000) ? 1 : 0;
+        int volume = (val & 0b1111);
+
+        pulse->constant_volume = constant_volume ? true : false;
+        pulse->duty = duty;
+        pulse->loop = loop ? true : false;
+        if (constant_volume)
+        {
+            pulse->volume = (float)volume / 15.0f;
+            pulse->envelope_counter = 0;
+            pulse->envelope_rate = 0.0;
+            pulse->envelope_progress = 0.0;
+        }
+        else
+        {
+            pulse->volume = 1.0f;
+            pulse->envelope_counter = 15;
+            pulse->envelope_rate = 1.0 / (double)(volume + 1);
+            pulse->envelope_progress = 0.0;
+        }
+    }
+    else if (addr == 0x4001 || addr == 0x4005) // Pulse reg 1
+    {
+        auto pulse = &m_pulses[(addr - 0x4001) / 4];
+        pulse->registers[1] = val; // Sweep, not emulated
+    }
+    else if (addr == 0x4002 || addr == 0x4006) // Pulse reg 2
+    {
+        auto pulse = &m_pulses[(addr - 0x4002) / 4];
+        pulse->registers[2] = val;
+
+        int timer_low = val;
+
+        pulse->timer = timer_low;
+    }
+    else if (addr == 0x4003 || addr == 0x4007) // Pulse reg 3
+    {
+        auto pulse = &m_pulses[(addr - 0x4003) / 4];
+        pulse->registers[3] = val;
+
+        int length_counter = (val >> 3) & 0b11111;
+        int timer_high = val & 0b111;
+
+        pulse->length_counter = LENGTH_COUNTER_TABLE[length_counter];
+        pulse->timer = pulse->timer | (timer_high << 8);
+        pulse->progress = 0.0;
+        pulse->time = 0;
+        pulse->frequency = (double)CPU_CLOCK_SPEED / (16.0 * ((double)pulse->timer + 1.0));
+        
+        if (pulse->enabled && !pulse->constant_volume)
+        {
+            pulse->envelope_counter = 15;
+            pulse->envelope_rate = 1.0 / (double)(pulse->volume * 15.0f + 1);
+            pulse->envelope_progress = 0.0;
+        }
+    }
+    else if (addr == 0x4008) // Triangle reg 0
+    {
+        m_triangle.registers[0] = val;
+
+        int control_flag = (val & 0b10000000) ? 1 : 0;
+        int counter_reload = val & 0b01111111;
+
+        m_triangle.control_flag = control_flag ? true : false;
+        m_triangle.reload_value = counter_reload + 1;
+    }
+    else if (addr == 0x4009) // Triangle reg 1
+    {
+        m_triangle.registers[1] = val;
+    }
+    else if (addr == 0x400A) // Triangle reg 2
+    {
+        m_triangle.registers[2] = val;
+
+        int timer_low = val;
+
+        m_triangle.timer = timer_low;
+    }
+    else if (addr == 0x400B) // Triangle reg 3
+    {
+        m_triangle.registers[3] = val;
+
+        int length_counter = (val >> 3) & 0b11111;
+        int timer_high = val & 0b111;
+
+        m_triangle.length_counter = LENGTH_COUNTER_TABLE[length_counter];
+        m_triangle.timer = m_triangle.timer | (timer_high << 8);
+        m_triangle.frequency = (double)CPU_CLOCK_SPEED / (32.0 * ((double)m_triangle.timer + 1.0));
+        m_triangle.reload_flag = true;
+    }
+    else if (addr == 0x400C) // Noise reg 0
+    {
+        m_noise.registers[0] = val;
+
+        int loop = (val & 0b100000) ? 1 : 0;
+        int constant_volume = (val & 0b10000) ? 1 : 0;
+        int volume = (val & 0b1111);
+
+        m_noise.constant_volume = constant_volume ? true : false;
+        m_noise.loop = loop ? true : false;
+        if (constant_volume)
+        {
+            m_noise.volume = (float)volume / 15.0f;
+            m_noise.envelope_counter = 0;
+            m_noise.envelope_rate = 0.0;
+            m_noise.envelope_progress = 0.0;
+        }
+        else
+        {
+            m_noise.volume = (float)volume / 15.0f;
+            m_noise.envelope_counter = 15;
+            m_noise.envelope_rate = 1.0 / (double)(volume + 1);
+            m_noise.envelope_progress = 0.0;
+        }
+    }
+    else if (addr == 0x400D) // Noise reg 1
+    {
+        m_noise.registers[1] = val;
+    }
+    else if (addr == 0x400E) // Noise reg 2
+    {
+        m_noise.registers[2] = val;
+
+        int mode = (val & 0b10000000) ? 1 : 0;
+        int period = val & 0b1111;
+
+        m_noise.frequency = (double)CPU_CLOCK_SPEED / NOISE_FREQUENCY_TABLE[period];
+        m_noise.mode = mode ? true : false;
+    }
+    else if (addr == 0x400F) // Noise reg 3
+    {
+        m_noise.registers[3] = val;
+
+        int length_counter = (val >> 3) & 0b11111;
+
+        m_noise.length_counter = LENGTH_COUNTER_TABLE[length_counter];
+        if (m_noise.enabled && !m_noise.constant_volume)
+        {
+            m_noise.envelope_counter = 15;
+            m_noise.envelope_rate = 1.0 / (double)(m_noise.volume * 15.0f + 1);
+            m_noise.envelope_progress = 0.0;
+        }
+    }
+    else if (addr == 0x4010) // DCM reg 0
+    {
+        m_dmc.registers[0] = val;
+    }
+    else if (addr == 0x4011) // DCM reg 1
+    {
+        m_dmc.registers[1] = val;
+    }
+    else if (addr == 0x4012) // DCM reg 2
+    {
+        m_dmc.registers[2] = val;
+    }
+    else if (addr == 0x4013) // DCM reg 3
+    {
+        m_dmc.registers[3] = val;
+    }
+    else if (addr == 0x4015)
+    {
+        m_status_register = val;
+
+        m_pulses[0].enabled = (val & 0b1) != 0;
+        m_pulses[1].enabled = (val & 0b10) != 0;
+        m_triangle.enabled = (val & 0b100) != 0;
+        m_noise.enabled = (val & 0b1000) != 0;
+        m_dmc.enabled = (val & 0b10000) != 0;
+
+        if (!m_pulses[0].enabled) m_pulses[0].length_counter = 0;
+        if (!m_pulses[1].enabled) m_pulses[1].length_counter = 0;
+        if (!m_triangle.enabled) m_triangle.length_counter = 0;
+        if (!m_noise.enabled) m_noise.length_counter = 0;
+    }
+    else if (addr == 0x4017)
+    {
+        m_frame_counter_register = val;
+    }
+
+    update_output((double)cycle);
+}
+
+
+template<typename Sink>
+uint8_t APUSynth<Sink>::read_register(int addr) const
+{
+    if (addr == 0x4000 || addr == 0x4004)
+    {
+        auto pulse = &m_pulses[(addr - 0x4000) / 4];
+        return pulse->registers[0];
+    }
+    else if (addr == 0x4001 || addr == 0x4005)
+    {
+        auto pulse = &m_pulses[(addr - 0x4000) / 4];
+        return pulse->registers[1];
+    }
+    else if (addr == 0x4002 || addr == 0x4006)
+    {
+        auto pulse = &m_pulses[(addr - 0x4000) / 4];
+        return pulse->registers[2];
+    }
+    else if (addr == 0x4003 || addr == 0x4007)
+    {
+        auto pulse = &m_pulses[(addr - 0x4000) / 4];
+        return pulse->registers[3];
+    }
+    else if (addr == 0x4008)
+    {
+        return m_triangle.registers[0];
+    }
+    else if (addr == 0x4009)
+    {
+        return m_triangle.registers[1];
+    }
+    else if (addr == 0x400A)
+    {
+        return m_triangle.registers[2];
+    }
+    else if (addr == 0x400B)
+    {
+        return m_triangle.registers[3];
+    }
+    else if (addr == 0x400C)
+    {
+        return m_noise.registers[0];
+    }
+    else if (addr == 0x400D)
+    {
+        return m_noise.registers[1];
+    }
+    else if (addr == 0x400E)
+    {
+        return m_noise.registers[2];
+    }
+    else if (addr == 0x400F)
+    {
+        return m_noise.registers[3];
+    }
+    else if (addr == 0x4010)
+    {
+        return m_dmc.registers[0];
+    }
+    else if (addr == 0x4011)
+    {
+        return m_dmc.registers[1];
+    }
+    else if (addr == 0x4012)
+    {
+        return m_dmc.registers[2];
+    }
+    else if (addr == 0x4013)
+    {
+        return m_dmc.registers[3];
+    }
+    else if (addr == 0x4015)
+    {
+        return m_status_register;
+    }
+    else if (addr == 0x4017)
+    {
+        return m_frame_counter_register;
+    }
+
+    return 0;
+}
+
+
+template<typename Sink>
+int64_t APUSynth<Sink>::get_cycles_to_next_tick() const
+{
+    // Accumulators advance by their rate every cycle and tick when they reach 1
+    auto cycles_to_tick = [](double progress, double rate)
+    {
+        return std::max<int64_t>(1, (int64_t)ceil((1.0 - progress) / rate));
+    };
+
+    int64_t cycles = cycles_to_tick(m_240hz_progress, m_240hz_rate);
+    cycles = std::min(cycles, cycles_to_tick(m_120hz_progress, m_120hz_rate));
+    cycles = std::min(cycles, cycles_to_tick(m_60hz_progress, m_60hz_rate));
+    return cycles;
+}
+
+
+template<typename Sink>
+int APUSynth<Sink>::clock_sequencer(int64_t cycle, int64_t cycles)
+{
+    m_240hz_progress += m_240hz_rate * (double)cycles;
+    m_120hz_progress += m_120hz_rate * (double)cycles;
+    m_60hz_progress += m_60hz_rate * (double)cycles;
+    if (m_240hz_progress < 1.0 && m_120hz_progress < 1.0 && m_60hz_progress < 1.0)
+        return 0; // Rounding, it will tick on the next cycle
+
+    // Envelopes and counters change what the channels output, play them up to here first
+    run(cycle);
+
+    while (m_240hz_progress >= 1.0)
+    {
+        m_240hz_progress -= 1.0;
+
+        // Envelopes on pulses
+        for (int i = 0; i < 2; ++i)
+        {
+            auto pulse = &m_pulses[i];
+
+            if (!pulse->constant_volume)
+            {
+                if (pulse->envelope_counter > 0 || pulse->loop)
+                {
+                    pulse->envelope_progress += pulse->envelope_rate;
+                    while (pulse->envelope_progress >= 1.0)
+                    {
+                        pulse->envelope_progress -= 1.0;
+                        pulse->envelope_counter--;
+                        pulse->volume = (float)pulse->envelope_counter / 15.0f;
+                        if (pulse->envelope_counter == 0 && pulse->loop)
+                        {
+                            pulse->envelope_counter = 15;
+                            pulse->volume = 1.0f;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Envelope on noise
+        if (!m_noise.constant_volume)
+        {
+            if (m_noise.envelope_counter > 0 || m_noise.loop)
+            {
+                m_noise.envelope_progress += m_noise.envelope_rate;
+                while (m_noise.envelope_progress >= 1.0)
+                {
+                    m_noise.envelope_progress -= 1.0;
+                    m_noise.envelope_counter--;
+                    m_noise.volume = (float)m_noise.envelope_counter / 15.0f;
+                    if (m_noise.envelope_counter == 0 && m_noise.loop)
+                    {
+                        m_noise.envelope_counter = 15;
+                        m_noise.volume = 1.0f;
+                    }
+                }
+            }
+        }
+    }
+
+    while (m_120hz_progress >= 1.0)
+    {
+        m_120hz_progress -= 1.0;
+
+        // Pulses
+        for (int i = 0; i < 2; ++i)
+        {
+            auto pulse = &m_pulses[i];
+
+            if (pulse->length_counter > 0 && !pulse->loop)
+                pulse->length_counter--;
+        }
+
+        // Triangle
+        if (m_triangle.length_counter > 0 && !m_triangle.control_flag)
+            m_triangle.length_counter--;
+
+        if (m_triangle.reload_flag)
+        {
+            m_triangle.linear_counter = m_triangle.reload_value;
+        }
+        else if (m_triangle.linear_counter > 0)
+        {
+            m_triangle.linear_counter--;
+        }
+        if (!m_triangle.control_flag)
+        {
+            m_triangle.reload_flag = false;
+        }
+
+        // Noise
+        if (m_noise.length_counter > 0 && !m_noise.loop)
+            m_noise.length_counter--;
+    }
+
+    // Frames, the players call their "NMI" on those
+    int frames = 0;
+    while (m_60hz_progress >= 1.0)
+    {
+        m_60hz_progress -= 1.0;
+        frames++;
+    }
+
+    update_output((double)cycle);
+    return frames;
+}
+
+
+template<typename Sink>
+void APUSynth<Sink>::reset_sequencer()
+{
+    m_60hz_progress = 0.0;
+    m_120hz_progress = 0.0;
+    m_240hz_progress = 0.0;
+}
+
+
+template<typename Sink>
+bool APUSynth<Sink>::is_pulse_playing(int idx) const
+{
+    return m_pulses[idx].length_counter > 0 && m_pulses[idx].timer >= 8;
+}
+
+
+template<typename Sink>
+bool APUSynth<Sink>::is_triangle_playing() const
+{
+    // Once silenced, it still finishes its current period
+    return (m_triangle.enabled && m_triangle.length_counter > 0 && m_triangle.linear_counter > 0 && m_triangle.timer > 0) || m_triangle.time != 0;
+}
+
+
+template<typename Sink>
+bool APUSynth<Sink>::is_noise_playing() const
+{
+    return m_noise.enabled && m_noise.length_counter > 0;
+}
+
+
+template<typename Sink>
+void APUSynth<Sink>::clock_noise()
+{
+    int bit_a = m_noise.shift_register & 0b1;
+    int bit_b = (m_noise.shift_register >> 1) & 0b1;
+    if (m_noise.mode)
+        bit_b = (m_noise.shift_register >> 6) & 0b1;
+    int feedback = bit_a ^ bit_b;
+    m_noise.shift_register >>= 1;
+    m_noise.shift_register = (m_noise.shift_register & 0b11111111111111) | (feedback << 14);
+
+    m_noise.previous_sample = (float)(!(m_noise.shift_register & 0b1)) * m_noise.volume;
+}
+
+
+template<typename Sink>
+void APUSynth<Sink>::run(int64_t cycle)
+{
+    if (cycle <= m_synth_cycle)
+        return;
+
+    const double from = (double)m_synth_cycle;
+    const double to = (double)cycle;
+    m_synth_cycle = cycle;
+
+    // Pulses, triangle, noise. Each steps its waveform every period CPU cycles while playing,
+    // progress being how far it is into the current step.
+    const double periods[4] = {
+        (double)CPU_CLOCK_SPEED / (m_pulses[0].frequency * 8.0),
+        (double)CPU_CLOCK_SPEED / (m_pulses[1].frequency * 8.0),
+        (double)CPU_CLOCK_SPEED / (m_triangle.frequency * 32.0),
+        (double)CPU_CLOCK_SPEED / m_noise.frequency
+    };
+    double* progresses[4] = { &m_pulses[0].progress, &m_pulses[1].progress, &m_triangle.progress, &m_noise.progress };
+    bool playing[4] = { is_pulse_playing(0), is_pulse_playing(1), is_triangle_playing(), is_noise_playing() };
+    double next_steps[4];
+    for (int i = 0; i < 4; ++i)
+        next_steps[i] = playing[i] ? from + (1.0 - *progresses[i]) * periods[i] : DBL_MAX;
+
+    // Step them in time order, since the mixer isn't linear and each output change depends on the others
+    while (true)
+    {
+        int idx = 0;
+        for (int i = 1; i < 4; ++i)
+            if (next_steps[i] < next_steps[idx])
+                idx = i;
+
+        double t = next_steps[idx];
+        if (t >= to)
+            break;
+
+        switch (idx)
+        {
+            case 0:
+            case 1:
+                m_pulses[idx].time = (m_pulses[idx].time + 1) & 7;
+                break;
+            case 2:
+                m_triangle.time = (m_triangle.time + 1) & 31;
+                playing[2] = is_triangle_playing();
+                if (!playing[2])
+                    m_triangle.progress = 0.0;
+                break;
+            case 3:
+                clock_noise();
+                break;
+        }
+
+        next_steps[idx] = playing[idx] ? t + periods[idx] : DBL_MAX;
+        update_output(t);
+    }
+
+    for (int i = 0; i < 4; ++i)
+        if (playing[i])
+            *progresses[i] = 1.0 - (next_steps[i] - to) / periods[i];
+}
+
+
+template<typename Sink>
+void APUSynth<Sink>::resync(int64_t cycle)
+{
+    m_synth_cycle = cycle;
+    update_output((double)cycle);
+}
+
+
+template<typename Sink>
+void APUSynth<Sink>::update_output(double cycle)
+{
+    int level = get_output_level();
+    if (level != m_output_level)
+    {
+        m_sink->add_delta(cycle, level - m_output_level);
+        m_output_level = level;
+    }
+}
+
+
+template<typename Sink>
+int APUSynth<Sink>::get_output_level() const
+{
+    float pulse_samples[2] = { 0.0f, 0.0f };
+    float triangle_sample = 0.0;
+    float noise_sample = 0.0;
+    float dmc_sample = 0.0;
+
+    for (int i = 0; i < 2; ++i)
+        if (is_pulse_playing(i))
+            pulse_samples[i] = (float)PULSE_WAVE_DATA[m_pulses[i].duty][m_pulses[i].time] * m_pulses[i].volume;
+
+    if (is_triangle_playing())
+        triangle_sample = (float)TRIANGLE_WAVE_DATA[m_triangle.time] / 15.0f;
+
+    if (is_noise_playing())
+        noise_sample = m_noise.previous_sample * m_noise.volume; // Why is this too loud?
+
+    // Mixing
+    float sample = 0.0f;
+
+    // DACs
+    float pulse_group = pulse_samples[0] * 15.0f + pulse_samples[1] * 15.0f;
+    if (pulse_group > 0.0f)
+        sample += 95.88f / ((8128.0f / pulse_group) + 100.0f);
+
+    float tnd_group = (triangle_sample * 15.0f / 8227.0f) + (noise_sample * 15.0f / 12241.0f) + (dmc_sample * 127.0f / 22638.0f);
+    if (tnd_group > 0.0f)
+        sample += 159.79f / (1.0f / tnd_group + 100.0f);
+
+    return (int)lroundf(sample * (float)Sink::LEVEL_SCALE);
+}
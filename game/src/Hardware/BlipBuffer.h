@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cinttypes>
+#include <math.h>
+#include <memory.h>
+
+
+// Band-limited step synthesis. Instead of point sampling waveforms, output level changes are
+// added as deltas at clock timestamps. Each one is spread over a few samples with a windowed
+// sinc step, so square waves don't alias. Reading integrates the deltas back into samples.
+// Output is delayed by about KERNEL_WIDTH / 2 samples.
+// Header-only and allocation free: blocks are at most MAX_SAMPLES long.
+class BlipBuffer final
+{
+public:
+    static const int LEVEL_SCALE = 1 << 16; // Delta units for an amplitude of 1.0
+    static constexpr int MAX_SAMPLES = 4096; // Per block. constexpr so std::min() can take it by reference.
+
+    void set_rates(double clock_rate, double sample_rate);
+    void clear(int64_t clock); // Next block starts at clock
+
+    // Clocks the next block must run for sample_count (at most MAX_SAMPLES) samples to be ready
+    int64_t clocks_needed(int sample_count) const;
+
+    // Clocks are absolute. A delta can fall between clocks, but not before the current block.
+    void add_delta(double clock, int delta);
+    void end_block(int64_t clock); // Next block starts at clock
+
+    // Removes sample_count samples (at most get_samples_available()), as amplitudes
+    void read_samples(float* out, int sample_count);
+    int get_samples_available() const { return m_available; }
+
+    // Fraction of a sample the next block starts at
+    double get_sample_offset() const;
+    void set_sample_offset(double offset);
+
+private:
+    static const int FRAC_BITS = 32;
+    static const int PHASE_BITS = 5;
+    static const int PHASE_COUNT = 1 << PHASE_BITS;
+    static const int KERNEL_WIDTH = 16;
+    static const int KERNEL_UNIT = 1 << 14; // Sum of a kernel's taps
+
+    static const int32_t* get_kernels(); // PHASE_COUNT x KERNEL_WIDTH
+
+    int64_t m_deltas[MAX_SAMPLES + KERNEL_WIDTH] = { 0 };
+    double m_factor = 0.0; // Samples per clock, FRAC_BITS fixed point
+    uint64_t m_offset = 0; // Where the block starts past the available samples, FRAC_BITS fixed point
+    int64_t m_block_clock = 0;
+    int m_available = 0;
+    int64_t m_integrator = 0;
+};
+
+
+inline void BlipBuffer::set_rates(double clock_rate, double sample_rate)
+{
+    m_factor = sample_rate / clock_rate * (double)(1ull << FRAC_BITS);
+    get_kernels(); // Build them now rather than on the first delta
+}
+
+
+inline void BlipBuffer::clear(int64_t clock)
+{
+    memset(m_deltas, 0, sizeof(m_deltas));
+    m_offset = 0;
+    m_block_clock = clock;
+    m_available = 0;
+    m_integrator = 0;
+}
+
+
+inline int64_t BlipBuffer::clocks_needed(int sample_count) const
+{
+    if (sample_count > MAX_SAMPLES)
+        sample_count = MAX_SAMPLES;
+    int needed_samples = sample_count - m_available;
+    if (needed_samples <= 0 || m_factor <= 0.0)
+        return 0;
+
+    uint64_t needed = ((uint64_t)needed_samples << FRAC_BITS) - m_offset;
+    int64_t clocks = (int64_t)ceil((double)needed / m_factor);
+    while ((uint64_t)((double)clocks * m_factor) < needed) // Rounding
+        clocks++;
+    return clocks;
+}
+
+
+inline void BlipBuffer::add_delta(double clock, int delta)
+{
+    double clock_time = clock - (double)m_block_clock;
+    if (clock_time < 0.0)
+        clock_time = 0.0;
+
+    uint64_t fixed = ((uint64_t)m_available << FRAC_BITS) + m_offset + (uint64_t)(clock_time * m_factor);
+    int pos = (int)(fixed >> FRAC_BITS);
+    int phase = (int)(fixed >> (FRAC_BITS - PHASE_BITS)) & (PHASE_COUNT - 1);
+    if (pos > MAX_SAMPLES)
+        pos = MAX_SAMPLES; // Block ran longer than it should. Late, but the level stays right.
+
+    const int32_t* kernel = get_kernels() + phase * KERNEL_WIDTH;
+    int64_t* out = m_deltas + pos;
+    for (int i = 0; i < KERNEL_WIDTH; ++i)
+        out[i] += (int64_t)kernel[i] * delta;
+}
+
+
+inline void BlipBuffer::end_block(int64_t clock)
+{
+    m_offset += (uint64_t)((double)(clock - m_block_clock) * m_factor);
+    m_available += (int)(m_offset >> FRAC_BITS);
+    m_offset &= (1ull << FRAC_BITS) - 1;
+    m_block_clock = clock;
+    if (m_available > MAX_SAMPLES)
+        m_available = MAX_SAMPLES;
+}
+
+
+inline void BlipBuffer::read_samples(float* out, int sample_count)
+{
+    if (sample_count > m_available)
+        sample_count = m_available;
+    if (sample_count <= 0)
+        return;
+
+    const double scale = 1.0 / ((double)LEVEL_SCALE * (double)KERNEL_UNIT);
+    for (int i = 0; i < sample_count; ++i)
+    {
+        m_integrator += m_deltas[i];
+        out[i] = (float)((double)m_integrator * scale);
+    }
+
+    // Shift what's left, including the kernel tails that spill past the available samples
+    int remaining = m_available - sample_count + KERNEL_WIDTH;
+    memmove(m_deltas, m_deltas + sample_count, remaining * sizeof(int64_t));
+    memset(m_deltas + remaining, 0, sample_count * sizeof(int64_t));
+    m_available -= sample_count;
+}
+
+
+inline double BlipBuffer::get_sample_offset() const
+{
+    return (double)m_offset / (double)(1ull << FRAC_BITS);
+}
+
+
+inline void BlipBuffer::set_sample_offset(double offset)
+{
+    if (offset < 0.0 || offset >= 1.0)
+        offset = 0.0;
+    m_offset = (uint64_t)(offset * (double)(1ull << FRAC_BITS));
+}
+
+
+inline const int32_t* BlipBuffer::get_kernels()
+{
+    static const double KERNEL_CUTOFF = 0.4; // In cycles per sample, a bit under Nyquist
+    static const double KERNEL_HALF_SPAN = 6.5; // Windowed sinc support, in samples
+    static const double KERNEL_DELAY = 7.5; // Where in the kernel the step is centered, in samples
+    static const int STEP_RESOLUTION = 64; // Step table entries per sample
+    static const int STEP_COUNT = 13 * STEP_RESOLUTION; // KERNEL_HALF_SPAN * 2
+
+    struct kernels_t
+    {
+        int32_t taps[PHASE_COUNT * KERNEL_WIDTH];
+
+        kernels_t()
+        {
+            // Band-limited unit step: running integral of a Blackman windowed sinc, sampled every 1/STEP_RESOLUTION
+            static double step[STEP_COUNT + 1];
+            const int subdivisions = 16;
+            step[0] = 0.0;
+            for (int i = 0; i < STEP_COUNT; ++i)
+            {
+                double area = 0.0;
+                for (int s = 0; s < subdivisions; ++s)
+                {
+                    double x = -KERNEL_HALF_SPAN + ((double)i + ((double)s + 0.5) / (double)subdivisions) / (double)STEP_RESOLUTION;
+                    double t = 3.14159265358979323846 * 2.0 * KERNEL_CUTOFF * x;
+                    double sinc = t == 0.0 ? 1.0 : sin(t) / t;
+                    double w = 3.14159265358979323846 * x / KERNEL_HALF_SPAN;
+                    double window = 0.42 + 0.5 * cos(w) + 0.08 * cos(2.0 * w);
+                    area += sinc * window;
+                }
+                step[i + 1] = step[i] + area;
+            }
+            for (int i = 0; i <= STEP_COUNT; ++i)
+                step[i] /= step[STEP_COUNT];
+
+            auto step_at = [](double x)
+            {
+                double i = (x + KERNEL_HALF_SPAN) * (double)STEP_RESOLUTION;
+                if (i <= 0.0) return 0.0;
+                if (i >= (double)STEP_COUNT) return 1.0;
+                return step[(int)(i + 0.5)];
+            };
+
+            // Each phase's taps are the step's sample to sample differences, so integrating them rebuilds it
+            for (int p = 0; p < PHASE_COUNT; ++p)
+            {
+                double frac = (double)p / (double)PHASE_COUNT;
+                int32_t* kernel = taps + p * KERNEL_WIDTH;
+                int sum = 0;
+                int largest = 0;
+                for (int k = 0; k < KERNEL_WIDTH; ++k)
+                {
+                    double x = (double)k - frac - KERNEL_DELAY;
+                    kernel[k] = (int32_t)lround((step_at(x) - step_at(x - 1.0)) * (double)KERNEL_UNIT);
+                    sum += kernel[k];
+                    if (kernel[k] > kernel[largest]) largest = k;
+                }
+                kernel[largest] += KERNEL_UNIT - sum; // Exact, so levels don't drift
+            }
+        }
+    };
+
+    static const kernels_t kernels;
+    return kernels.taps;
+}
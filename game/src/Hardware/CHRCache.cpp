@@ -0,0 +1,53 @@
+#include "CHRCache.h"
+#include "Cart.h"
+
+#include <memory.h>
+
+
+static_assert(CHRCache::TILE_COUNT == Cart::CHR_TILE_COUNT, "CHRCache covers all the cart CHR tiles");
+
+
+CHRCache::CHRCache(const Cart* cart)
+    : m_cart(cart)
+{
+    memset(m_tiles, 0, sizeof(m_tiles));
+}
+
+
+void CHRCache::decode_tile(const uint8_t* src, uint8_t* out)
+{
+    for (int y = 0; y < 8; ++y)
+    {
+        uint8_t plane0 = src[y];
+        uint8_t plane1 = src[y + 8];
+        for (int x = 0; x < 8; ++x)
+        {
+            int b0 = (plane0 >> (7 - x)) & 1;
+            int b1 = (plane1 >> (7 - x)) & 1;
+            *out++ = static_cast<uint8_t>((b0) | (b1 << 1));
+        }
+    }
+}
+
+
+void CHRCache::refresh(bool* out_dirty)
+{
+    for (int i = 0; i < TILE_COUNT; ++i)
+    {
+        uint32_t generation = m_cart->get_chr_tile_generation(i);
+        bool dirty = m_all_dirty || generation != m_generations[i];
+        if (dirty)
+        {
+            decode_tile(m_cart->get_chr_tile(i), m_tiles[i]);
+            m_generations[i] = generation;
+        }
+        if (out_dirty) out_dirty[i] = dirty;
+    }
+    m_all_dirty = false;
+}
+
+
+void CHRCache::invalidate()
+{
+    m_all_dirty = true;
+}
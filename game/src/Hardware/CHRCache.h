@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cinttypes>
+
+
+class Cart;
+
+
+// Cart CHR decoded to one palette index (0-3) per pixel, so rasterizers
+// don't have to go through the PPU bus and shift bitplanes.
+// Tiles are refreshed individually when the cart reports they changed.
+class CHRCache final
+{
+public:
+    static const int TILE_COUNT = 512;
+    static const int TILE_SIZE = 8 * 8;
+
+    CHRCache(const Cart* cart);
+
+    // Decodes a 16 bytes 2bpp tile into 64 indices, row major
+    static void decode_tile(const uint8_t* src, uint8_t* out);
+
+    // Re-decodes the tiles that changed in the cart. out_dirty (TILE_COUNT) gets which ones did.
+    void refresh(bool* out_dirty = nullptr);
+    void invalidate();
+
+    const uint8_t* get_tile(int tile) const { return m_tiles[tile]; }
+
+private:
+    const Cart* m_cart = nullptr;
+    uint8_t m_tiles[TILE_COUNT][TILE_SIZE];
+    uint32_t m_generations[TILE_COUNT] = { 0 };
+    bool m_all_dirty = true;
+};
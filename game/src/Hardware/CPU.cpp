@@ -1,11 +1,6 @@
 #include "CPU.h"
 #include "CPUBUS.h"
 
-#include <onut/Font.h>
-#include <onut/SpriteBatch.h>
-
-#include <cmath>
-
 
 static uint8 MCS6502_global_read(uint16 addr, void * readWriteContext)
 {
@@ -51,42 +46,42 @@ void CPU::NMI()
 }
 
 
-void CPU::serialize(FILE* f, int version) const
+void CPU::serialize(StateWriter& writer, int version) const
 {
-    fwrite(&m_halt_cycles, sizeof(m_halt_cycles), 1, f);
-
-    fwrite(&m_cpu_context.a, sizeof(m_cpu_context.a), 1, f);
-    fwrite(&m_cpu_context.x, sizeof(m_cpu_context.x), 1, f);
-    fwrite(&m_cpu_context.y, sizeof(m_cpu_context.y), 1, f);
-    fwrite(&m_cpu_context.sp, sizeof(m_cpu_context.sp), 1, f);
-    fwrite(&m_cpu_context.pc, sizeof(m_cpu_context.pc), 1, f);
-    fwrite(&m_cpu_context.p, sizeof(m_cpu_context.p), 1, f);
-    fwrite(&m_cpu_context.pendingTiming, sizeof(m_cpu_context.pendingTiming), 1, f);
-    fwrite(&m_cpu_context.timingForLastOperation, sizeof(m_cpu_context.timingForLastOperation), 1, f);
+    writer.write(&m_halt_cycles, sizeof(m_halt_cycles));
+
+    writer.write(&m_cpu_context.a, sizeof(m_cpu_context.a));
+    writer.write(&m_cpu_context.x, sizeof(m_cpu_context.x));
+    writer.write(&m_cpu_context.y, sizeof(m_cpu_context.y));
+    writer.write(&m_cpu_context.sp, sizeof(m_cpu_context.sp));
+    writer.write(&m_cpu_context.pc, sizeof(m_cpu_context.pc));
+    writer.write(&m_cpu_context.p, sizeof(m_cpu_context.p));
+    writer.write(&m_cpu_context.pendingTiming, sizeof(m_cpu_context.pendingTiming));
+    writer.write(&m_cpu_context.timingForLastOperation, sizeof(m_cpu_context.timingForLastOperation));
     uint8_t b;
     b = m_cpu_context.irqPending;
-    fwrite(&b, sizeof(b), 1, f);
+    writer.write(&b, sizeof(b));
     b = m_cpu_context.nmiPending;
-    fwrite(&b, sizeof(b), 1, f);
+    writer.write(&b, sizeof(b));
 }
 
 
-void CPU::deserialize(FILE* f, int version)
+void CPU::deserialize(StateReader& reader, int version)
 {
-    fread(&m_halt_cycles, sizeof(m_halt_cycles), 1, f);
-
-    fread(&m_cpu_context.a, sizeof(m_cpu_context.a), 1, f);
-    fread(&m_cpu_context.x, sizeof(m_cpu_context.x), 1, f);
-    fread(&m_cpu_context.y, sizeof(m_cpu_context.y), 1, f);
-    fread(&m_cpu_context.sp, sizeof(m_cpu_context.sp), 1, f);
-    fread(&m_cpu_context.pc, sizeof(m_cpu_context.pc), 1, f);
-    fread(&m_cpu_context.p, sizeof(m_cpu_context.p), 1, f);
-    fread(&m_cpu_context.pendingTiming, sizeof(m_cpu_context.pendingTiming), 1, f);
-    fread(&m_cpu_context.timingForLastOperation, sizeof(m_cpu_context.timingForLastOperation), 1, f);
-    uint8_t b;
-    fread(&b, sizeof(b), 1, f);
+    reader.read(&m_halt_cycles, sizeof(m_halt_cycles));
+
+    reader.read(&m_cpu_context.a, sizeof(m_cpu_context.a));
+    reader.read(&m_cpu_context.x, sizeof(m_cpu_context.x));
+    reader.read(&m_cpu_context.y, sizeof(m_cpu_context.y));
+    reader.read(&m_cpu_context.sp, sizeof(m_cpu_context.sp));
+    reader.read(&m_cpu_context.pc, sizeof(m_cpu_context.pc));
+    reader.read(&m_cpu_context.p, sizeof(m_cpu_context.p));
+    reader.read(&m_cpu_context.pendingTiming, sizeof(m_cpu_context.pendingTiming));
+    reader.read(&m_cpu_context.timingForLastOperation, sizeof(m_cpu_context.timingForLastOperation));
+    uint8_t b = 0;
+    reader.read(&b, sizeof(b));
     m_cpu_context.irqPending = b ? true : false;
-    fread(&b, sizeof(b), 1, f);
+    reader.read(&b, sizeof(b));
     m_cpu_context.nmiPending = b ? true : false;
 }
 
@@ -97,24 +92,22 @@ void CPU::halt(int cycles)
 }
 
 
-void CPU::tick()
+int CPU::step()
 {
     if (m_halt_cycles > 0)
     {
-        m_halt_cycles--;
-        return;
+        int cycles = m_halt_cycles;
+        m_halt_cycles = 0;
+        return cycles;
     }
-    MCS6502Tick(&m_cpu_context);
-}
 
-void CPU::render()
-{
-#if 0
-    auto font = OGetFont("font.fnt");
-    oSpriteBatch->begin();
-    char buf[260];
-    snprintf(buf, 260, "PC: 0x%02X", m_cpu_context.pc);
-    oSpriteBatch->drawText(font, buf, Vector2(50, 0));
-    oSpriteBatch->end();
-#endif
+    MCS6502ExecNext(&m_cpu_context);
+
+    // The instruction is considered in flight until the next step. This way an NMI raised
+    // by the PPU while it catches up is deferred to the instruction boundary.
+    int cycles = (int)m_cpu_context.timingForLastOperation;
+    if (cycles < 1) cycles = 1;
+    m_cpu_context.pendingTiming = (unsigned int)cycles;
+
+    return cycles;
 }
@@ -2,8 +2,7 @@
 
 #include "CPUPeripheral.h"
 #include "MCS6502.h"
-
-#include <stdio.h>
+#include "StateBuffer.h"
 
 
 class CPU final : public CPUPeripheral
@@ -11,16 +10,17 @@ class CPU final : public CPUPeripheral
 public:
     CPU();
 
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
+
+    std::vector<cpu_range_t> get_cpu_ranges() const override { return {}; } // Not memory mapped
 
     void NMI();
     void halt(int cycles);
     void reset();
-    void tick();
-
-    void render();
+    int step(); // Runs one instruction (or a whole DMA halt), returns the cycles it took
 
+    uint16_t get_pc() const { return m_cpu_context.pc; }
     uint8_t get_a() const { return m_cpu_context.a; }
     uint8_t get_x() const { return m_cpu_context.x; }
     uint8_t get_y() const { return m_cpu_context.y; }
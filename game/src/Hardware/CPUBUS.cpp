@@ -16,16 +16,44 @@ void CPUBUS::add_peripheral(CPUPeripheral* peripheral)
 {
     m_peripherals.push_back(peripheral);
     peripheral->set_cpu_bus(this);
+
+    // Register the peripheral in every page it touches. Pages keep the registration
+    // order so shared pages ($4000-$40FF) behave exactly like a full broadcast.
+    bool pages[PAGE_COUNT] = { false };
+    for (const auto& range : peripheral->get_cpu_ranges())
+    {
+        for (int page = range.first_addr >> 8; page <= (range.last_addr >> 8); ++page)
+        {
+            pages[page] = true;
+        }
+    }
+
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (!pages[page]) continue;
+
+        auto& entry = m_pages[page];
+        entry.peripherals.push_back(peripheral);
+        entry.owner = entry.peripherals.size() == 1 ? peripheral : nullptr;
+    }
 }
 
 
 bool CPUBUS::write(uint16_t addr, uint8_t data)
 {
+    const auto& page = m_pages[addr >> 8];
+
+    // Fast path: RAM, PRG ROM and most registers have a single owner
+    if (page.owner)
+    {
+        return page.owner->cpu_write(addr, data);
+    }
+
     bool ret = false;
 
-    for (int i = 0, len = (int)m_peripherals.size(); i < len; ++i)
+    for (int i = 0, len = (int)page.peripherals.size(); i < len; ++i)
     {
-        ret |= m_peripherals[i]->cpu_write(addr, data);
+        ret |= page.peripherals[i]->cpu_write(addr, data);
     }
 
     return ret;
@@ -34,11 +62,18 @@ bool CPUBUS::write(uint16_t addr, uint8_t data)
 
 bool CPUBUS::read(uint16_t addr, uint8_t* out_data)
 {
+    const auto& page = m_pages[addr >> 8];
+
+    if (page.owner)
+    {
+        return page.owner->cpu_read(addr, out_data);
+    }
+
     bool ret = false;
 
-    for (int i = 0, len = (int)m_peripherals.size(); i < len; ++i)
+    for (int i = 0, len = (int)page.peripherals.size(); i < len; ++i)
     {
-        ret |= m_peripherals[i]->cpu_read(addr, out_data);
+        ret |= page.peripherals[i]->cpu_read(addr, out_data);
     }
 
     return ret;
@@ -19,5 +19,14 @@ public:
     bool read(uint16_t addr, uint8_t* out_data);
 
 private:
+    static const int PAGE_COUNT = 256; // 256 bytes per page
+
+    struct page_t
+    {
+        CPUPeripheral* owner = nullptr; // Set when only one peripheral maps this page
+        std::vector<CPUPeripheral*> peripherals; // In registration order
+    };
+
     std::vector<CPUPeripheral*> m_peripherals;
+    page_t m_pages[PAGE_COUNT];
 };
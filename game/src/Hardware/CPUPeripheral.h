@@ -1,11 +1,20 @@
 #pragma once
 
 #include <cinttypes>
+#include <vector>
 
 
 class CPUBUS;
 
 
+// Inclusive address range a peripheral responds to on the CPU bus
+struct cpu_range_t
+{
+    uint16_t first_addr;
+    uint16_t last_addr;
+};
+
+
 class CPUPeripheral
 {
 public:
@@ -14,6 +23,10 @@ public:
     virtual bool cpu_write(uint16_t addr, uint8_t data) { return false; };
     virtual bool cpu_read(uint16_t addr, uint8_t* out_data) { return false; };
 
+    // Address ranges this peripheral owns. The bus only dispatches accesses
+    // that land in those ranges' pages. Default is the whole address space.
+    virtual std::vector<cpu_range_t> get_cpu_ranges() const { return { { 0x0000, 0xFFFF } }; }
+
     CPUBUS* get_cpu_bus() const { return m_cpu_bus; }
     void set_cpu_bus(CPUBUS* bus);
 
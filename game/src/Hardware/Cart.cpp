@@ -1,11 +1,11 @@
 #include "Cart.h"
 #include "Mapper001.h"
-
-#include <onut/Dialogs.h>
-#include <onut/onut.h>
+#include "ErrorHandler.h"
 
 #include <memory.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string>
 
 
 static const size_t ROM_HEADER_SIZE = 0x10;
@@ -55,7 +55,7 @@ Cart::Cart(const char* filename)
     FILE* f = fopen(filename, "rb");
     if (!f)
     {
-        onut::showMessageBox("ERROR", "Missing rom file: " + std::string(filename));
+        show_error("ERROR", "Missing rom file: " + std::string(filename));
         exit(0);
         return;
     }
@@ -66,7 +66,7 @@ Cart::Cart(const char* filename)
     if (rom_size <= ROM_HEADER_SIZE)
     {
         fclose(f);
-        onut::showMessageBox("ERROR", "(0x80000001) ROM too small: " + std::string(filename));
+        show_error("ERROR", "(0x80000001) ROM too small: " + std::string(filename));
         exit(0);
         return;
     }
@@ -78,7 +78,7 @@ Cart::Cart(const char* filename)
     {
         delete[] file_data;
         fclose(f);
-        onut::showMessageBox("ERROR", "(0x80000002) Failed to read ROM file: " + std::string(filename));
+        show_error("ERROR", "(0x80000002) Failed to read ROM file: " + std::string(filename));
         exit(0);
         return;
     }
@@ -90,7 +90,7 @@ Cart::Cart(const char* filename)
     if (header_size != ROM_HEADER_SIZE)
     {
         delete[] file_data;
-        onut::showMessageBox("ERROR", "(0x80000003) Header padding error");
+        show_error("ERROR", "(0x80000003) Header padding error");
         exit(0);
         return;
     }
@@ -100,7 +100,7 @@ Cart::Cart(const char* filename)
     if (memcmp(header.signature, ROM_SIGNATURE, 4))
     {
         delete[] file_data;
-        onut::showMessageBox("ERROR", "(0x80000004) Invalid ROM signature: " + std::string(filename));
+        show_error("ERROR", "(0x80000004) Invalid ROM signature: " + std::string(filename));
         exit(0);
         return;
     }
@@ -114,7 +114,7 @@ Cart::Cart(const char* filename)
     // Check ines version. For now, we only support ines1
     //if (header.ines_format == 2)
     //{
-    //    onut::showMessageBox("ERROR", "(0x80000008) Only iNes 1.0 is supported: " + std::string(filename));
+    //    show_error("ERROR", "(0x80000008) Only iNes 1.0 is supported: " + std::string(filename));
     //    delete[] file_data;
     //    fclose(f);
     //    OQuit();
@@ -131,7 +131,7 @@ Cart::Cart(const char* filename)
     if (expected_rom_size != rom_size - header_size)
     {
         delete[] file_data;
-        onut::showMessageBox("ERROR", "(0x80000005) Wrong ROM size: " + std::string(filename));
+        show_error("ERROR", "(0x80000005) Wrong ROM size: " + std::string(filename));
         exit(0);
         return;
     }
@@ -147,7 +147,7 @@ Cart::Cart(const char* filename)
     if (checksum != ROM_CHECKSUM/* && // Rev0
         checksum != ROM_CHECKSUM_REV1*/) // Rev1 (It doesnt work, bad dialog code?)
     {
-        onut::showMessageBox("ERROR", "(0x80000006) Wrong ROM checksum: " + std::string(filename));
+        show_error("ERROR", "(0x80000006) Wrong ROM checksum: " + std::string(filename));
         exit(0);
         return;
     }
@@ -177,7 +177,7 @@ Cart::Cart(const char* filename)
     {
         case 1: m_mapper = new Mapper001(header.PRG_ROM_size, header.CHR_ROM_size); break;
         default:
-            onut::showMessageBox("ERROR", "(0x80000007) Unsupported mapper " + std::to_string(mapper_id) + " for rom file: " + std::string(filename));
+            show_error("ERROR", "(0x80000007) Unsupported mapper " + std::to_string(mapper_id) + " for rom file: " + std::string(filename));
             exit(0);
             return;
     }
@@ -192,16 +192,25 @@ Cart::~Cart()
 }
 
 
-void Cart::serialize(FILE* f, int version) const
+void Cart::serialize(StateWriter& writer, int version) const
 {
-    fwrite(m_chr_rom, 1, 2 * 8 * 1024, f);
-    m_mapper->serialize(f, version);
+    writer.write(m_chr_rom, 2 * 8 * 1024);
+    m_mapper->serialize(writer, version);
 }
 
-void Cart::deserialize(FILE* f, int version)
+void Cart::deserialize(StateReader& reader, int version)
 {
-    fread(m_chr_rom, 1, 2 * 8 * 1024, f);
-    m_mapper->deserialize(f, version);
+    // Only the tiles that changed are bumped, run-ahead and rewind load a snapshot every frame
+    uint8_t tile[16];
+    for (int i = 0; i < CHR_TILE_COUNT; ++i)
+    {
+        if (reader.read(tile, sizeof(tile)) != sizeof(tile)) break;
+        if (memcmp(m_chr_rom + i * 16, tile, sizeof(tile)) == 0) continue;
+        memcpy(m_chr_rom + i * 16, tile, sizeof(tile));
+        m_chr_tile_generations[i]++;
+    }
+    reader.read(m_chr_rom + CHR_TILE_COUNT * 16, 2 * 8 * 1024 - CHR_TILE_COUNT * 16);
+    m_mapper->deserialize(reader, version);
 }
 
 
@@ -219,14 +228,6 @@ bool Cart::cpu_write(uint16_t addr, uint8_t data)
     return false;
 }
 
-#include "Daxanadu.h"
-#include "Emulator.h"
-#include "CPU.h"
-#include "RAM.h"
-
-extern Daxanadu* daxanadu;
-
-
 void Cart::register_write_callback(const std::function<void(int)>& callback, int addr)
 {
     m_write_callbacks.push_back({ addr, callback });
@@ -284,7 +285,12 @@ bool Cart::ppu_write(uint16_t addr, uint8_t data)
                 write_callback.second((int)mapped_addr);
 
         // CHR_RAM
-        m_chr_rom[addr] = data;
+        if (m_chr_rom[addr] != data)
+        {
+            m_chr_rom[addr] = data;
+            if ((addr >> 4) < CHR_TILE_COUNT)
+                m_chr_tile_generations[addr >> 4]++;
+        }
         return true;
     }
 
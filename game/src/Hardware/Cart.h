@@ -2,8 +2,8 @@
 
 #include "CPUPeripheral.h"
 #include "PPUPeripheral.h"
+#include "StateBuffer.h"
 
-#include <stdio.h>
 #include <functional>
 #include <vector>
 
@@ -14,6 +14,8 @@ class Mapper;
 class Cart final : public CPUPeripheral, public PPUPeripheral
 {
 public:
+    static const int CHR_TILE_COUNT = 512; // 16 bytes per tile, both pattern tables
+
     Cart(const char* filename);
     ~Cart();
 
@@ -21,9 +23,10 @@ public:
     bool cpu_read(uint16_t addr, uint8_t* out_data) override;
     bool ppu_write(uint16_t addr, uint8_t data) override;
     bool ppu_read(uint16_t addr, uint8_t* out_data) override;
+    std::vector<cpu_range_t> get_cpu_ranges() const override { return { { 0x8000, 0xFFFF } }; } // PRG ROM, cart RAM is unused
 
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
 
     void reset();
 
@@ -33,6 +36,10 @@ public:
     void register_write_callback(const std::function<void(int)>& callback, int addr);
     void register_read_callback(const std::function<void(int)>& callback, int addr);
 
+    // Bumped every time a tile's CHR data changes, so decoded copies know when to refresh
+    uint32_t get_chr_tile_generation(int tile) const { return m_chr_tile_generations[tile]; }
+    const uint8_t* get_chr_tile(int tile) const { return m_chr_rom + tile * 16; } // CHR is not banked on this mapper
+
 private:
     uint8_t* m_prg_rom = nullptr;
     uint8_t* m_chr_rom = nullptr;
@@ -41,6 +48,7 @@ private:
     size_t m_chr_rom_size = 0;
 
     Mapper* m_mapper = nullptr;
+    uint32_t m_chr_tile_generations[CHR_TILE_COUNT] = { 0 };
 
     std::vector<std::pair<int, std::function<void(int)>>> m_write_callbacks;
     std::vector<std::pair<int, std::function<void(int)>>> m_read_callbacks;
@@ -1,8 +1,5 @@
 #include "Controller.h"
-#include "InputContext.h"
-
-#include <onut/GamePad.h>
-#include <onut/Input.h>
+#include "ControllerInputs.h"
 
 
 uint8_t Controller::read_inputs(int controller_id)
@@ -11,7 +8,7 @@ uint8_t Controller::read_inputs(int controller_id)
 
     uint8_t ret = 0;
 
-    auto inputs = m_input_context->read_inputs(controller_id);
+    auto inputs = m_use_snapshots ? m_input_context->get_snapshot(controller_id) : m_input_context->read_inputs(controller_id);
 
     if (inputs.right) ret |= 0b00000001;
     if (inputs.left) ret |= 0b00000010;
@@ -26,15 +23,15 @@ uint8_t Controller::read_inputs(int controller_id)
 }
 
 
-void Controller::serialize(FILE* f, int version) const
+void Controller::serialize(StateWriter& writer, int version) const
 {
-    fwrite(m_shift_registers, 1, 2, f);
+    writer.write(m_shift_registers, 2);
 }
 
 
-void Controller::deserialize(FILE* f, int version)
+void Controller::deserialize(StateReader& reader, int version)
 {
-    fread(m_shift_registers, 1, 2, f);
+    reader.read(m_shift_registers, 2);
 }
 
 
@@ -1,8 +1,7 @@
 #pragma once
 
 #include "CPUPeripheral.h"
-
-#include <stdio.h>
+#include "StateBuffer.h"
 
 
 class InputContext;
@@ -11,17 +10,22 @@ class InputContext;
 class Controller final : public CPUPeripheral
 {
 public:
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
 
     bool cpu_write(uint16_t addr, uint8_t data) override;
     bool cpu_read(uint16_t addr, uint8_t* out_data) override;
+    std::vector<cpu_range_t> get_cpu_ranges() const override { return { { 0x4016, 0x4017 } }; }
 
     void set_input_context(InputContext* input_context);
     const InputContext* get_input_context() const { return m_input_context; }
     uint8_t read_inputs(int controller_id);
 
+    // Read the input context's snapshot instead of the devices, see InputContext::take_snapshot()
+    void set_use_snapshots(bool use_snapshots) { m_use_snapshots = use_snapshots; }
+
 private:
     uint8_t m_shift_registers[2] = { 0 };
     InputContext* m_input_context = nullptr;
+    bool m_use_snapshots = false;
 };
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+
+
+struct inputs_t
+{
+    bool left = false;
+    bool right = false;
+    bool up = false;
+    bool down = false;
+    bool select = false;
+    bool start = false;
+    bool a = false;
+    bool b = false;
+};
+
+
+// Where the controller gets its buttons from. Implemented by the front-end.
+class InputContext
+{
+public:
+    virtual ~InputContext() {}
+
+    virtual inputs_t read_inputs(int controller_id) = 0;
+
+    // When the emulation runs on another thread, the thread owning the input devices takes a
+    // snapshot of them once per update, and the controller reads that instead
+    void take_snapshot()
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            inputs_t inputs = read_inputs(i);
+            m_snapshots[i] = (uint8_t)(inputs.left | (inputs.right << 1) | (inputs.up << 2) | (inputs.down << 3) |
+                                       (inputs.select << 4) | (inputs.start << 5) | (inputs.a << 6) | (inputs.b << 7));
+        }
+    }
+
+    inputs_t get_snapshot(int controller_id) const
+    {
+        uint8_t bits = m_snapshots[controller_id & 1];
+        inputs_t inputs;
+        inputs.left = bits & 0x01;
+        inputs.right = bits & 0x02;
+        inputs.up = bits & 0x04;
+        inputs.down = bits & 0x08;
+        inputs.select = bits & 0x10;
+        inputs.start = bits & 0x20;
+        inputs.a = bits & 0x40;
+        inputs.b = bits & 0x80;
+        return inputs;
+    }
+
+private:
+    std::atomic<uint8_t> m_snapshots[2] = {};
+};
@@ -0,0 +1,654 @@
+#include "Emulator.h"
+#include "APU.h"
+#include "Cart.h"
+#include "Controller.h"
+#include "CPU.h"
+#include "CPUBUS.h"
+#include "ExternalInterface.h"
+#include "PPU.h"
+#include "PPUBUS.h"
+#include "RAM.h"
+#include "RewindBuffer.h"
+
+#include <algorithm>
+#include <math.h>
+
+
+static const int CPU_CLOCK_SPEED = 1789773; // hz
+static const int PPU_CLOCK_SPEED = CPU_CLOCK_SPEED * 3; // hz
+static const auto MAX_FRAME_DURATION = std::chrono::nanoseconds(1000000000 / 20);
+static const auto MAX_AUDIO_CLOCK_STALL = std::chrono::nanoseconds(1000000000 / 10); // Device stopped reporting
+static const double AUDIO_ERROR_SMOOTHING = 0.05; // Per frame
+static const double AUDIO_RATE_INTEGRAL_GAIN = 0.002; // Per frame
+static const double FRAME_PERIOD_NS = (double)PPU::FRAME_DOTS * 1000000000.0 / (double)PPU_CLOCK_SPEED; // 60.0988 hz
+static const double REFRESH_SMOOTHING = 0.02; // Per refresh
+static const int MAX_REFRESHES_PER_FRAME = 4; // 240 hz
+static const auto FRAME_PERIOD = std::chrono::nanoseconds(static_cast<int64_t>(FRAME_PERIOD_NS));
+
+static constexpr uint32_t APU_CHUNK = state_chunk_tag("APU ");
+static constexpr uint32_t CART_CHUNK = state_chunk_tag("CART");
+static constexpr uint32_t CPU_CHUNK = state_chunk_tag("CPU ");
+static constexpr uint32_t PPU_CHUNK = state_chunk_tag("PPU ");
+static constexpr uint32_t RAM_CHUNK = state_chunk_tag("RAM ");
+static constexpr uint32_t CONTROLLER_CHUNK = state_chunk_tag("CTRL");
+static constexpr uint32_t EXTERNAL_INTERFACE_CHUNK = state_chunk_tag("EXTI");
+
+
+Emulator::Emulator()
+{
+    m_cpu_bus = new CPUBUS();
+    m_ppu_bus = new PPUBUS();
+
+    m_ram = new RAM();
+    m_cpu = new CPU();
+    m_cart = new Cart("Faxanadu (U).nes");
+    //m_cart = new Cart("Faxanadu (USA).nes");
+    //m_cart = new Cart("Faxanadu (USA) (Rev A).nes");
+    m_ppu = new PPU(m_cpu, m_cart);
+    m_apu = new APU();
+    m_controller = new Controller();
+    m_external_interface = new ExternalInterface();
+    m_rewind_buffer = new RewindBuffer();
+
+    m_cpu_bus->add_peripheral(m_ram);
+    m_cpu_bus->add_peripheral(m_cpu);
+    m_cpu_bus->add_peripheral(m_ppu);
+    m_cpu_bus->add_peripheral(m_apu);
+    m_cpu_bus->add_peripheral(m_controller);
+    m_cpu_bus->add_peripheral(m_cart);
+    m_cpu_bus->add_peripheral(m_external_interface);
+
+    m_ppu_bus->add_peripheral(m_ppu);
+    m_ppu_bus->add_peripheral(m_cart);
+
+    reset();
+}
+
+
+Emulator::~Emulator()
+{
+    stop_thread();
+
+    delete m_rewind_buffer;
+    delete m_external_interface;
+    delete m_cart;
+    delete m_controller;
+    delete m_apu;
+    delete m_ppu;
+    delete m_cpu;
+    delete m_ram;
+
+    delete m_ppu_bus;
+    delete m_cpu_bus;
+}
+
+
+void Emulator::reset()
+{
+    m_cart->reset();
+    m_ppu->reset();
+    m_cpu->reset();
+
+    m_tick_progress = 0.0;
+    m_cpu_dots = 0;
+    m_last_frame_time = std::chrono::high_resolution_clock::now();
+    m_audio_error_valid = false;
+}
+
+
+void Emulator::set_audio_clock_master(bool enabled, float lead_ms)
+{
+    int64_t lead_cycles = enabled ? (int64_t)((double)lead_ms * (double)CPU_CLOCK_SPEED / 1000.0) : 0;
+    if (lead_cycles != m_audio_lead_cycles)
+        m_audio_error_valid = false;
+    m_audio_lead_cycles = lead_cycles;
+}
+
+
+void Emulator::update(float dt)
+{
+    if (!m_thread.joinable())
+    {
+        auto now = std::chrono::high_resolution_clock::now();
+        std::chrono::nanoseconds time_elapsed_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_last_frame_time);
+        m_last_frame_time = now;
+        advance_time(time_elapsed_ns);
+    }
+
+    m_ram->update(dt);
+}
+
+
+void Emulator::advance_time(std::chrono::nanoseconds time_elapsed_ns)
+{
+    // If too large, slow down the simulation to about 20 fps).
+    if (time_elapsed_ns > MAX_FRAME_DURATION) time_elapsed_ns = MAX_FRAME_DURATION;
+
+    double ppu_ticks = 0.0;
+    if (!(m_audio_lead_cycles > 0 && m_speed == 1.0 && follow_audio_clock(time_elapsed_ns, &ppu_ticks)))
+    {
+        m_audio_error_valid = false;
+        ppu_ticks = m_frame_pacing ? get_refresh_ticks(time_elapsed_ns) : static_cast<double>(time_elapsed_ns.count()) * static_cast<double>(PPU_CLOCK_SPEED) * m_speed / 1000000000.0;
+    }
+    advance(ppu_ticks);
+}
+
+
+void Emulator::set_frame_pacing(bool enabled, int max_frame_skip)
+{
+    if (enabled != m_frame_pacing)
+        m_refresh_average_valid = false;
+    m_frame_pacing = enabled;
+    m_max_frame_skip = std::max(max_frame_skip, 0);
+}
+
+
+double Emulator::get_refresh_ticks(std::chrono::nanoseconds time_elapsed_ns)
+{
+    // Update is called once per display refresh. Measure it.
+    double elapsed_ns = static_cast<double>(time_elapsed_ns.count());
+    if (!m_refresh_average_valid)
+    {
+        m_refresh_average_ns = elapsed_ns;
+        m_refresh_average_valid = true;
+    }
+    m_refresh_average_ns += (elapsed_ns - m_refresh_average_ns) * REFRESH_SMOOTHING;
+
+    // When the display refreshes at (a multiple of) the NES rate, within what the audio resampling can absorb,
+    // count refreshes instead of wall time. Every frame then shows for the same number of refreshes.
+    int refreshes_per_frame = (int)lround(FRAME_PERIOD_NS / m_refresh_average_ns);
+    if (refreshes_per_frame < 1 || refreshes_per_frame > MAX_REFRESHES_PER_FRAME ||
+        fabs(m_refresh_average_ns * (double)refreshes_per_frame - FRAME_PERIOD_NS) > FRAME_PERIOD_NS * APUAudioStream::MAX_RATE_ADJUST)
+    {
+        return elapsed_ns * static_cast<double>(PPU_CLOCK_SPEED) * m_speed / 1000000000.0;
+    }
+
+    double refreshes = std::max(1.0, round(elapsed_ns / m_refresh_average_ns)); // Some can be missed under load
+    return refreshes * static_cast<double>(PPU::FRAME_DOTS) * m_speed / static_cast<double>(refreshes_per_frame);
+}
+
+
+void Emulator::advance(double ppu_ticks)
+{
+    if (m_rewinding)
+    {
+        step_back(ppu_ticks);
+        return;
+    }
+
+    m_tick_progress += ppu_ticks;
+
+    // With run-ahead, what's shown comes from the frames after these instead
+    const bool hide_frames = m_run_ahead_frames > 0;
+    const int64_t vblank_cycle = m_ppu->get_cycle() + m_ppu->get_dots_to_vblank();
+
+    if (!m_frame_pacing)
+    {
+        int ticks = static_cast<int>(m_tick_progress);
+        m_tick_progress -= static_cast<double>(ticks);
+        m_ppu->set_skip_screen(hide_frames);
+        run(ticks);
+    }
+    else
+    {
+        // Whole frames only, so each refresh shows a finished one. When there's time for more than one, only the
+        // last is rasterized. Past the frame skip (scaled by the speed), the time is dropped and the game slows down.
+        const int max_frames = static_cast<int>(ceil(m_speed)) * (m_max_frame_skip + 1);
+        for (int frame = 0;; ++frame)
+        {
+            int dots = m_ppu->get_dots_to_vblank();
+            if (m_tick_progress < static_cast<double>(dots))
+                break;
+            if (frame == max_frames)
+            {
+                m_tick_progress = 0.0;
+                break;
+            }
+
+            bool shown = frame == max_frames - 1 || m_tick_progress - static_cast<double>(dots) < static_cast<double>(PPU::FRAME_DOTS);
+            m_ppu->set_skip_screen(!shown || hide_frames);
+            run_frame();
+            m_tick_progress -= static_cast<double>(dots);
+        }
+    }
+    m_ppu->set_skip_screen(false);
+
+    if (hide_frames && m_ppu->get_cycle() >= vblank_cycle)
+        present_ahead();
+}
+
+
+void Emulator::present_ahead()
+{
+    const int64_t cycle = m_ppu->get_cycle();
+    m_run_ahead_writer.clear();
+    save_snapshot(m_run_ahead_writer);
+
+    m_running_ahead = true;
+    m_apu->set_skip_stream(true);
+    m_external_interface->set_skip_callbacks(true);
+    for (int frame = 0; frame < m_run_ahead_frames; ++frame)
+    {
+        m_ppu->set_skip_screen(frame < m_run_ahead_frames - 1);
+        run_frame();
+    }
+    m_ppu->set_skip_screen(false);
+    m_external_interface->set_skip_callbacks(false);
+    m_apu->set_skip_stream(false);
+    m_running_ahead = false;
+
+    // The screen keeps the frame ahead, until the next one. The PPU clock goes back too, the audio and
+    // rewind timestamps follow it.
+    StateReader reader(m_run_ahead_writer.get_data(), m_run_ahead_writer.get_size());
+    load_snapshot(reader);
+    m_ppu->set_cycle(cycle);
+}
+
+
+void Emulator::set_rewind(bool enabled, int interval, size_t budget)
+{
+    m_rewind_interval = enabled ? std::max(interval, 1) : 0;
+    m_rewind_buffer->set_budget(enabled ? budget : 0);
+    if (!enabled) set_rewinding(false);
+}
+
+
+void Emulator::set_rewinding(bool rewinding)
+{
+    rewinding = rewinding && m_rewind_interval > 0;
+    if (rewinding == m_rewinding) return;
+
+    m_rewinding = rewinding;
+    m_tick_progress = 0.0;
+    m_audio_error_valid = false;
+    if (!m_turbo)
+        m_apu->get_audio_stream()->set_muted(rewinding); // The sound can't play backward
+}
+
+
+void Emulator::set_rewind_state_callbacks(const std::function<void(StateWriter&)>& save, const std::function<void(StateReader&)>& load)
+{
+    m_save_rewind_state = save;
+    m_load_rewind_state = load;
+}
+
+
+void Emulator::capture_rewind()
+{
+    m_rewind_cycle = m_ppu->get_cycle();
+    m_rewind_writer.clear();
+    save_snapshot(m_rewind_writer);
+    if (m_save_rewind_state) m_save_rewind_state(m_rewind_writer);
+    m_rewind_buffer->push(m_rewind_writer.get_data(), m_rewind_writer.get_size());
+}
+
+
+void Emulator::step_back(double ppu_ticks)
+{
+    m_tick_progress += ppu_ticks;
+    const double snapshot_dots = static_cast<double>(PPU::FRAME_DOTS * m_rewind_interval);
+    bool popped = false;
+    while (m_tick_progress >= snapshot_dots)
+    {
+        m_tick_progress -= snapshot_dots;
+        popped |= m_rewind_buffer->pop(&m_rewind_state);
+    }
+    if (!popped) return; // Not time yet, or back to the oldest one
+
+    StateReader reader(m_rewind_state.data(), m_rewind_state.size());
+    load_snapshot(reader);
+    if (m_load_rewind_state) m_load_rewind_state(reader);
+    m_ppu->refresh_screen(); // Nothing runs to rasterize it
+}
+
+
+void Emulator::set_threaded(bool threaded)
+{
+    if (threaded)
+    {
+        if (!m_thread.joinable())
+            start_thread();
+        m_thread_for_turbo = false;
+    }
+    else if (m_thread.joinable() && !m_thread_for_turbo)
+    {
+        if (is_turbo())
+            m_thread_for_turbo = true; // Let fast forward finish, it stops the thread
+        else
+            stop_thread();
+    }
+}
+
+
+void Emulator::start_thread()
+{
+    m_controller->set_use_snapshots(true);
+    m_last_frame_time = std::chrono::high_resolution_clock::now();
+    m_thread_running = true;
+    m_thread = std::thread([this]() { run_thread(); });
+}
+
+
+void Emulator::stop_thread()
+{
+    if (!m_thread.joinable()) return;
+
+    if (is_turbo())
+    {
+        m_thread_for_turbo = false;
+        stop_turbo();
+    }
+
+    m_thread_running = false;
+    m_thread.join();
+
+    m_controller->set_use_snapshots(false);
+    m_last_frame_time = std::chrono::high_resolution_clock::now();
+}
+
+
+void Emulator::start_turbo(int render_interval, bool mute_audio)
+{
+    if (is_turbo()) return;
+
+    {
+        auto state_lock = lock_state();
+        m_turbo_render_interval = std::max(render_interval, 1);
+        m_turbo_frame = 0;
+        m_turbo_frame_time = std::chrono::steady_clock::now();
+        m_rewinding = false;
+        m_apu->get_audio_stream()->set_muted(mute_audio);
+        m_turbo = true;
+    }
+
+    if (!m_thread.joinable())
+    {
+        start_thread();
+        m_thread_for_turbo = true;
+    }
+}
+
+
+void Emulator::stop_turbo()
+{
+    if (!is_turbo()) return;
+
+    {
+        auto state_lock = lock_state();
+        m_turbo = false;
+        m_ppu->set_skip_screen(false);
+        m_apu->set_time_scale(m_ppu->get_cycle() / 3, 1.0);
+        m_apu->get_audio_stream()->set_muted(false);
+        m_tick_progress = 0.0;
+        m_audio_error_valid = false;
+        m_last_frame_time = std::chrono::high_resolution_clock::now();
+    }
+
+    if (m_thread_for_turbo)
+        stop_thread();
+}
+
+
+std::unique_lock<std::mutex> Emulator::lock_state()
+{
+    m_state_lock_requests++;
+    std::unique_lock<std::mutex> lock(m_state_mutex);
+    m_state_lock_requests--;
+    return lock;
+}
+
+
+void Emulator::run_thread()
+{
+    auto next_frame_time = std::chrono::steady_clock::now();
+    while (m_thread_running)
+    {
+        // The mutex isn't fair. Step aside while another thread waits for it, or it could starve.
+        while (m_state_lock_requests > 0)
+            std::this_thread::yield();
+
+        {
+            std::unique_lock<std::mutex> lock(m_state_mutex);
+            if (!m_thread_running) break;
+
+            if (m_turbo)
+            {
+                run_turbo_frame();
+                continue;
+            }
+
+            auto now = std::chrono::high_resolution_clock::now();
+            advance_time(std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_last_frame_time));
+            m_last_frame_time = now;
+        }
+
+        // Wake up once per NES frame. How much runs still follows the wall clock, the audio clock or the
+        // frame pacing, like update() does.
+        auto now = std::chrono::steady_clock::now();
+        next_frame_time += FRAME_PERIOD;
+        if (next_frame_time < now)
+            next_frame_time = now; // Fell behind, or back from turbo. Don't burst to catch up.
+        std::this_thread::sleep_until(next_frame_time);
+    }
+}
+
+
+void Emulator::run_turbo_frame()
+{
+    // The audio plays this frame in the real time the last one took, so it keeps up without piling writes
+    auto now = std::chrono::steady_clock::now();
+    double scale = std::chrono::duration<double>(now - m_turbo_frame_time).count() * (double)PPU_CLOCK_SPEED / (double)PPU::FRAME_DOTS;
+    m_turbo_frame_time = now;
+    m_apu->set_time_scale(m_ppu->get_cycle() / 3, std::min(scale, 1.0));
+
+    m_turbo_frame++;
+    m_ppu->set_skip_screen(m_turbo_frame % m_turbo_render_interval != 0);
+    run_frame();
+}
+
+
+void Emulator::run_frame()
+{
+    run(m_ppu->get_dots_to_vblank());
+}
+
+
+bool Emulator::follow_audio_clock(std::chrono::nanoseconds time_elapsed_ns, double* out_ppu_ticks)
+{
+    // The device reports once per buffer. If it stops (lost, or paused by the OS), go back to wall time.
+    int64_t played_cycle = m_apu->get_audio_stream()->get_played_cycle();
+    if (played_cycle != m_last_played_cycle)
+    {
+        m_last_played_cycle = played_cycle;
+        m_played_cycle_age = std::chrono::nanoseconds(0);
+    }
+    else
+    {
+        m_played_cycle_age += time_elapsed_ns;
+    }
+    if (played_cycle < 0 || m_played_cycle_age > MAX_AUDIO_CLOCK_STALL)
+        return false;
+
+    int64_t error = played_cycle + m_audio_lead_cycles - m_apu->get_audio_cycle(m_ppu->get_cycle() / 3); // Cycles the emulation is behind
+    if (error > m_audio_lead_cycles * 2)
+    {
+        // The audio ran out long enough ago that its stream re-anchors on the next write. Carry on with wall time.
+        m_audio_error_valid = false;
+        return false;
+    }
+    if (error > m_audio_lead_cycles)
+    {
+        // A hitch, the audio is about to run out. Run what it needs at once.
+        m_tick_progress = 0.0;
+        m_audio_error_valid = false;
+        *out_ppu_ticks = static_cast<double>(error * 3);
+        return true;
+    }
+    if (error < -m_audio_lead_cycles)
+    {
+        // Far ahead, let the audio catch up
+        m_audio_error_valid = false;
+        *out_ppu_ticks = 0.0;
+        return true;
+    }
+
+    // Advancing straight to where the audio needs would pace frames by the device's buffers. Run at wall
+    // speed instead, nudged by the smoothed error. The integral settles on the drift between the device and
+    // wall clocks. It's heard as a pitch change of at most MAX_RATE_ADJUST.
+    double error_ratio = (double)error / (double)m_audio_lead_cycles;
+    if (!m_audio_error_valid)
+    {
+        m_audio_error = error_ratio;
+        m_audio_error_valid = true;
+    }
+    m_audio_error += (error_ratio - m_audio_error) * AUDIO_ERROR_SMOOTHING;
+    m_audio_rate_integral = std::clamp(m_audio_rate_integral + m_audio_error * AUDIO_RATE_INTEGRAL_GAIN, -1.0, 1.0);
+    double speed = 1.0 + std::clamp(m_audio_error + m_audio_rate_integral, -1.0, 1.0) * APUAudioStream::MAX_RATE_ADJUST;
+
+    *out_ppu_ticks = static_cast<double>(time_elapsed_ns.count()) * static_cast<double>(PPU_CLOCK_SPEED) * speed / 1000000000.0;
+    return true;
+}
+
+
+void Emulator::run(int ppu_ticks)
+{
+    const int cpu_divider = m_fast_cpu ? 1 : 3;
+
+    while (ppu_ticks > 0)
+    {
+        // Run a whole instruction (or DMA halt), then let the PPU catch up with it
+        if (m_cpu_dots == 0)
+        {
+            m_apu->set_cpu_cycle(m_ppu->get_cycle() / 3); // Timestamps the APU writes, in real time CPU cycles
+            m_cpu_dots = m_cpu->step() * cpu_divider;
+        }
+
+        int dots = m_cpu_dots < ppu_ticks ? m_cpu_dots : ppu_ticks;
+        m_ppu->run_until(m_ppu->get_cycle() + dots);
+
+        m_cpu_dots -= dots;
+        ppu_ticks -= dots;
+    }
+
+    if (m_running_ahead) return; // These never happened
+
+    m_apu->publish_cpu_cycle(m_ppu->get_cycle() / 3);
+
+    // The PPU cycle isn't part of the state, it keeps counting across loads and rewinds
+    if (m_rewind_interval > 0 && m_ppu->get_cycle() - m_rewind_cycle >= (int64_t)PPU::FRAME_DOTS * m_rewind_interval)
+        capture_rewind();
+}
+
+
+void Emulator::serialize(StateWriter& writer, int version) const
+{
+    m_apu->serialize(writer, version);
+    m_cart->serialize(writer, version);
+    m_cpu->serialize(writer, version);
+    m_ppu->serialize(writer, version);
+    m_ram->serialize(writer, version);
+    m_controller->serialize(writer, version);
+    m_external_interface->serialize(writer, version);
+}
+
+
+void Emulator::deserialize(StateReader& reader, int version)
+{
+    m_apu->deserialize(reader, version);
+    m_cart->deserialize(reader, version);
+    m_cpu->deserialize(reader, version);
+    m_ppu->deserialize(reader, version);
+    m_ram->deserialize(reader, version);
+    m_controller->deserialize(reader, version);
+    m_external_interface->deserialize(reader, version);
+
+    m_ppu->invalidate();
+    m_cpu_dots = 0;
+}
+
+
+void Emulator::serialize_chunks(StateWriter& writer) const
+{
+    writer.begin_chunk(APU_CHUNK);
+    m_apu->serialize(writer, STATE_VERSION);
+    writer.end_chunk();
+
+    writer.begin_chunk(CART_CHUNK);
+    m_cart->serialize(writer, STATE_VERSION);
+    writer.end_chunk();
+
+    writer.begin_chunk(CPU_CHUNK);
+    m_cpu->serialize(writer, STATE_VERSION);
+    writer.end_chunk();
+
+    writer.begin_chunk(PPU_CHUNK);
+    m_ppu->serialize(writer, STATE_VERSION);
+    writer.end_chunk();
+
+    writer.begin_chunk(RAM_CHUNK);
+    m_ram->serialize(writer, STATE_VERSION);
+    writer.end_chunk();
+
+    writer.begin_chunk(CONTROLLER_CHUNK);
+    m_controller->serialize(writer, STATE_VERSION);
+    writer.end_chunk();
+
+    writer.begin_chunk(EXTERNAL_INTERFACE_CHUNK);
+    m_external_interface->serialize(writer, STATE_VERSION);
+    writer.end_chunk();
+}
+
+
+bool Emulator::deserialize_chunk(uint32_t tag, StateReader& reader, int version)
+{
+    switch (tag)
+    {
+        case APU_CHUNK: m_apu->deserialize(reader, version); break;
+        case CART_CHUNK: m_cart->deserialize(reader, version); break;
+        case CPU_CHUNK:
+            m_cpu->deserialize(reader, version);
+            m_cpu_dots = 0;
+            break;
+        case PPU_CHUNK:
+            m_ppu->deserialize(reader, version);
+            m_ppu->invalidate();
+            break;
+        case RAM_CHUNK: m_ram->deserialize(reader, version); break;
+        case CONTROLLER_CHUNK: m_controller->deserialize(reader, version); break;
+        case EXTERNAL_INTERFACE_CHUNK: m_external_interface->deserialize(reader, version); break;
+        default: return false;
+    }
+    return true;
+}
+
+
+std::vector<uint32_t> Emulator::get_required_chunks()
+{
+    return { CART_CHUNK, CPU_CHUNK, PPU_CHUNK, RAM_CHUNK };
+}
+
+
+void Emulator::save_snapshot(StateWriter& writer) const
+{
+    m_apu->serialize_registers(writer);
+    m_cart->serialize(writer, STATE_VERSION);
+    m_cpu->serialize(writer, STATE_VERSION);
+    m_ppu->serialize(writer, STATE_VERSION);
+    m_ram->serialize(writer, STATE_VERSION);
+    m_controller->serialize(writer, STATE_VERSION);
+    m_external_interface->serialize(writer, STATE_VERSION);
+    writer.write(&m_cpu_dots, sizeof(m_cpu_dots));
+}
+
+
+void Emulator::load_snapshot(StateReader& reader)
+{
+    m_apu->deserialize_registers(reader);
+    m_cart->deserialize(reader, STATE_VERSION);
+    m_cpu->deserialize(reader, STATE_VERSION);
+    m_ppu->deserialize(reader, STATE_VERSION);
+    m_ram->deserialize(reader, STATE_VERSION);
+    m_controller->deserialize(reader, STATE_VERSION);
+    m_external_interface->deserialize(reader, STATE_VERSION);
+    reader.read(&m_cpu_dots, sizeof(m_cpu_dots));
+}
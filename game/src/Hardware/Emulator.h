@@ -0,0 +1,177 @@
+#pragma once
+
+#include "StateBuffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class APU;
+class Cart;
+class Controller;
+class CPU;
+class CPUBUS;
+class PPU;
+class PPUBUS;
+class RAM;
+class ExternalInterface;
+class RewindBuffer;
+
+
+class Emulator final
+{
+public:
+    // Version of what serialize() writes. Bump it with any change to that.
+    // 9: save files are split in chunks, see serialize_chunks()
+    static const int32_t STATE_VERSION = 9;
+
+    Emulator();
+    ~Emulator();
+
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
+
+    // The same, one chunk per component. Returns false for a tag that isn't one of them.
+    void serialize_chunks(StateWriter& writer) const;
+    bool deserialize_chunk(uint32_t tag, StateReader& reader, int version);
+    static std::vector<uint32_t> get_required_chunks(); // A state missing one can't be loaded. The others keep what they had.
+
+    // In-memory snapshots, for rewind and run-ahead. Unlike serialize(), they leave the audio thread alone:
+    // only the registers the game reads back are saved, and the sound carries on from where it is.
+    void save_snapshot(StateWriter& writer) const;
+    void load_snapshot(StateReader& reader);
+
+    void reset();
+    void update(float dt);
+    void run(int ppu_ticks); // Headless stepping, not tied to wall time
+    void run_frame(); // Runs until the next v-blank, so the PPU holds a whole new frame
+
+    void set_fast_cpu(bool fast_cpu) { m_fast_cpu = fast_cpu; }
+    void set_speed(double speed) { m_speed = speed; }
+
+    // Follow the audio device's clock instead of wall time: each frame starts lead_ms ahead of what the
+    // audio rendered. Only at normal speed, wall time is used while the audio clock is unknown.
+    void set_audio_clock_master(bool enabled, float lead_ms);
+
+    // Run whole frames per display refresh instead of fractions of one. Displays at (a multiple of) 60 hz
+    // are locked to one frame per so many refreshes. Under load, up to max_frame_skip frames are run
+    // without being rasterized to keep up.
+    void set_frame_pacing(bool enabled, int max_frame_skip);
+
+    // Runs the frames on a thread of its own instead of in update(), paced the same way. Meanwhile,
+    // anything else touching the emulation must hold lock_state(). Don't hold it to start or stop.
+    void set_threaded(bool threaded);
+    bool is_threaded() const { return m_thread.joinable(); }
+
+    // Fast forward: frames run as fast as the host allows on the emulation thread (started for the
+    // occasion if needed), and only one in render_interval is rasterized. The audio is squeezed into
+    // real time, or muted.
+    void start_turbo(int render_interval, bool mute_audio);
+    void stop_turbo();
+    bool is_turbo() const { return m_turbo; }
+
+    // Rewind: a snapshot every interval frames goes into a ring within budget bytes. While rewinding, they're
+    // restored newest first, at the pace they were taken, instead of running. The sound is muted meanwhile.
+    void set_rewind(bool enabled, int interval, size_t budget);
+    void set_rewinding(bool rewinding);
+    bool is_rewinding() const { return m_rewinding; }
+    const RewindBuffer* get_rewind_buffer() const { return m_rewind_buffer; }
+
+    // State kept outside the emulation that rewinding must take back too, appended to each snapshot and
+    // restored with it. Called on the emulation's thread. Run-ahead doesn't need it, its frames don't call out.
+    void set_rewind_state_callbacks(const std::function<void(StateWriter&)>& save, const std::function<void(StateReader&)>& load);
+
+    // Run-ahead: once a frame is due, the next frames are run too and the last one is shown instead, then
+    // the state goes back. What the game only reacts to a frame or two later shows right away. Those frames
+    // aren't heard, don't call out of the emulation and aren't kept for rewind. 0 to disable.
+    void set_run_ahead(int frames) { m_run_ahead_frames = std::max(frames, 0); }
+    int get_run_ahead() const { return m_run_ahead_frames; }
+
+    std::unique_lock<std::mutex> lock_state();
+
+    ExternalInterface* get_external_interface() const { return m_external_interface; }
+    Cart* get_cart() const { return m_cart; }
+    PPU* get_ppu() const { return m_ppu; }
+    CPU* get_cpu() const { return m_cpu; }
+    Controller* get_controller() const { return m_controller; }
+    CPUBUS* get_cpu_bus() const { return m_cpu_bus; };
+    APU* get_apu() const { return m_apu; }
+    RAM* get_ram() const { return m_ram; }
+
+private:
+    bool follow_audio_clock(std::chrono::nanoseconds time_elapsed_ns, double* out_ppu_ticks); // False to use wall time instead
+    double get_refresh_ticks(std::chrono::nanoseconds time_elapsed_ns);
+    void advance_time(std::chrono::nanoseconds time_elapsed_ns);
+    void advance(double ppu_ticks);
+    void start_thread();
+    void stop_thread();
+    void run_thread();
+    void run_turbo_frame();
+    void capture_rewind();
+    void step_back(double ppu_ticks);
+    void present_ahead();
+
+    CPUBUS* m_cpu_bus = nullptr;
+    PPUBUS* m_ppu_bus = nullptr;
+
+    APU* m_apu = nullptr;
+    Cart* m_cart = nullptr;
+    Controller* m_controller = nullptr;
+    CPU* m_cpu = nullptr;
+    PPU* m_ppu = nullptr;
+    RAM* m_ram = nullptr;
+    ExternalInterface* m_external_interface = nullptr;
+
+    std::chrono::high_resolution_clock::time_point m_last_frame_time;
+    double m_tick_progress = 0.0;
+    int m_cpu_dots = 0; // PPU dots left before the CPU executes its next instruction
+    bool m_fast_cpu = false;
+    double m_speed = 1.0;
+
+    // Audio clock master
+    int64_t m_audio_lead_cycles = 0; // 0 when disabled
+    int64_t m_last_played_cycle = -1;
+    std::chrono::nanoseconds m_played_cycle_age = std::chrono::nanoseconds(0);
+    double m_audio_error = 0.0; // Smoothed, in leads. Positive when the emulation is behind.
+    bool m_audio_error_valid = false;
+    double m_audio_rate_integral = 0.0;
+
+    // Frame pacing
+    bool m_frame_pacing = false;
+    int m_max_frame_skip = 0;
+    double m_refresh_average_ns = 0.0;
+    bool m_refresh_average_valid = false;
+
+    // Emulation thread
+    std::thread m_thread;
+    std::atomic<bool> m_thread_running = false;
+    bool m_thread_for_turbo = false; // Only started to fast forward
+    std::mutex m_state_mutex;
+    std::atomic<int> m_state_lock_requests = 0;
+
+    // Turbo
+    std::atomic<bool> m_turbo = false;
+    int m_turbo_render_interval = 1;
+    int m_turbo_frame = 0;
+    std::chrono::steady_clock::time_point m_turbo_frame_time;
+
+    // Rewind
+    RewindBuffer* m_rewind_buffer = nullptr;
+    int m_rewind_interval = 0; // Frames between snapshots, 0 when disabled
+    int64_t m_rewind_cycle = 0; // PPU cycle of the last snapshot
+    bool m_rewinding = false;
+    StateWriter m_rewind_writer;
+    std::vector<uint8_t> m_rewind_state;
+    std::function<void(StateWriter&)> m_save_rewind_state;
+    std::function<void(StateReader&)> m_load_rewind_state;
+
+    // Run-ahead
+    int m_run_ahead_frames = 0;
+    bool m_running_ahead = false;
+    StateWriter m_run_ahead_writer;
+};
@@ -0,0 +1,24 @@
+#include "ErrorHandler.h"
+
+#include <stdio.h>
+
+
+static std::function<void(const std::string&, const std::string&)> error_handler;
+
+
+void set_error_handler(const std::function<void(const std::string&, const std::string&)>& handler)
+{
+    error_handler = handler;
+}
+
+
+void show_error(const std::string& title, const std::string& message)
+{
+    if (error_handler)
+    {
+        error_handler(title, message);
+        return;
+    }
+
+    fprintf(stderr, "%s: %s\n", title.c_str(), message.c_str());
+}
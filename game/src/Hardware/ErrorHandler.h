@@ -0,0 +1,10 @@
+#pragma once
+
+#include <functional>
+#include <string>
+
+
+// The emulator core has no window to show errors in. Fatal errors go through
+// this handler and the front-end decides how to present them.
+void set_error_handler(const std::function<void(const std::string&, const std::string&)>& handler);
+void show_error(const std::string& title, const std::string& message);
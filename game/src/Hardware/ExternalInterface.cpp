@@ -1,25 +1,25 @@
 #include "ExternalInterface.h"
 
 
-void ExternalInterface::serialize(FILE* f, int version) const
+void ExternalInterface::serialize(StateWriter& writer, int version) const
 {
-    fwrite(&m_id_to_call, 1, 1, f);
-    fwrite(&m_arg_accum, 1, 1, f);
-    fwrite(&m_arg_count, 1, 1, f);
-    fwrite(m_args, 1, 4, f);
-    fwrite(&m_return_value, 1, 1, f);
+    writer.write(&m_id_to_call, 1);
+    writer.write(&m_arg_accum, 1);
+    writer.write(&m_arg_count, 1);
+    writer.write(m_args, 4);
+    writer.write(&m_return_value, 1);
 }
 
 
-void ExternalInterface::deserialize(FILE* f, int version)
+void ExternalInterface::deserialize(StateReader& reader, int version)
 {
     if (version < 2) return;
 
-    fread(&m_id_to_call, 1, 1, f);
-    fread(&m_arg_accum, 1, 1, f);
-    fread(&m_arg_count, 1, 1, f);
-    fread(m_args, 1, 4, f);
-    fread(&m_return_value, 1, 1, f);
+    reader.read(&m_id_to_call, 1);
+    reader.read(&m_arg_accum, 1);
+    reader.read(&m_arg_count, 1);
+    reader.read(m_args, 4);
+    reader.read(&m_return_value, 1);
 }
 
 
@@ -45,19 +45,19 @@ bool ExternalInterface::cpu_write(uint16_t addr, uint8_t data)
                 // Call it!
                 m_id_to_call = 0;
                 m_arg_accum = 0;
-                m_return_value = callback.fn(0, 0, 0, 0);
+                m_return_value = call(callback, 0, 0, 0, 0);
             }
         }
     }
     else
     {
-        const auto& callback = m_callbacks[m_id_to_call];
+        auto& callback = m_callbacks[m_id_to_call];
         m_args[m_arg_accum++] = data;
         if (m_arg_accum == callback.arg_count)
         {
             m_id_to_call = 0;
             m_arg_accum = 0;
-            m_return_value = callback.fn(m_args[0], m_args[1], m_args[2], m_args[3]);
+            m_return_value = call(callback, m_args[0], m_args[1], m_args[2], m_args[3]);
         }
     }
 
@@ -65,6 +65,15 @@ bool ExternalInterface::cpu_write(uint16_t addr, uint8_t data)
 }
 
 
+uint8_t ExternalInterface::call(callback_t& callback, uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+    if (m_skip_callbacks) return callback.last_return_value;
+
+    callback.last_return_value = callback.fn(a, b, c, d);
+    return callback.last_return_value;
+}
+
+
 bool ExternalInterface::cpu_read(uint16_t addr, uint8_t* out_data)
 {
     if (addr != 0x6000) return false;
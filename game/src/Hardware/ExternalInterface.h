@@ -1,33 +1,43 @@
 #pragma once
 
 #include "CPUPeripheral.h"
+#include "StateBuffer.h"
 
-#include <stdio.h>
 #include <functional>
 
 
 class ExternalInterface final : public CPUPeripheral
 {
 public:
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
 
     bool cpu_write(uint16_t addr, uint8_t data) override;
     bool cpu_read(uint16_t addr, uint8_t* out_data) override;
+    std::vector<cpu_range_t> get_cpu_ranges() const override { return { { 0x6000, 0x6000 } }; }
 
     void register_callback(uint8_t id, const std::function<uint8_t(uint8_t, uint8_t, uint8_t, uint8_t)>& callback, int arg_count = 0);
 
+    // For frames that will be thrown away, like run-ahead. Callbacks act outside the emulation (saving,
+    // menus, sounds, Archipelago queues), so they aren't called. The game gets what the last real call
+    // returned instead, the likeliest answer for the polled ones.
+    void set_skip_callbacks(bool skip_callbacks) { m_skip_callbacks = skip_callbacks; }
+
 private:
     struct callback_t
     {
         int arg_count = 0;
         std::function<uint8_t(uint8_t, uint8_t, uint8_t, uint8_t)> fn;
+        uint8_t last_return_value = 0;
     };
 
+    uint8_t call(callback_t& callback, uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+
     callback_t m_callbacks[256];
     uint8_t m_id_to_call = 0;
     uint8_t m_arg_accum = 0;
     uint8_t m_arg_count = 0;
     uint8_t m_args[4];
     uint8_t m_return_value = 0;
+    bool m_skip_callbacks = false;
 };
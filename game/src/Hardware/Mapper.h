@@ -1,7 +1,8 @@
 #pragma once
 
+#include "StateBuffer.h"
+
 #include <cinttypes>
-#include <stdio.h>
 
 
 class Mapper
@@ -10,8 +11,8 @@ public:
     Mapper(int prg_banks, int chr_banks);
     virtual ~Mapper() {}
 
-    virtual void serialize(FILE* f, int version) const = 0;
-    virtual void deserialize(FILE* f, int version) = 0;
+    virtual void serialize(StateWriter& writer, int version) const = 0;
+    virtual void deserialize(StateReader& reader, int version) = 0;
 
     virtual bool map_cpu_write(uint16_t addr, uint32_t* mapped_addr, uint8_t data) { return false; }
     virtual bool map_cpu_read(uint16_t addr, uint32_t* mapped_addr) { return false; }
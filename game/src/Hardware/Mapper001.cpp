@@ -155,33 +155,33 @@ void Mapper001::reset()
 }
 
 
-void Mapper001::serialize(FILE* f, int version) const
+void Mapper001::serialize(StateWriter& writer, int version) const
 {
-    fwrite(&m_shift_register, sizeof(m_shift_register), 1, f);
-    fwrite(&m_shift_register_writes, sizeof(m_shift_register_writes), 1, f);
-    fwrite(&m_control_register, sizeof(m_control_register), 1, f);
+    writer.write(&m_shift_register, sizeof(m_shift_register));
+    writer.write(&m_shift_register_writes, sizeof(m_shift_register_writes));
+    writer.write(&m_control_register, sizeof(m_control_register));
 
-    fwrite(&m_first_chr_bank, sizeof(m_first_chr_bank), 1, f);
-    fwrite(&m_second_chr_bank, sizeof(m_second_chr_bank), 1, f);
-    fwrite(&m_merged_chr_bank, sizeof(m_merged_chr_bank), 1, f);
+    writer.write(&m_first_chr_bank, sizeof(m_first_chr_bank));
+    writer.write(&m_second_chr_bank, sizeof(m_second_chr_bank));
+    writer.write(&m_merged_chr_bank, sizeof(m_merged_chr_bank));
 
-    fwrite(&m_first_prg_bank, sizeof(m_first_prg_bank), 1, f);
-    fwrite(&m_second_prg_bank, sizeof(m_second_prg_bank), 1, f);
-    fwrite(&m_merged_prg_bank, sizeof(m_merged_prg_bank), 1, f);
+    writer.write(&m_first_prg_bank, sizeof(m_first_prg_bank));
+    writer.write(&m_second_prg_bank, sizeof(m_second_prg_bank));
+    writer.write(&m_merged_prg_bank, sizeof(m_merged_prg_bank));
 }
 
 
-void Mapper001::deserialize(FILE* f, int version)
+void Mapper001::deserialize(StateReader& reader, int version)
 {
-    fread(&m_shift_register, sizeof(m_shift_register), 1, f);
-    fread(&m_shift_register_writes, sizeof(m_shift_register_writes), 1, f);
-    fread(&m_control_register, sizeof(m_control_register), 1, f);
+    reader.read(&m_shift_register, sizeof(m_shift_register));
+    reader.read(&m_shift_register_writes, sizeof(m_shift_register_writes));
+    reader.read(&m_control_register, sizeof(m_control_register));
 
-    fread(&m_first_chr_bank, sizeof(m_first_chr_bank), 1, f);
-    fread(&m_second_chr_bank, sizeof(m_second_chr_bank), 1, f);
-    fread(&m_merged_chr_bank, sizeof(m_merged_chr_bank), 1, f);
+    reader.read(&m_first_chr_bank, sizeof(m_first_chr_bank));
+    reader.read(&m_second_chr_bank, sizeof(m_second_chr_bank));
+    reader.read(&m_merged_chr_bank, sizeof(m_merged_chr_bank));
 
-    fread(&m_first_prg_bank, sizeof(m_first_prg_bank), 1, f);
-    fread(&m_second_prg_bank, sizeof(m_second_prg_bank), 1, f);
-    fread(&m_merged_prg_bank, sizeof(m_merged_prg_bank), 1, f);
+    reader.read(&m_first_prg_bank, sizeof(m_first_prg_bank));
+    reader.read(&m_second_prg_bank, sizeof(m_second_prg_bank));
+    reader.read(&m_merged_prg_bank, sizeof(m_merged_prg_bank));
 }
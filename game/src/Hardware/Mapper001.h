@@ -2,16 +2,14 @@
 
 #include "Mapper.h"
 
-#include <stdio.h>
-
 
 class Mapper001 final : public Mapper
 {
 public:
     Mapper001(int prg_banks, int chr_banks);
 
-    void serialize(FILE* f, int version) const override;
-    void deserialize(FILE* f, int version) override;
+    void serialize(StateWriter& writer, int version) const override;
+    void deserialize(StateReader& reader, int version) override;
 
     bool map_cpu_write(uint16_t addr, uint32_t* mapped_addr, uint8_t data) override;
     bool map_cpu_read(uint16_t addr, uint32_t* mapped_addr) override;
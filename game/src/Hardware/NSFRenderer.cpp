@@ -0,0 +1,270 @@
+#include "NSFRenderer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <memory.h>
+#include <thread>
+
+
+static const int BLOCK_SIZE = 1024; // Samples rendered at a time
+
+
+static uint8 MCS6502_read(uint16 addr, void * readWriteContext)
+{
+    return ((NSFRenderer*)readWriteContext)->cpu_read((int)addr);
+}
+
+
+static void MCS6502_write(uint16 addr, uint8 byte, void * readWriteContext)
+{
+    ((NSFRenderer*)readWriteContext)->cpu_write((int)addr, byte);
+}
+
+
+NSFRenderer::NSFRenderer(const uint8_t* rom, size_t size)
+    : m_synth(&m_blip)
+{
+    MCS6502Init(&m_cpu_context, MCS6502_read, MCS6502_write, this);
+
+    m_nsf_load_addr = 0x8000;
+    m_nsf_play_addr = 0xB3D1;
+    m_nsf_init_addr = 0xB3D8;
+    m_nsf_play_speed = 16666;
+
+    memset(m_ram, 0, sizeof(m_ram));
+    memcpy(m_ram + m_nsf_load_addr, rom + BANK_OFFSET, BANK_SIZE);
+
+    m_blip.set_rates((double)APUSynth<BlipBuffer>::CPU_CLOCK_SPEED, (double)SAMPLE_RATE);
+
+    // Patch in the init and play code from NSF
+    uint8_t nsf_code[] = {
+        // play:
+            0x20, 0x09, 0x80, // jsr $8009
+            0x20, 0x03, 0x80, // jsr $8003f
+            0x60, // rts
+            
+        // init: // a = 0 (First song), x = 0 (NTSC)
+            0xC9, 0x10, // cpm $10
+            0x90, 0x06, // bcc song_id_less_than_16
+            0x38, // sec
+            0xE9, 0x0F, // sbc $0F
+            0x85, 0xFB, // sta $FB
+            0x60, // rts
+            
+        // song_id_less_than_16:
+            0xAA, // tax
+            0xBD, 0xE9, 0xB3, // lda table, x
+            0x85, 0xFA, // sta $FA
+            0x60, // rts
+
+        // table:
+            0x01, 0x08, 0x07, 0x0E, 0x0D, 0x0F, 0x03, 0x09, 0x06, 0x0A, 0x05, 0x0B, 0x04, 0x02, 0x10, 0x0C // .db
+    };
+    int nsf_init_addr = m_nsf_play_addr;
+    memcpy(m_ram + nsf_init_addr, nsf_code, sizeof(nsf_code));
+
+    // Init code
+    uint8_t init_code[] = {
+        // Initialize the sound registers
+        0xA9, 0x00, // lda $00
+        0x8D, 0x00, 0x40, // sta $4000
+        0x8D, 0x01, 0x40, // sta $4001
+        0x8D, 0x02, 0x40, // sta $4002
+        0x8D, 0x03, 0x40, // sta $4003
+        0x8D, 0x04, 0x40, // sta $4004
+        0x8D, 0x05, 0x40, // sta $4005
+        0x8D, 0x06, 0x40, // sta $4006
+        0x8D, 0x07, 0x40, // sta $4007
+        0x8D, 0x08, 0x40, // sta $4008
+        0x8D, 0x09, 0x40, // sta $4009
+        0x8D, 0x0A, 0x40, // sta $400A
+        0x8D, 0x0B, 0x40, // sta $400B
+        0x8D, 0x0C, 0x40, // sta $400C
+        0x8D, 0x0D, 0x40, // sta $400D
+        0x8D, 0x0E, 0x40, // sta $400E
+        0x8D, 0x0F, 0x40, // sta $400F
+        0x8D, 0x10, 0x40, // sta $4010
+        0x8D, 0x11, 0x40, // sta $4011
+        0x8D, 0x12, 0x40, // sta $4012
+        0x8D, 0x13, 0x40, // sta $4013
+        0x8D, 0x15, 0x40, // sta $4015
+        0xA9, 0x0F, // lda $0F
+        0x8D, 0x15, 0x40, // sta $4015
+
+        // Initialize the frame counter to 4-step mode
+        0xA9, 0x40, // lda $40
+        0x8D, 0x17, 0x40, // sta $4017
+
+        // Call init(song 1, NTSC)
+        0xA9, 0x00, // lda $00
+        0xA2, 0x00, // ldx $00
+        0x20, (uint8_t)(m_nsf_init_addr), (uint8_t)(m_nsf_init_addr >> 8), // jsr init
+
+        // Infinite loop
+        0x4C, 0000, 0000
+    };
+    int init_addr = nsf_init_addr + sizeof(nsf_code);
+    m_init_infinite_loop_addr = init_addr + (int)sizeof(init_code) - 3;
+    init_code[sizeof(init_code) - 2] = (uint8_t)(m_init_infinite_loop_addr);
+    init_code[sizeof(init_code) - 1] = (uint8_t)(m_init_infinite_loop_addr >> 8);
+    memcpy(m_ram + init_addr, init_code, sizeof(init_code));
+
+    m_init_addr = init_addr;
+    m_music_id_addr = init_addr + sizeof(init_code) - 9;
+
+    uint8_t play_code[] = {
+        // Call play()
+        0x20, (uint8_t)(m_nsf_play_addr), (uint8_t)(m_nsf_play_addr >> 8), // jsr play
+
+        // Infinite loop
+        0x4C, 0000, 0000
+    };
+    int play_addr = init_addr + sizeof(init_code);
+    m_play_infinite_loop_addr = play_addr + (int)sizeof(play_code) - 3;
+    play_code[sizeof(play_code) - 2] = (uint8_t)(m_play_infinite_loop_addr);
+    play_code[sizeof(play_code) - 1] = (uint8_t)(m_play_infinite_loop_addr >> 8);
+    memcpy(m_ram + play_addr, play_code, sizeof(play_code));
+
+    m_play_addr = play_addr;
+}
+
+
+void NSFRenderer::play(int music_id)
+{
+    m_music_id = music_id;
+
+    // Set our reset vector to the init function then run the CPU for a bit so we initialize correctly
+    m_ram[m_music_id_addr] = music_id;
+    m_ram[0xFFFC] = (uint8_t)m_init_addr;
+    m_ram[0xFFFD] = (uint8_t)(m_init_addr >> 8);
+    MCS6502Reset(&m_cpu_context);
+    while (m_cpu_context.pc != m_init_infinite_loop_addr)
+        MCS6502ExecNext(&m_cpu_context);
+
+    // Set the reset addr to our play function, this is what will be used next time we reset the CPU
+    m_ram[0xFFFC] = (uint8_t)m_play_addr;
+    m_ram[0xFFFD] = (uint8_t)(m_play_addr >> 8);
+    MCS6502Reset(&m_cpu_context);
+    m_cpu_cycles = 0;
+
+    m_synth.reset_sequencer();
+}
+
+
+void NSFRenderer::cpu_write(int addr, uint8_t val)
+{
+    if (addr < 0x0800)
+    {
+        // Ram
+        m_ram[addr] = val;
+    }
+    else if (addr >= 0x4000 && addr <= 0x4017)
+    {
+        m_synth.write_register(m_cycle, addr, val);
+    }
+}
+
+
+uint8_t NSFRenderer::cpu_read(int addr)
+{
+    if (addr >= 0x4000 && addr <= 0x4017)
+        return m_synth.read_register(addr);
+
+    return m_ram[addr];
+}
+
+
+void NSFRenderer::emulate(int64_t end_cycle)
+{
+    while (m_cycle < end_cycle)
+    {
+        // A whole instruction at a time, the sequencer advanced by its cycles. One running past end_cycle
+        // finishes on the next call.
+        if (m_cpu_cycles == 0)
+        {
+            MCS6502ExecNext(&m_cpu_context);
+            m_cpu_cycles = std::max(1, (int)m_cpu_context.timingForLastOperation);
+        }
+        int cycles = (int)std::min<int64_t>(m_cpu_cycles, end_cycle - m_cycle);
+
+        // Call "NMI" every frame, unless play() hasn't returned yet
+        if (m_synth.clock_sequencer(m_cycle + cycles - 1, cycles) && (int)m_cpu_context.pc == m_play_infinite_loop_addr)
+            MCS6502Reset(&m_cpu_context); // Reset to the play function
+
+        m_cycle += cycles;
+        m_cpu_cycles -= cycles;
+    }
+}
+
+
+std::vector<float> NSFRenderer::render(int sound_id, int silence_samples, int max_samples)
+{
+    play(sound_id);
+
+    std::vector<float> samples;
+    samples.reserve(std::min(max_samples, SAMPLE_RATE * 2)); // Most sounds are shorter than that
+    float block[BLOCK_SIZE];
+    int silence_time = 0;
+
+    while (silence_time < silence_samples && (int)samples.size() < max_samples)
+    {
+        int64_t end_cycle = m_cycle + m_blip.clocks_needed(BLOCK_SIZE);
+        emulate(end_cycle);
+        m_synth.run(end_cycle);
+        m_blip.end_block(end_cycle);
+        m_blip.read_samples(block, BLOCK_SIZE);
+
+        for (int i = 0; i < BLOCK_SIZE && silence_time < silence_samples && (int)samples.size() < max_samples; ++i)
+        {
+            float sample = use_filter ? m_filter.process(block[i]) : block[i];
+
+            samples.push_back(sample);
+            if (std::fabs(sample) < 0.01f)
+                silence_time++;
+            else
+                silence_time = 0;
+        }
+    }
+
+    // Remove the silence at the end
+    samples.erase(samples.end() - silence_time, samples.end());
+
+    return samples;
+}
+
+
+std::vector<std::vector<float>> NSFRenderer::render_all(const uint8_t* rom, size_t size, const std::vector<int>& sound_ids, int silence_samples, int max_samples, int thread_count, bool use_filter)
+{
+    std::vector<std::vector<float>> sounds(sound_ids.size());
+    if (size < BANK_OFFSET + BANK_SIZE) return sounds;
+
+    // Created here because MCS6502Init isn't thread safe
+    std::vector<std::unique_ptr<NSFRenderer>> renderers;
+    for (size_t i = 0; i < sound_ids.size(); ++i)
+    {
+        renderers.push_back(std::make_unique<NSFRenderer>(rom, size));
+        renderers.back()->use_filter = use_filter;
+    }
+
+    const int sound_count = (int)sound_ids.size();
+    std::atomic<int> next_sound = 0;
+    auto render_worker = [&]()
+    {
+        for (int i = next_sound++; i < sound_count; i = next_sound++)
+            sounds[i] = renderers[i]->render(sound_ids[i], silence_samples, max_samples);
+    };
+
+    if (thread_count <= 0)
+        thread_count = (int)std::thread::hardware_concurrency();
+    thread_count = std::max(1, std::min(thread_count, sound_count));
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i)
+        threads.emplace_back(render_worker);
+    render_worker();
+    for (auto& thread : threads)
+        thread.join();
+
+    return sounds;
+}
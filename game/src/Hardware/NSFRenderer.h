@@ -0,0 +1,60 @@
+#pragma once
+
+#include "APUSynth.h"
+#include "BlipBuffer.h"
+#include "MCS6502.h"
+
+#include <vector>
+
+
+// Plays the ROM's sound engine on its own CPU and APU, through an NSF style init/play shim.
+// Nothing else from the game runs, so it renders much faster than real time.
+class NSFRenderer final
+{
+public:
+    static const int SAMPLE_RATE = 48000;
+    static const int MUSIC_COUNT = 16; // Sound ids below this are music tracks, the ones after are SFX
+    static const int BANK_OFFSET = 0x14000; // Sound engine bank, in PRG ROM
+    static const int BANK_SIZE = 0x4000;
+
+    NSFRenderer(const uint8_t* rom, size_t size);
+
+    // Renders sound_id until silence_samples of silence (trimmed off) or max_samples. Mono, SAMPLE_RATE.
+    std::vector<float> render(int sound_id, int silence_samples, int max_samples);
+
+    // Renders each sound on its own renderer, so they don't depend on each other's leftover state.
+    // thread_count 0 uses one thread per core.
+    static std::vector<std::vector<float>> render_all(const uint8_t* rom, size_t size, const std::vector<int>& sound_ids, int silence_samples, int max_samples, int thread_count = 0, bool use_filter = true);
+
+    void cpu_write(int addr, uint8_t val);
+    uint8_t cpu_read(int addr);
+
+    bool use_filter = true;
+
+private:
+    void play(int music_id);
+    void emulate(int64_t end_cycle); // Runs the CPU and the frame sequencer up to end_cycle
+
+    // Music stuff
+    BlipBuffer m_blip;
+    APUSynth<BlipBuffer> m_synth;
+    apu_filter_t m_filter;
+    int m_init_infinite_loop_addr = 0;
+    int m_play_infinite_loop_addr = 0;
+    int m_music_id = 0;
+    int m_init_addr = 0;
+    int m_music_id_addr = 0;
+    int m_play_addr = 0;
+
+    // Cpu vars
+    int64_t m_cycle = 0;
+    int m_cpu_cycles = 0; // Left in the instruction in flight
+    uint8_t m_ram[0x10000];
+    MCS6502ExecutionContext m_cpu_context;
+
+    // NSF crap
+    int m_nsf_load_addr = -1;
+    int m_nsf_init_addr = -1;
+    int m_nsf_play_addr = -1;
+    int m_nsf_play_speed = -1;
+};
@@ -2,59 +2,57 @@
 #include "CPU.h"
 #include "CPUBUS.h"
 #include "PPUBUS.h"
+#include "ErrorHandler.h"
+#include "PixelKernels.h"
 
-#include <onut/Dialogs.h>
-#include <onut/onut.h>
-#include <onut/Random.h>
-#include <onut/Renderer.h>
-#include <onut/SpriteBatch.h>
-#include <onut/Texture.h>
-
+#include <memory.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 
 static const int PPU_COL_COUNT = 341;
 static const int PPU_ROW_COUNT = 262;
+static const int NAMETABLE_TILE_COUNT = 32 * 30;
 
 
-PPU::PPU(CPU* cpu)
+PPU::PPU(CPU* cpu, const Cart* cart)
     : m_cpu(cpu)
+    , m_chr_cache(cart)
+    , m_pixel_kernels(&get_pixel_kernels())
 {
     memset(m_nametables, 0, sizeof(m_nametables));
     memset(m_sprites, 0, sizeof(m_sprites));
+    memset(m_nametable_dirty_tiles, 0, sizeof(m_nametable_dirty_tiles));
 
     load_colors();
+    update_palettes_rgba();
+
+    for (int i = 0; i < 2; ++i)
+    {
+        m_sprite_pixels[i] = new uint8_t[SCREEN_W * SCREEN_H * 4];
+        memset(m_sprite_pixels[i], 0, SCREEN_W * SCREEN_H * 4);
 
-    m_sprite_pixels = new uint8_t[SCREEN_W * SCREEN_H * 4];
-    memset(m_sprite_pixels, 0, SCREEN_W * SCREEN_H * 4);
-
-    m_pattern_pixels = new uint8_t[128 * 128 * 4];
-    memset(m_pattern_pixels, 0, 128 * 128 * 4);
-
-    m_nametable_pixels = new uint8_t[SCREEN_W * SCREEN_H * 4];
-    memset(m_nametable_pixels, 0, SCREEN_W * SCREEN_H * 4);
-
-    m_screen_texture = OTexture::createRenderTarget({ SCREEN_W, SCREEN_H });
-    m_sprite_textures[0] = OTexture::createDynamic({ SCREEN_W, SCREEN_H });
-    m_sprite_textures[0]->setData(m_sprite_pixels);
-    m_sprite_textures[1] = OTexture::createDynamic({ SCREEN_W, SCREEN_H });
-    m_sprite_textures[1]->setData(m_sprite_pixels);
-    m_chr_textures[0] = OTexture::createDynamic({ 128, 128 });
-    m_chr_textures[0]->setData(m_sprite_pixels);
-    m_chr_textures[1] = OTexture::createDynamic({ 128, 128 });
-    m_chr_textures[1]->setData(m_sprite_pixels);
-    m_nametable_textures[0] = OTexture::createDynamic({ SCREEN_W, SCREEN_H });
-    m_nametable_textures[0]->setData(m_sprite_pixels);
-    m_nametable_textures[1] = OTexture::createDynamic({ SCREEN_W, SCREEN_H });
-    m_nametable_textures[1]->setData(m_sprite_pixels);
+        m_pattern_pixels[i] = new uint8_t[128 * 128 * 4];
+        memset(m_pattern_pixels[i], 0, 128 * 128 * 4);
+
+        m_nametable_pixels[i] = new uint8_t[SCREEN_W * SCREEN_H * 4];
+        memset(m_nametable_pixels[i], 0, SCREEN_W * SCREEN_H * 4);
+    }
+
+    m_screen_pixels = new uint8_t[SCREEN_W * SCREEN_H * 4];
+    memset(m_screen_pixels, 0, SCREEN_W * SCREEN_H * 4);
 }
 
 
 PPU::~PPU()
 {
-    delete[] m_nametable_pixels;
-    delete[] m_pattern_pixels;
-    delete[] m_sprite_pixels;
+    delete[] m_screen_pixels;
+    for (int i = 0; i < 2; ++i)
+    {
+        delete[] m_nametable_pixels[i];
+        delete[] m_pattern_pixels[i];
+        delete[] m_sprite_pixels[i];
+    }
 }
 
 
@@ -65,62 +63,93 @@ void PPU::load_colors()
     FILE* f = fopen(palette_filename, "rb");
     if (!f)
     {
-        onut::showMessageBox("ERROR", "Missing palette file: " + std::string(palette_filename));
-        OQuit();
+        show_error("ERROR", "Missing palette file: " + std::string(palette_filename));
+        exit(0);
         return;
     }
     if (fread(m_colors, 1, 192, f) != 192)
     {
-        onut::showMessageBox("ERROR", "Corrupted palette file: " + std::string(palette_filename));
-        OQuit();
         fclose(f);
+        show_error("ERROR", "Corrupted palette file: " + std::string(palette_filename));
+        exit(0);
         return;
     }
     fclose(f);
+
+    for (int i = 0; i < 64; ++i)
+    {
+        m_rgba_colors[i] = pack_rgba(m_colors[i * 3 + 0], m_colors[i * 3 + 1], m_colors[i * 3 + 2], 255);
+    }
 }
 
 
-void PPU::serialize(FILE* f, int version) const
+void PPU::update_palettes_rgba()
 {
-    fwrite(&m_PPUCTRL_register, sizeof(m_PPUCTRL_register), 1, f);
-    fwrite(&m_PPUMASK_register, sizeof(m_PPUMASK_register), 1, f);
-    fwrite(&m_PPUSTATUS_register, sizeof(m_PPUSTATUS_register), 1, f);
-    fwrite(&m_OAMADDR_register, sizeof(m_OAMADDR_register), 1, f);
-    fwrite(&m_PPUSCROLL_register, sizeof(m_PPUSCROLL_register), 1, f);
-    fwrite(&m_PPUADDR_register, sizeof(m_PPUADDR_register), 1, f);
+    for (int i = 0; i < 32; ++i)
+    {
+        m_palettes_rgba[i] = get_rgba_color(m_palettes[i]);
+    }
+}
+
+
+void PPU::serialize(StateWriter& writer, int version) const
+{
+    writer.write(&m_PPUCTRL_register, sizeof(m_PPUCTRL_register));
+    writer.write(&m_PPUMASK_register, sizeof(m_PPUMASK_register));
+    writer.write(&m_PPUSTATUS_register, sizeof(m_PPUSTATUS_register));
+    writer.write(&m_OAMADDR_register, sizeof(m_OAMADDR_register));
+    writer.write(&m_PPUSCROLL_register, sizeof(m_PPUSCROLL_register));
+    writer.write(&m_PPUADDR_register, sizeof(m_PPUADDR_register));
     
-    fwrite(m_nametables, 1, sizeof(m_nametables), f);
-    fwrite(m_sprites, 1, sizeof(m_sprites), f);
-    fwrite(m_palettes, 1, sizeof(m_palettes), f);
-
-    fwrite(&m_row, sizeof(m_row), 1, f);
-    fwrite(&m_col, sizeof(m_col), 1, f);
-    fwrite(&m_frames, sizeof(m_frames), 1, f);
-    fwrite(&m_scroll_h, sizeof(m_scroll_h), 1, f);
-    fwrite(&m_scroll_v, sizeof(m_scroll_v), 1, f);
-    fwrite(&m_display_scroll_h, sizeof(m_display_scroll_h), 1, f);
+    writer.write(m_nametables, sizeof(m_nametables));
+    writer.write(m_sprites, sizeof(m_sprites));
+    writer.write(m_palettes, sizeof(m_palettes));
+
+    writer.write(&m_row, sizeof(m_row));
+    writer.write(&m_col, sizeof(m_col));
+    writer.write(&m_frames, sizeof(m_frames));
+    writer.write(&m_scroll_h, sizeof(m_scroll_h));
+    writer.write(&m_scroll_v, sizeof(m_scroll_v));
+    writer.write(&m_display_scroll_h, sizeof(m_display_scroll_h));
 }
 
 
-void PPU::deserialize(FILE* f, int version)
+void PPU::deserialize(StateReader& reader, int version)
 {
-    fread(&m_PPUCTRL_register, sizeof(m_PPUCTRL_register), 1, f);
-    fread(&m_PPUMASK_register, sizeof(m_PPUMASK_register), 1, f);
-    fread(&m_PPUSTATUS_register, sizeof(m_PPUSTATUS_register), 1, f);
-    fread(&m_OAMADDR_register, sizeof(m_OAMADDR_register), 1, f);
-    fread(&m_PPUSCROLL_register, sizeof(m_PPUSCROLL_register), 1, f);
-    fread(&m_PPUADDR_register, sizeof(m_PPUADDR_register), 1, f);
+    reader.read(&m_PPUCTRL_register, sizeof(m_PPUCTRL_register));
+    reader.read(&m_PPUMASK_register, sizeof(m_PPUMASK_register));
+    reader.read(&m_PPUSTATUS_register, sizeof(m_PPUSTATUS_register));
+    reader.read(&m_OAMADDR_register, sizeof(m_OAMADDR_register));
+    reader.read(&m_PPUSCROLL_register, sizeof(m_PPUSCROLL_register));
+    reader.read(&m_PPUADDR_register, sizeof(m_PPUADDR_register));
     
-    fread(m_nametables, 1, sizeof(m_nametables), f);
-    fread(m_sprites, 1, sizeof(m_sprites), f);
-    fread(m_palettes, 1, sizeof(m_palettes), f);
-
-    fread(&m_row, sizeof(m_row), 1, f);
-    fread(&m_col, sizeof(m_col), 1, f);
-    fread(&m_frames, sizeof(m_frames), 1, f);
-    fread(&m_scroll_h, sizeof(m_scroll_h), 1, f);
-    fread(&m_scroll_v, sizeof(m_scroll_v), 1, f);
-    fread(&m_display_scroll_h, sizeof(m_display_scroll_h), 1, f);
+    // Only what changed is re-rasterized, run-ahead and rewind load a snapshot every frame. Sprites are
+    // compared with what they were drawn from at v-blank already.
+    uint8_t nametables[2][1024];
+    if (reader.read(nametables, sizeof(nametables)) == sizeof(nametables))
+    {
+        for (int idx = 0; idx < 2; ++idx)
+            for (int addr = 0; addr < 1024; ++addr)
+                if (m_nametables[idx][addr] != nametables[idx][addr]) mark_nametable_dirty(idx, addr);
+        memcpy(m_nametables, nametables, sizeof(m_nametables));
+    }
+    reader.read(m_sprites, sizeof(m_sprites));
+    uint8_t palettes[32];
+    if (reader.read(palettes, sizeof(palettes)) == sizeof(palettes))
+    {
+        // Color 0 of each palette is transparent in the layers, like in ppu_write()
+        for (int i = 0; i < 32; ++i)
+            if (m_palettes[i] != palettes[i] && (i & 0b11)) m_palettes_dirty[i >> 2] = true;
+        memcpy(m_palettes, palettes, sizeof(m_palettes));
+    }
+    update_palettes_rgba();
+
+    reader.read(&m_row, sizeof(m_row));
+    reader.read(&m_col, sizeof(m_col));
+    reader.read(&m_frames, sizeof(m_frames));
+    reader.read(&m_scroll_h, sizeof(m_scroll_h));
+    reader.read(&m_scroll_v, sizeof(m_scroll_v));
+    reader.read(&m_display_scroll_h, sizeof(m_display_scroll_h));
 }
 
 
@@ -223,17 +252,22 @@ bool PPU::ppu_write(uint16_t addr, uint8_t data)
         addr = (addr - 0x2000) % 0x0800;
         if (addr >= 0x0000 && addr <= 0x03FF)
         {
+            if (m_nametables[0][addr] != data) mark_nametable_dirty(0, addr);
             m_nametables[0][addr] = data;
             return true;
         }
         else if (addr >= 0x0400 && addr <= 0x07FF)
         {
+            if (m_nametables[1][addr - 0x400] != data) mark_nametable_dirty(1, addr - 0x400);
             m_nametables[1][addr - 0x400] = data;
         }
     }
     else if (addr >= 0x3F00 && addr <= 0x3FFF)
     {
+        // Color 0 of each palette is transparent in the layers, only the clear color uses $3F00
+        if (m_palettes[addr & 0b11111] != data && (addr & 0b11)) m_palettes_dirty[(addr & 0b11111) >> 2] = true;
         m_palettes[addr & 0b11111] = data;
+        m_palettes_rgba[addr & 0b11111] = get_rgba_color(data);
         return true;
     }
 
@@ -284,73 +318,91 @@ void PPU::reset()
     m_frames = 0;
     m_scroll_h = 0;
     m_scroll_v = 0;
+    m_cycle = 0;
+    m_nmi_cycle = -1;
+    m_sprite0_cycle = -1;
+
+    m_all_dirty = true;
+}
+
+
+void PPU::mark_nametable_dirty(int idx, int addr)
+{
+    if (addr < NAMETABLE_TILE_COUNT)
+    {
+        m_nametable_dirty_tiles[idx][addr] = true;
+        return;
+    }
+
+    // An attribute byte covers 4x4 tiles
+    int attrib_k = addr - NAMETABLE_TILE_COUNT;
+    int tx0 = (attrib_k % 8) * 4;
+    int ty0 = (attrib_k / 8) * 4;
+    for (int ty = ty0; ty < ty0 + 4 && ty < 30; ++ty)
+    {
+        for (int tx = tx0; tx < tx0 + 4; ++tx)
+        {
+            m_nametable_dirty_tiles[idx][ty * 32 + tx] = true;
+        }
+    }
 }
 
 
-void PPU::update_pattern_table(int idx)
+void PPU::update_pattern_table(int idx, const bool* chr_dirty)
 {
-    int addr = idx * 0x1000;
-    auto ppu_bus = get_ppu_bus();
+    auto pattern_pixels = m_pattern_pixels[idx];
+    bool changed = false;
+
+    // Grayscale, the pattern tables don't know which palette they'll be used with
+    const uint32_t colors[4] = {
+        pack_rgba(0, 0, 0, 255),
+        pack_rgba(85, 85, 85, 255),
+        pack_rgba(170, 170, 170, 255),
+        pack_rgba(255, 255, 255, 255)
+    };
 
     for (int ty = 0; ty < 16; ++ty)
     {
         int dst_y = ty * 8 * 16 * 8 * 4;
-        int src_y = ty * 16 * 16;
         for (int tx = 0; tx < 16; ++tx)
         {
+            int tile_k = idx * 256 + ty * 16 + tx;
+            if (!chr_dirty[tile_k]) continue;
+            changed = true;
+
             int dst_x = tx * 8 * 4;
             int dst_k = dst_y + dst_x;
-            int src_x = tx * 16;
-            int src_k = addr + src_y + src_x;
-            for (int y = 0; y < 8; ++y, dst_k += 16 * 8 * 4 - 8 * 4, ++src_k)
+            auto tile = m_chr_cache.get_tile(tile_k);
+            for (int y = 0; y < 8; ++y, dst_k += 16 * 8 * 4, tile += 8)
             {
-                uint8_t plane0 = 0x55;
-                uint8_t plane1 = 0x55;
-                
-                ppu_bus->read(src_k, &plane0);
-                ppu_bus->read(src_k + 8, &plane1);
-
-                for (int x = 0; x < 8; ++x, dst_k += 4)
-                {
-                    int b0 = (plane0 >> (7 - x)) & 1;
-                    int b1 = (plane1 >> (7 - x)) & 1;
-                    int col = (b0) | (b1 << 1);
-                    m_pattern_pixels[dst_k + 0] = col * 85;
-                    m_pattern_pixels[dst_k + 1] = col * 85;
-                    m_pattern_pixels[dst_k + 2] = col * 85;
-                    m_pattern_pixels[dst_k + 3] = 255;
-                }
+                m_pixel_kernels->expand_row(tile, colors, pattern_pixels + dst_k);
             }
         }
     }
 
-    m_chr_textures[idx]->setData(m_pattern_pixels);
+    if (changed) m_pattern_versions[idx]++;
 }
 
 
-Color PPU::get_color(int idx)
+void PPU::update_nametable(int idx, const bool* chr_dirty, bool all_dirty)
 {
-    return Color(
-        (float)m_colors[idx * 3 + 0] / 255.0f,
-        (float)m_colors[idx * 3 + 1] / 255.0f,
-        (float)m_colors[idx * 3 + 2] / 255.0f,
-        1.0f);
-}
-
-
-void PPU::update_nametable(int idx)
-{
-    memset(m_nametable_pixels, 0, SCREEN_W * SCREEN_H * 4);
+    auto nametable_pixels = m_nametable_pixels[idx];
+    auto dirty_tiles = m_nametable_dirty_tiles[idx];
 
     if (!(m_PPUMASK_register & 0b00001000))
     {
         // nametables off
-        m_nametable_textures[idx]->setData(m_nametable_pixels);
+        if (all_dirty)
+        {
+            memset(nametable_pixels, 0, SCREEN_W * SCREEN_H * 4);
+            m_nametable_versions[idx]++;
+        }
+        memset(dirty_tiles, 0, NAMETABLE_TILE_COUNT);
         return;
     }
 
-    auto ppu_bus = get_ppu_bus();
-    int chr_offset = 0x1000;
+    int chr_offset = 256; // Background uses the second pattern table
+    bool changed = false;
 
     // There are faster ways to blit that data... There's a reason the data is layed out the way it is
     for (int ty = 0; ty < 30; ++ty)
@@ -370,50 +422,56 @@ void PPU::update_nametable(int idx)
             int quadran = ((tx / 2) & 1) + (((ty / 2) & 1) * 2);
             int pal_idx = (attrib >> (quadran * 2)) & 0b11;
 
-            uint8_t* pal = m_palettes + pal_idx * 4; // Should do a ppu read here
             uint8_t tile_id = m_nametables[idx][src_k];
 
-            int chr_src_k = tile_id * 16 + chr_offset;
-            for (int y = 0; y < 8; ++y, dst_k += 32 * 8 * 4 - 8 * 4, chr_src_k++)
+            // Skip tiles that would come out the same as last frame
+            if (!all_dirty && !dirty_tiles[src_k] && !m_palettes_dirty[pal_idx] && !chr_dirty[chr_offset + tile_id]) continue;
+            dirty_tiles[src_k] = false;
+            changed = true;
+
+            // Color 0 is see-through, the renderer puts the clear color behind
+            const uint32_t* pal = m_palettes_rgba + pal_idx * 4;
+            const uint32_t colors[4] = { 0, pal[1], pal[2], pal[3] };
+            auto tile = m_chr_cache.get_tile(chr_offset + tile_id);
+            for (int y = 0; y < 8; ++y, dst_k += 32 * 8 * 4, tile += 8)
             {
-                uint8_t plane0 = 0x55;
-                uint8_t plane1 = 0x55;
-                
-                ppu_bus->read(chr_src_k, &plane0);
-                ppu_bus->read(chr_src_k + 8, &plane1);
-
-                for (int x = 0; x < 8; ++x, dst_k += 4)
-                {
-                    int b0 = (plane0 >> (7 - x)) & 1;
-                    int b1 = (plane1 >> (7 - x)) & 1;
-                    int col = (b0) | (b1 << 1);
-
-                    if (col)
-                    {
-                        m_nametable_pixels[dst_k + 0] = m_colors[pal[col] * 3 + 0];
-                        m_nametable_pixels[dst_k + 1] = m_colors[pal[col] * 3 + 1];
-                        m_nametable_pixels[dst_k + 2] = m_colors[pal[col] * 3 + 2];
-                        m_nametable_pixels[dst_k + 3] = 255;
-                    }
-                }
+                m_pixel_kernels->expand_row(tile, colors, nametable_pixels + dst_k);
             }
         }
     }
 
-    m_nametable_textures[idx]->setData(m_nametable_pixels);
+    if (changed) m_nametable_versions[idx]++;
 }
 
 
-void PPU::update_sprites(int idx)
+void PPU::update_sprites(int idx, bool all_dirty)
 {
-    memset(m_sprite_pixels, 0, SCREEN_W * SCREEN_H * 4);
+    auto sprite_pixels = m_sprite_pixels[idx];
+    if (all_dirty)
+    {
+        memset(sprite_pixels, 0, SCREEN_W * SCREEN_H * 4);
+    }
+    else
+    {
+        // Only erase where sprites were drawn last time
+        for (int i = 0; i < 256; i += 4)
+        {
+            auto sprite = m_drawn_sprites + i;
+            int x = (int)sprite[3];
+            int w = (x + 8 < SCREEN_W) ? 8 : SCREEN_W - x;
+            for (int y = (int)sprite[0] + 1; y < (int)sprite[0] + 9 && y < SCREEN_H; ++y)
+            {
+                memset(sprite_pixels + (y * SCREEN_W + x) * 4, 0, w * 4);
+            }
+        }
+    }
+    m_sprite_versions[idx]++;
+
     if (!(m_PPUMASK_register & 0b00010000))
     {
-        m_sprite_textures[idx]->setData(m_sprite_pixels);
         return;
     }
 
-    auto ppu_bus = get_ppu_bus();
     for (int i = 0; i < 256; i += 4)
     {
         auto sprite = m_sprites + i;
@@ -428,91 +486,180 @@ void PPU::update_sprites(int idx)
         }
 
         int pal_idx = sprite[2] & 0b11;
-        uint8_t* pal = m_palettes + 16 + pal_idx * 4; // Should do a ppu read here
+        const uint32_t* pal = m_palettes_rgba + 16 + pal_idx * 4; // Color 0 is transparent, blend_row skips it
 
         int dst_k = ((int)sprite[0] + 1) * SCREEN_W * 4 + (int)sprite[3] * 4;
-        int dst_inc_y = SCREEN_W * 4 - 8 * 4;
-        int dst_inc_x = 4;
-        int src_k = (int)sprite[1] * 16;
-        int src_inc_y = 1;
+        auto tile = m_chr_cache.get_tile(sprite[1]);
+        int src_k = 0;
+        int src_inc_y = 8;
         bool flipped_h = (sprite[2] & 0b01000000) ? true : false;
+        bool clipped = (int)sprite[3] + 8 > SCREEN_W;
 
         if (sprite[2] & 0b10000000)
         {
             // y-flipped
-            src_k += 7;
+            src_k += 7 * 8;
             src_inc_y = -src_inc_y;
         }
 
-        for (int y = 0; y < 8; ++y, src_k += src_inc_y, dst_k += dst_inc_y)
+        for (int y = 0; y < 8; ++y, src_k += src_inc_y, dst_k += SCREEN_W * 4)
         {
             if (((int)sprite[0] + 1) + y >= SCREEN_H) break;
 
-            uint8_t plane0 = 0x55;
-            uint8_t plane1 = 0x55;
-            
-            ppu_bus->read(src_k, &plane0);
-            ppu_bus->read(src_k + 8, &plane1);
-
+            auto row = tile + src_k;
+            uint8_t flipped_row[8];
             if (flipped_h)
             {
-                for (int x = 0; x < 8; ++x, dst_k += dst_inc_x)
-                {
-                    if ((int)sprite[3] + x < SCREEN_W)
-                    {
-                        int b0 = (plane0 >> x) & 1;
-                        int b1 = (plane1 >> x) & 1;
-                        int col = (b0) | (b1 << 1);
-
-                        if (col)
-                        {
-                            m_sprite_pixels[dst_k + 0] = m_colors[pal[col] * 3 + 0];
-                            m_sprite_pixels[dst_k + 1] = m_colors[pal[col] * 3 + 1];
-                            m_sprite_pixels[dst_k + 2] = m_colors[pal[col] * 3 + 2];
-                            m_sprite_pixels[dst_k + 3] = 255;
-                        }
-                    }
-                }
+                for (int x = 0; x < 8; ++x)
+                    flipped_row[x] = row[7 - x];
+                row = flipped_row;
             }
-            else
+
+            if (!clipped)
             {
-                for (int x = 0; x < 8; ++x, dst_k += dst_inc_x)
-                {
-                    if ((int)sprite[3] + x < SCREEN_W)
-                    {
-                        int b0 = (plane0 >> (7 - x)) & 1;
-                        int b1 = (plane1 >> (7 - x)) & 1;
-                        int col = (b0) | (b1 << 1);
-
-                        if (col)
-                        {
-                            m_sprite_pixels[dst_k + 0] = m_colors[pal[col] * 3 + 0];
-                            m_sprite_pixels[dst_k + 1] = m_colors[pal[col] * 3 + 1];
-                            m_sprite_pixels[dst_k + 2] = m_colors[pal[col] * 3 + 2];
-                            m_sprite_pixels[dst_k + 3] = 255;
-                        }
-                    }
-                }
+                m_pixel_kernels->blend_row(row, pal, sprite_pixels + dst_k);
+                continue;
+            }
+
+            // Goes past the right edge
+            for (int x = 0; (int)sprite[3] + x < SCREEN_W; ++x)
+            {
+                if (row[x]) memcpy(sprite_pixels + dst_k + x * 4, &pal[row[x]], 4);
             }
         }
     }
-
-    m_sprite_textures[idx]->setData(m_sprite_pixels);
 }
 
 
 void PPU::update_screen()
 {
-    // Animate mist in ROM directly
+    // Decode the CHR tiles that changed since the last frame (The mist scroll rewrites some every frame)
+    bool chr_dirty[CHRCache::TILE_COUNT];
+    if (m_all_dirty) m_chr_cache.invalidate();
+    m_chr_cache.refresh(chr_dirty);
+
+    update_pattern_table(0, chr_dirty);
+    update_pattern_table(1, chr_dirty);
+
+    bool nametables_dirty = m_all_dirty || ((m_PPUMASK_register ^ m_drawn_mask) & 0b00001000);
+    update_nametable(0, chr_dirty, nametables_dirty);
+    update_nametable(1, chr_dirty, nametables_dirty);
+
+    // Sprites are cheap, redraw them all as soon as anything they use changed
+    bool sprites_dirty = m_all_dirty ||
+                         ((m_PPUMASK_register ^ m_drawn_mask) & 0b00010000) ||
+                         memcmp(m_sprites, m_drawn_sprites, sizeof(m_sprites)) != 0 ||
+                         m_palettes_dirty[4] || m_palettes_dirty[5] || m_palettes_dirty[6] || m_palettes_dirty[7];
+    for (int i = 0; i < 256 && !sprites_dirty; i += 4)
+    {
+        sprites_dirty = chr_dirty[m_sprites[i + 1]];
+    }
+    if (sprites_dirty)
+    {
+        update_sprites(0, m_all_dirty);
+        update_sprites(1, m_all_dirty);
+        memcpy(m_drawn_sprites, m_sprites, sizeof(m_sprites));
+    }
+
+    memset(m_palettes_dirty, 0, sizeof(m_palettes_dirty));
+    m_drawn_mask = m_PPUMASK_register;
+    m_all_dirty = false;
 
+    if (m_compose_screen) compose_screen();
 
-    //
-    update_pattern_table(0);
-    update_pattern_table(1);
-    update_nametable(0);
-    update_nametable(1);
-    update_sprites(0);
-    update_sprites(1);
+    m_screen_frame++;
+    publish_frame();
+}
+
+
+void PPU::publish_frame()
+{
+    // The slot holds the frame from two publishes ago. Copy what changed since.
+    frame_t& frame = m_published_frames.get_back();
+    if (m_compose_screen)
+    {
+        if (frame.screen_version != m_screen_version)
+        {
+            memcpy(frame.screen_pixels, m_screen_pixels, sizeof(frame.screen_pixels));
+            frame.screen_version = m_screen_version;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            if (frame.sprite_versions[i] != m_sprite_versions[i])
+            {
+                memcpy(frame.sprite_pixels[i], m_sprite_pixels[i], sizeof(frame.sprite_pixels[i]));
+                frame.sprite_versions[i] = m_sprite_versions[i];
+            }
+            if (frame.pattern_versions[i] != m_pattern_versions[i])
+            {
+                memcpy(frame.pattern_pixels[i], m_pattern_pixels[i], sizeof(frame.pattern_pixels[i]));
+                frame.pattern_versions[i] = m_pattern_versions[i];
+            }
+            if (frame.nametable_versions[i] != m_nametable_versions[i])
+            {
+                memcpy(frame.nametable_pixels[i], m_nametable_pixels[i], sizeof(frame.nametable_pixels[i]));
+                frame.nametable_versions[i] = m_nametable_versions[i];
+            }
+        }
+    }
+    frame.compose_screen = m_compose_screen;
+    frame.display_scroll_h = m_display_scroll_h;
+    frame.clear_color = m_palettes_rgba[0];
+    m_published_frames.publish();
+}
+
+
+void PPU::compose_screen()
+{
+    // Nothing moved since last time?
+    const int versions[5] = { m_sprite_versions[0], m_sprite_versions[1], m_nametable_versions[0], m_nametable_versions[1], m_display_scroll_h };
+    if (!memcmp(versions, m_composed_versions, sizeof(versions)) && m_composed_clear_color == m_palettes_rgba[0]) return;
+    memcpy(m_composed_versions, versions, sizeof(versions));
+    m_composed_clear_color = m_palettes_rgba[0];
+
+    const int row_size = SCREEN_W * 4;
+    int scroll_h = m_display_scroll_h & 0x1FF;
+
+    for (int y = 0; y < SCREEN_H; ++y)
+    {
+        auto dst = m_screen_pixels + y * row_size;
+
+        for (int x = 0; x < SCREEN_W; ++x)
+        {
+            memcpy(dst + x * 4, &m_palettes_rgba[0], 4);
+        }
+
+        m_pixel_kernels->blend_pixels(m_sprite_pixels[0] + y * row_size, dst, SCREEN_W);
+
+        if (y < 32)
+        {
+            // The top part is always at scroll 0
+            m_pixel_kernels->blend_pixels(m_nametable_pixels[0] + y * row_size, dst, SCREEN_W);
+        }
+        else
+        {
+            // Nametables side by side, wrapping around
+            int x = 0;
+            int src_x = scroll_h;
+            while (x < SCREEN_W)
+            {
+                int nametable = (src_x / SCREEN_W) & 1;
+                int nametable_x = src_x % SCREEN_W;
+                int count = SCREEN_W - nametable_x;
+                if (count > SCREEN_W - x) count = SCREEN_W - x;
+                m_pixel_kernels->blend_pixels(m_nametable_pixels[nametable] + y * row_size + nametable_x * 4, dst + x * 4, count);
+                x += count;
+                src_x += count;
+            }
+        }
+
+        m_pixel_kernels->blend_pixels(m_sprite_pixels[1] + y * row_size, dst, SCREEN_W);
+    }
+
+    m_screen_version++;
 }
 
 
@@ -544,6 +691,7 @@ void PPU::tick()
         {
             // Sprite 0 hit
             m_PPUSTATUS_register |= 0b01000000;
+            m_sprite0_cycle = m_cycle;
         }
 
         // First DOT is idle
@@ -580,23 +728,74 @@ void PPU::tick()
             m_PPUSTATUS_register |= 0b10000000;
             m_display_scroll_h = m_scroll_h;
             if (m_PPUCTRL_register | 0b10000000)
+            {
                 m_cpu->NMI();
-            update_screen();
+                m_nmi_cycle = m_cycle;
+            }
+            if (!m_skip_screen)
+                update_screen();
         }
     }
 
     // Pass to the next dot
-    m_col++;
+    skip_dots(1);
+}
 
+
+int PPU::get_line_length() const
+{
     // Odd frames, the first scanline has 1 less cycle
-    int end_line = PPU_COL_COUNT;
     if (m_row == 261 && (m_frames & 0b1))
     {
-        end_line--;
+        return PPU_COL_COUNT - 1;
     }
+    return PPU_COL_COUNT;
+}
+
+
+int PPU::get_dots_to_vblank() const
+{
+    // v-blank starts when the dot at scanline 241, column 1 runs. Count through it.
+    const int vblank_dot = 241 * PPU_COL_COUNT + 1;
+    int dot = m_row * PPU_COL_COUNT + m_col;
+    if (dot <= vblank_dot)
+        return vblank_dot - dot + 1;
+
+    int frame_dots = PPU_ROW_COUNT * PPU_COL_COUNT - ((m_frames & 0b1) ? 1 : 0);
+    return frame_dots - dot + vblank_dot + 1;
+}
+
+
+int PPU::get_next_event_col() const
+{
+    // Columns, on the current scanline, where tick() has something to do
+    if (m_row == 261)
+    {
+        if (m_col <= 1) return 1;
+        if (m_col <= 257) return 257;
+        if (m_col <= 320) return 320;
+    }
+    else if (m_row >= 0 && m_row <= 239)
+    {
+        if (m_row == 25 && m_col <= 1) return 1;
+        if (m_col <= 257) return 257;
+    }
+    else if (m_row == 241)
+    {
+        if (m_col <= 1) return 1;
+    }
+    return -1;
+}
+
+
+void PPU::skip_dots(int dots)
+{
+    // Never crosses more than one scanline
+    m_cycle += dots;
+    m_col += dots;
 
     // End of scanline
-    if (m_col >= end_line)
+    if (m_col >= get_line_length())
     {
         m_col = 0;
         m_row++;
@@ -610,50 +809,24 @@ void PPU::tick()
 }
 
 
-void PPU::render()
+void PPU::run_until(int64_t cycle)
 {
-    auto res = OScreenf;
-    float scale = std::floor(res.y / (float)SCREEN_H);
+    while (m_cycle < cycle)
+    {
+        // Jump straight to the next dot that does work, or the end of the scanline
+        int event_col = get_next_event_col();
+        if (event_col == m_col)
+        {
+            tick();
+            continue;
+        }
 
-    oRenderer->renderStates.renderTargets[0].push(m_screen_texture);
-    oRenderer->clear(OColorRGB(m_colors[m_palettes[0] * 3 + 0], m_colors[m_palettes[0] * 3 + 1], m_colors[m_palettes[0] * 3 + 2]));
-    oSpriteBatch->begin();
-    
-    // Draw background sprites
-    oSpriteBatch->drawSprite(m_sprite_textures[0], Vector2::Zero, Color::White, OTopLeft);
-
-    // Render the nametables to the render target.
-    oSpriteBatch->drawRectWithUVs(m_nametable_textures[0], 
-                                    Rect(-(float)m_display_scroll_h, 32.0f, (float)SCREEN_W, (float)SCREEN_H - 32.0f),
-                                    Vector4(0, 32.0f / (float)SCREEN_H, 1, 1), Color::White);
-    oSpriteBatch->drawRectWithUVs(m_nametable_textures[1], 
-                                    Rect((float)SCREEN_W - (float)m_display_scroll_h, 32.0f, (float)SCREEN_W, (float)SCREEN_H - 32.0f),
-                                    Vector4(0, 32.0f / (float)SCREEN_H, 1, 1), Color::White);
-    oSpriteBatch->drawRectWithUVs(m_nametable_textures[0], 
-                                    Rect(-(float)m_display_scroll_h + (float)SCREEN_W * 2, 32.0f, (float)SCREEN_W, (float)SCREEN_H - 32.0f),
-                                    Vector4(0, 32.0f / (float)SCREEN_H, 1, 1), Color::White);
-
-    // The top part is always at scroll 0
-    oSpriteBatch->drawRectWithUVs(m_nametable_textures[0], Rect(0, 0, (float)SCREEN_W, 32.0f), Vector4(0, 0, 1, 32.0f / (float)SCREEN_H), Color::White);
-
-    // Draw foreground sprites
-    oSpriteBatch->drawSprite(m_sprite_textures[1], Vector2::Zero, Color::White, OTopLeft);
-
-    oSpriteBatch->end();
-    oRenderer->renderStates.renderTargets[0].pop();
-    
-    // Draw final image
-    oSpriteBatch->begin();
-    oSpriteBatch->drawSpriteWithUVs(m_screen_texture, OScreenCenterf, 
-                                    Vector4(0, 8.0f / (float)SCREEN_H, 1.0f, ((float)SCREEN_H - 8.0f) / (float)SCREEN_H),
-                                    Color::White, 0.0f, scale, OCenter);
-#if defined(_DEBUG) // To be safe
-#if 0
-    oSpriteBatch->drawSprite(m_chr_textures[0], Vector2(0, 16), Color::White, 0.0f, 2.0f, OTopLeft);
-    oSpriteBatch->drawSprite(m_chr_textures[1], Vector2(0, 16 + 128 * 2 + 2), Color::White, 0.0f, 2.0f, OTopLeft);
-    oSpriteBatch->drawSprite(m_nametable_textures[0], Vector2(res.x - SCREEN_W, 16), Color::White, OTopLeft);
-    oSpriteBatch->drawSprite(m_nametable_textures[1], Vector2(res.x - SCREEN_W, 16 + SCREEN_H + 2), Color::White, OTopLeft);
-#endif
-#endif
-    oSpriteBatch->end();
+        int dots = (event_col == -1 ? get_line_length() : event_col) - m_col;
+        if ((int64_t)dots > cycle - m_cycle)
+        {
+            dots = (int)(cycle - m_cycle);
+        }
+        skip_dots(dots);
+    }
 }
+
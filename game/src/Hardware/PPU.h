@@ -1,14 +1,15 @@
 #pragma once
 
+#include "CHRCache.h"
 #include "CPUPeripheral.h"
 #include "PPUPeripheral.h"
+#include "StateBuffer.h"
+#include "TripleBuffer.h"
 
-#include <onut/Color.h>
-#include <onut/ForwardDeclaration.h>
 
-
-OForwardDeclare(Texture);
+class Cart;
 class CPU;
+struct pixel_kernels_t;
 
 
 class PPU final : public CPUPeripheral, public PPUPeripheral
@@ -16,30 +17,95 @@ class PPU final : public CPUPeripheral, public PPUPeripheral
 public:
     static const int SCREEN_W = 256;
     static const int SCREEN_H = 240;
+    static const int FRAME_DOTS = 341 * 262;
+
+    // A finished frame, handed over to the renderer. Only what it draws from is copied: the screen
+    // when composited in software, the layers otherwise.
+    struct frame_t
+    {
+        uint8_t sprite_pixels[2][SCREEN_W * SCREEN_H * 4];
+        uint8_t pattern_pixels[2][128 * 128 * 4];
+        uint8_t nametable_pixels[2][SCREEN_W * SCREEN_H * 4];
+        uint8_t screen_pixels[SCREEN_W * SCREEN_H * 4];
+        int sprite_versions[2] = { -1, -1 };
+        int pattern_versions[2] = { -1, -1 };
+        int nametable_versions[2] = { -1, -1 };
+        int screen_version = -1;
+        bool compose_screen = false;
+        int display_scroll_h = 0;
+        uint32_t clear_color = 0; // Packed RGBA
+    };
 
-    PPU(CPU* cpu);
+    PPU(CPU* cpu, const Cart* cart);
     ~PPU();
 
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
 
     bool cpu_write(uint16_t addr, uint8_t data) override;
     bool cpu_read(uint16_t addr, uint8_t* out_data) override;
     bool ppu_write(uint16_t addr, uint8_t data) override;
     bool ppu_read(uint16_t addr, uint8_t* out_data) override;
+    std::vector<cpu_range_t> get_cpu_ranges() const override { return { { 0x2000, 0x3FFF }, { 0x4014, 0x4014 } }; }
 
-    Color get_color(int idx);
+    const uint8_t* get_color(int idx) const { return m_colors + idx * 3; } // RGB
+    uint32_t get_rgba_color(int idx) const { return m_rgba_colors[idx & 0x3F]; } // Packed RGBA, see pack_rgba()
+    const uint8_t* get_palettes() const { return m_palettes; }
+    const uint32_t* get_palettes_rgba() const { return m_palettes_rgba; } // Palette RAM resolved to packed RGBA
 
     void reset();
-    void tick();
-    void render();
+    void tick(); // One dot
+    void run_until(int64_t cycle); // Runs dots until get_cycle() reaches cycle, skipping idle ones
+    int64_t get_cycle() const { return m_cycle; }
+    void set_cycle(int64_t cycle) { m_cycle = cycle; } // Back to where it was, after frames that never happened
+    int get_dots_to_vblank() const; // Dots to run for the next v-blank to have happened
+
+    // Dot of the latest v-blank NMI and sprite 0 hit, -1 before the first. run_until() must land them
+    // where tick() does.
+    int64_t get_nmi_cycle() const { return m_nmi_cycle; }
+    int64_t get_sprite0_cycle() const { return m_sprite0_cycle; }
+
+    // Frames that won't be shown can skip rasterizing at v-blank. The next one catches up on what changed.
+    void set_skip_screen(bool skip_screen) { m_skip_screen = skip_screen; }
+    void refresh_screen() { update_screen(); } // Rasterizes now, after jumping to another state
+    void invalidate() { m_all_dirty = true; } // Everything is rasterized again at the next v-blank, after loading a file
+
+    // Frame output, refreshed every v-blank. RGBA, SCREEN_W x SCREEN_H (pattern tables are 128x128).
+    int get_screen_frame() const { return m_screen_frame; }
+    int get_display_scroll_h() const { return m_display_scroll_h; }
+    const uint8_t* get_sprite_pixels(int idx) const { return m_sprite_pixels[idx]; } // Background then foreground
+    const uint8_t* get_nametable_pixels(int idx) const { return m_nametable_pixels[idx]; }
+    const uint8_t* get_pattern_pixels(int idx) const { return m_pattern_pixels[idx]; }
+
+    // Bumped when the matching pixels above changed, so only those need uploading
+    int get_sprite_version(int idx) const { return m_sprite_versions[idx]; }
+    int get_nametable_version(int idx) const { return m_nametable_versions[idx]; }
+    int get_pattern_version(int idx) const { return m_pattern_versions[idx]; }
+
+    // Optional final image, composited in software from the layers above: clear color,
+    // background sprites, nametables (scrolled below line 32), foreground sprites.
+    void set_compose_screen(bool compose_screen) { m_compose_screen = compose_screen; }
+    bool get_compose_screen() const { return m_compose_screen; }
+    const uint8_t* get_screen_pixels() const { return m_screen_pixels; }
+    int get_screen_version() const { return m_screen_version; }
+
+    // Latest finished frame. Can be called from another thread than the emulation's, but always the same
+    // one. Stays valid until the next call.
+    const frame_t& acquire_frame() { return m_published_frames.acquire(); }
 
 private:
     void load_colors();
+    void update_palettes_rgba();
+    int get_line_length() const;
+    int get_next_event_col() const;
+    void skip_dots(int dots);
     void update_screen();
-    void update_pattern_table(int idx);
-    void update_nametable(int idx);
-    void update_sprites(int idx);
+    void update_pattern_table(int idx, const bool* chr_dirty);
+    void update_nametable(int idx, const bool* chr_dirty, bool all_dirty);
+    void update_sprites(int idx, bool all_dirty);
+    void mark_nametable_dirty(int idx, int addr);
+    void compose_screen();
+    void publish_frame();
 
     uint8_t m_PPUCTRL_register = 0;
     uint8_t m_PPUMASK_register = 0;
@@ -54,18 +120,39 @@ private:
     uint8_t m_palettes[32] = { 0 };
 
     CPU* m_cpu = nullptr;
+    CHRCache m_chr_cache;
+    const pixel_kernels_t* m_pixel_kernels = nullptr;
     uint8_t m_colors[192] = { 0 };
-    uint8_t* m_sprite_pixels = nullptr;
-    uint8_t* m_pattern_pixels = nullptr;
-    uint8_t* m_nametable_pixels = nullptr;
-    OTextureRef m_screen_texture;
-    OTextureRef m_sprite_textures[2]; // Background then foreground
-    OTextureRef m_chr_textures[2];
-    OTextureRef m_nametable_textures[2];
+    uint32_t m_rgba_colors[64] = { 0 };
+    uint32_t m_palettes_rgba[32] = { 0 }; // Kept in sync with m_palettes
+    uint8_t* m_sprite_pixels[2] = { nullptr }; // Background then foreground
+    uint8_t* m_pattern_pixels[2] = { nullptr };
+    uint8_t* m_nametable_pixels[2] = { nullptr };
+    uint8_t* m_screen_pixels = nullptr;
+    int m_screen_frame = 0;
+    int m_sprite_versions[2] = { 0 };
+    int m_nametable_versions[2] = { 0 };
+    int m_pattern_versions[2] = { 0 };
+    bool m_compose_screen = false;
+    bool m_skip_screen = false;
+    int m_screen_version = 0;
+    int m_composed_versions[5] = { -1, -1, -1, -1, -1 }; // Sprites, nametables and scroll the screen was composed from
+    uint32_t m_composed_clear_color = 0;
+    TripleBuffer<frame_t> m_published_frames;
+
+    // What changed since the last v-blank, so we only re-rasterize the affected tiles
+    bool m_all_dirty = true; // After reset or load, the pixels don't match anything
+    bool m_nametable_dirty_tiles[2][960];
+    bool m_palettes_dirty[8] = { false };
+    uint8_t m_drawn_sprites[256] = { 0 }; // OAM the sprite pixels were rasterized from
+    uint8_t m_drawn_mask = 0;
     int m_row = 261;
     int m_col = 0;
     int m_frames = 0;
     int m_scroll_h = 0;
     int m_scroll_v = 0;
     int m_display_scroll_h = 0;
+    int64_t m_cycle = 0; // Dots since reset
+    int64_t m_nmi_cycle = -1;
+    int64_t m_sprite0_cycle = -1;
 };
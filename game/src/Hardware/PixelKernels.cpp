@@ -0,0 +1,149 @@
+#include "PixelKernels.h"
+
+#include <memory.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PIXEL_KERNELS_SSE2 1
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+
+uint32_t pack_rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    const uint8_t bytes[4] = { r, g, b, a };
+    uint32_t rgba;
+    memcpy(&rgba, bytes, 4);
+    return rgba;
+}
+
+
+static void scalar_expand_row(const uint8_t* indices, const uint32_t* palette, uint8_t* dst)
+{
+    for (int x = 0; x < 8; ++x, dst += 4)
+    {
+        memcpy(dst, &palette[indices[x]], 4);
+    }
+}
+
+
+static void scalar_blend_row(const uint8_t* indices, const uint32_t* palette, uint8_t* dst)
+{
+    for (int x = 0; x < 8; ++x, dst += 4)
+    {
+        if (indices[x]) memcpy(dst, &palette[indices[x]], 4);
+    }
+}
+
+
+static void scalar_blend_pixels(const uint8_t* src, uint8_t* dst, int count)
+{
+    for (int x = 0; x < count; ++x, src += 4, dst += 4)
+    {
+        if (src[3]) memcpy(dst, src, 4);
+    }
+}
+
+
+static const pixel_kernels_t SCALAR_PIXEL_KERNELS = { "scalar", scalar_expand_row, scalar_blend_row, scalar_blend_pixels };
+
+
+#if PIXEL_KERNELS_SSE2
+// 4 indices in 32 bits lanes -> 4 colors. Each lane picks the palette entry it equals.
+static inline __m128i sse2_lookup(__m128i idx, __m128i c0, __m128i c1, __m128i c2, __m128i c3)
+{
+    __m128i m1 = _mm_cmpeq_epi32(idx, _mm_set1_epi32(1));
+    __m128i m2 = _mm_cmpeq_epi32(idx, _mm_set1_epi32(2));
+    __m128i m3 = _mm_cmpeq_epi32(idx, _mm_set1_epi32(3));
+    __m128i m0 = _mm_cmpeq_epi32(idx, _mm_setzero_si128());
+    return _mm_or_si128(_mm_or_si128(_mm_and_si128(m0, c0), _mm_and_si128(m1, c1)),
+                        _mm_or_si128(_mm_and_si128(m2, c2), _mm_and_si128(m3, c3)));
+}
+
+
+static void sse2_expand_row(const uint8_t* indices, const uint32_t* palette, uint8_t* dst)
+{
+    // Gathers straight from the palette, cheaper than selecting out of all 4 colors in each lane
+    __m128i lo = _mm_set_epi32((int)palette[indices[3]], (int)palette[indices[2]], (int)palette[indices[1]], (int)palette[indices[0]]);
+    __m128i hi = _mm_set_epi32((int)palette[indices[7]], (int)palette[indices[6]], (int)palette[indices[5]], (int)palette[indices[4]]);
+    _mm_storeu_si128((__m128i*)dst, lo);
+    _mm_storeu_si128((__m128i*)(dst + 16), hi);
+}
+
+
+static void sse2_blend_row(const uint8_t* indices, const uint32_t* palette, uint8_t* dst)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i idx16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)indices), zero);
+    __m128i lo = _mm_unpacklo_epi16(idx16, zero);
+    __m128i hi = _mm_unpackhi_epi16(idx16, zero);
+
+    __m128i c1 = _mm_set1_epi32((int)palette[1]);
+    __m128i c2 = _mm_set1_epi32((int)palette[2]);
+    __m128i c3 = _mm_set1_epi32((int)palette[3]);
+
+    // Transparent lanes keep what's already there
+    __m128i dst_lo = _mm_loadu_si128((const __m128i*)dst);
+    __m128i dst_hi = _mm_loadu_si128((const __m128i*)(dst + 16));
+    _mm_storeu_si128((__m128i*)dst, sse2_lookup(lo, dst_lo, c1, c2, c3));
+    _mm_storeu_si128((__m128i*)(dst + 16), sse2_lookup(hi, dst_hi, c1, c2, c3));
+}
+
+
+static void sse2_blend_pixels(const uint8_t* src, uint8_t* dst, int count)
+{
+    __m128i alpha_mask = _mm_set1_epi32((int)pack_rgba(0, 0, 0, 255));
+    __m128i zero = _mm_setzero_si128();
+    int x = 0;
+    for (; x + 4 <= count; x += 4, src += 16, dst += 16)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)src);
+        __m128i d = _mm_loadu_si128((const __m128i*)dst);
+        __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(s, alpha_mask), zero);
+        _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_and_si128(transparent, d), _mm_andnot_si128(transparent, s)));
+    }
+    scalar_blend_pixels(src, dst, count - x);
+}
+
+
+static const pixel_kernels_t SIMD_PIXEL_KERNELS = { "sse2", sse2_expand_row, sse2_blend_row, sse2_blend_pixels };
+
+
+static bool has_simd()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    return true; // Always there on x64
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif
+
+
+const pixel_kernels_t& get_scalar_pixel_kernels()
+{
+    return SCALAR_PIXEL_KERNELS;
+}
+
+
+const pixel_kernels_t* get_simd_pixel_kernels()
+{
+#if PIXEL_KERNELS_SSE2
+    static const bool available = has_simd();
+    if (available) return &SIMD_PIXEL_KERNELS;
+#endif
+    return nullptr;
+}
+
+
+const pixel_kernels_t& get_pixel_kernels()
+{
+    auto simd = get_simd_pixel_kernels();
+    return simd ? *simd : get_scalar_pixel_kernels();
+}
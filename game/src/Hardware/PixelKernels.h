@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cinttypes>
+
+
+// Expands one row of 8 decoded CHR pixels (palette indices 0-3, see CHRCache)
+// into 8 RGBA32 pixels. palette holds the 4 RGBA colors, packed in memory order.
+struct pixel_kernels_t
+{
+    const char* name;
+
+    // dst[i] = palette[indices[i]]
+    void (*expand_row)(const uint8_t* indices, const uint32_t* palette, uint8_t* dst);
+
+    // Same, but index 0 is transparent and leaves dst untouched
+    void (*blend_row)(const uint8_t* indices, const uint32_t* palette, uint8_t* dst);
+
+    // Copies count RGBA pixels from src over dst, skipping those with 0 alpha
+    void (*blend_pixels)(const uint8_t* src, uint8_t* dst, int count);
+};
+
+
+const pixel_kernels_t& get_scalar_pixel_kernels();
+const pixel_kernels_t* get_simd_pixel_kernels(); // nullptr if this CPU has no SSE2
+const pixel_kernels_t& get_pixel_kernels(); // Fastest available
+
+uint32_t pack_rgba(uint8_t r, uint8_t g, uint8_t b, uint8_t a);
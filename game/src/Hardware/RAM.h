@@ -1,8 +1,8 @@
 #pragma once
 
 #include "CPUPeripheral.h"
+#include "StateBuffer.h"
 
-#include <stdio.h>
 #include <functional>
 #include <vector>
 
@@ -17,23 +17,30 @@ class RAM final : public CPUPeripheral
 public:
     RAM();
 
-    void serialize(FILE* f, int version) const;
-    void deserialize(FILE* f, int version);
+    void serialize(StateWriter& writer, int version) const;
+    void deserialize(StateReader& reader, int version);
 
     bool cpu_write(uint16_t addr, uint8_t data) override;
     bool cpu_read(uint16_t addr, uint8_t* out_data) override;
+    std::vector<cpu_range_t> get_cpu_ranges() const override { return { { 0x0000, 0x1FFF } }; }
 
-    void render();
     void update(float dt);
     
     uint8_t get(uint16_t addr) const { return m_data[addr]; }
     uint8_t operator[](uint16_t addr) const { return m_data[addr]; }
+#if SHOW_RAM
+    const float* get_usage() const { return m_usage; }
+#endif
 
     void register_write_callback(const std::function<uint8_t(uint8_t,int)>& callback, int addr);
     void register_read_callback(const std::function<bool(uint8_t*,int)>& callback, int addr);
 
 private:
+    static const uint8_t WRITE_CALLBACK_FLAG = 0b01;
+    static const uint8_t READ_CALLBACK_FLAG = 0b10;
+
     uint8_t m_data[0x2000];
+    uint8_t m_callback_flags[0x2000]; // So we only scan callbacks on addresses that have some
 #if SHOW_RAM
     float m_usage[0x2000];
     float m_time_passed = 0.0f;
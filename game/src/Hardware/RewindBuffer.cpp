@@ -0,0 +1,233 @@
+#include "RewindBuffer.h"
+
+#include <algorithm>
+#include <memory.h>
+
+
+// Encoded as a sequence of runs: uint16 unchanged byte count, uint16 changed byte count, then the changed bytes
+static const size_t MAX_RUN = 0xFFFF;
+static const size_t RUN_HEADER_SIZE = 4;
+static const size_t MIN_UNCHANGED_RUN = 4; // Shorter ones cost less kept in the changed bytes than a new header
+
+
+void RewindBuffer::set_budget(size_t budget)
+{
+    if (budget == m_ring.size()) return;
+
+    clear();
+    m_ring.resize(budget);
+    m_ring.shrink_to_fit();
+}
+
+
+void RewindBuffer::clear()
+{
+    m_entries.clear();
+    m_keyframe.clear();
+    m_deltas_since_keyframe = 0;
+    m_used = 0;
+}
+
+
+void RewindBuffer::push(const uint8_t* state, size_t size)
+{
+    if (m_ring.empty() || size == 0) return;
+
+    bool keyframe = m_entries.empty() || m_deltas_since_keyframe >= KEYFRAME_INTERVAL - 1 || size != m_keyframe.size();
+    size_t encoded_size = encode(state, keyframe ? nullptr : m_keyframe.data(), size);
+    uint8_t* data = allocate(encoded_size);
+    if (!keyframe && m_entries.empty())
+    {
+        // Its keyframe was dropped to make room
+        keyframe = true;
+        encoded_size = encode(state, nullptr, size);
+        data = allocate(encoded_size);
+    }
+    if (!data) return; // Larger than the whole budget
+
+    memcpy(data, m_encoded.data(), encoded_size);
+    m_entries.push_back({ (size_t)(data - m_ring.data()), encoded_size, size, keyframe });
+    m_used += encoded_size;
+
+    if (keyframe)
+    {
+        m_keyframe.assign(state, state + size);
+        m_deltas_since_keyframe = 0;
+    }
+    else
+    {
+        m_deltas_since_keyframe++;
+    }
+}
+
+
+bool RewindBuffer::pop(std::vector<uint8_t>* out_state)
+{
+    if (m_entries.empty()) return false;
+
+    entry_t entry = m_entries.back();
+    m_entries.pop_back();
+    m_used -= entry.size;
+
+    if (entry.keyframe)
+    {
+        *out_state = m_keyframe;
+        load_newest_keyframe();
+    }
+    else
+    {
+        out_state->resize(entry.state_size);
+        decode_delta(entry, m_keyframe.data(), out_state->data());
+        m_deltas_since_keyframe--;
+    }
+
+    return true;
+}
+
+
+size_t RewindBuffer::encode(const uint8_t* state, const uint8_t* keyframe, size_t size)
+{
+    m_diff.resize(size);
+    uint8_t* diff = m_diff.data();
+    if (keyframe)
+    {
+        for (size_t i = 0; i < size; ++i)
+            diff[i] = state[i] ^ keyframe[i];
+    }
+    else
+    {
+        memcpy(diff, state, size);
+    }
+
+    // Worst case, every run header but the first pays for itself in unchanged bytes
+    m_encoded.resize(size + (size / MAX_RUN + 2) * RUN_HEADER_SIZE);
+    uint8_t* out = m_encoded.data();
+
+    size_t i = 0;
+    while (i < size)
+    {
+        size_t unchanged_start = i;
+        size_t unchanged_end = std::min(size, unchanged_start + MAX_RUN);
+        while (i + 8 <= unchanged_end)
+        {
+            uint64_t word;
+            memcpy(&word, diff + i, 8);
+            if (word) break;
+            i += 8;
+        }
+        while (i < unchanged_end && !diff[i])
+            ++i;
+
+        size_t changed_start = i;
+        size_t changed_end = std::min(size, changed_start + MAX_RUN);
+        while (i < changed_end)
+        {
+            if (!diff[i] && i + MIN_UNCHANGED_RUN <= size && !diff[i + 1] && !diff[i + 2] && !diff[i + 3])
+                break;
+            ++i;
+        }
+
+        uint16_t header[2] = { (uint16_t)(changed_start - unchanged_start), (uint16_t)(i - changed_start) };
+        memcpy(out, header, RUN_HEADER_SIZE);
+        memcpy(out + RUN_HEADER_SIZE, diff + changed_start, i - changed_start);
+        out += RUN_HEADER_SIZE + (i - changed_start);
+    }
+
+    return (size_t)(out - m_encoded.data());
+}
+
+
+void RewindBuffer::decode_keyframe(const entry_t& entry, uint8_t* out_state) const
+{
+    // Encoded against zeros
+    memset(out_state, 0, entry.state_size);
+    apply_runs(entry, out_state);
+}
+
+
+void RewindBuffer::decode_delta(const entry_t& entry, const uint8_t* keyframe, uint8_t* out_state) const
+{
+    memcpy(out_state, keyframe, entry.state_size);
+    apply_runs(entry, out_state);
+}
+
+
+void RewindBuffer::apply_runs(const entry_t& entry, uint8_t* out_state) const
+{
+    const uint8_t* data = m_ring.data() + entry.offset;
+    const uint8_t* data_end = data + entry.size;
+    size_t offset = 0;
+    while (data < data_end)
+    {
+        uint16_t header[2];
+        memcpy(header, data, RUN_HEADER_SIZE);
+        data += RUN_HEADER_SIZE;
+
+        offset += header[0];
+        for (int i = 0; i < header[1]; ++i)
+            out_state[offset + i] ^= data[i];
+        offset += header[1];
+        data += header[1];
+    }
+}
+
+
+uint8_t* RewindBuffer::allocate(size_t size)
+{
+    if (size > m_ring.size()) return nullptr;
+
+    while (!m_entries.empty())
+    {
+        size_t oldest = m_entries.front().offset;
+        size_t newest_end = m_entries.back().offset + m_entries.back().size;
+        if (m_entries.back().offset >= oldest)
+        {
+            // In one piece, room after it or wrapping around before it
+            if (m_ring.size() - newest_end >= size) return m_ring.data() + newest_end;
+            if (oldest >= size) return m_ring.data();
+        }
+        else if (oldest - newest_end >= size)
+        {
+            // Wrapped around, room in between
+            return m_ring.data() + newest_end;
+        }
+
+        drop_oldest();
+    }
+
+    return m_ring.data();
+}
+
+
+void RewindBuffer::drop_oldest()
+{
+    // A keyframe goes with the deltas that need it
+    do
+    {
+        m_used -= m_entries.front().size;
+        m_entries.pop_front();
+    } while (!m_entries.empty() && !m_entries.front().keyframe);
+
+    if (m_entries.empty())
+    {
+        m_keyframe.clear();
+        m_deltas_since_keyframe = 0;
+    }
+}
+
+
+void RewindBuffer::load_newest_keyframe()
+{
+    m_keyframe.clear();
+    m_deltas_since_keyframe = 0;
+
+    for (int i = (int)m_entries.size() - 1; i >= 0; --i)
+    {
+        if (!m_entries[i].keyframe) continue;
+
+        m_keyframe.resize(m_entries[i].state_size);
+        decode_keyframe(m_entries[i], m_keyframe.data());
+        m_deltas_since_keyframe = (int)m_entries.size() - 1 - i;
+        return;
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <deque>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+// Ring of save states, newest last, within a fixed memory budget. The oldest are dropped to make room.
+//
+// Consecutive states are nearly identical (most of RAM, CHR and the nametables don't change from one
+// frame to the next). Each is stored XORed against the last keyframe, which leaves mostly zeros, then
+// run-length encoded. Keyframes are encoded the same way against nothing.
+class RewindBuffer final
+{
+public:
+    static const int KEYFRAME_INTERVAL = 60; // States per keyframe
+
+    // Changing it drops the states
+    void set_budget(size_t budget);
+    size_t get_budget() const { return m_ring.size(); }
+
+    void push(const uint8_t* state, size_t size);
+    bool pop(std::vector<uint8_t>* out_state); // Newest first
+    void clear();
+
+    int get_count() const { return (int)m_entries.size(); }
+    size_t get_used() const { return m_used; } // Bytes of the budget holding states
+
+private:
+    struct entry_t
+    {
+        size_t offset; // In the ring
+        size_t size; // Encoded
+        size_t state_size;
+        bool keyframe;
+    };
+
+    size_t encode(const uint8_t* state, const uint8_t* keyframe, size_t size); // Into m_encoded
+    void decode_keyframe(const entry_t& entry, uint8_t* out_state) const;
+    void decode_delta(const entry_t& entry, const uint8_t* keyframe, uint8_t* out_state) const;
+    void apply_runs(const entry_t& entry, uint8_t* out_state) const; // XORs the encoded runs into out_state
+    uint8_t* allocate(size_t size); // Drops the oldest states until it fits
+    void drop_oldest();
+    void load_newest_keyframe();
+
+    std::vector<uint8_t> m_ring;
+    std::deque<entry_t> m_entries;
+    std::vector<uint8_t> m_keyframe; // The newest in the ring, decoded
+    std::vector<uint8_t> m_diff;
+    std::vector<uint8_t> m_encoded;
+    size_t m_used = 0;
+    int m_deltas_since_keyframe = 0;
+};
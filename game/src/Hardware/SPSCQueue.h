@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+
+// Fixed size, lock-free queue for exactly one producer thread and one consumer thread.
+// CAPACITY must be a power of two. push() fails instead of blocking when the queue is full.
+template<typename T, uint32_t CAPACITY>
+class SPSCQueue final
+{
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+
+public:
+    // Producer
+    bool push(const T& item)
+    {
+        uint32_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == CAPACITY)
+            return false; // Full
+
+        m_items[tail & (CAPACITY - 1)] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer. The returned item stays valid until pop().
+    const T* front() const
+    {
+        uint32_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return nullptr; // Empty
+
+        return &m_items[head & (CAPACITY - 1)];
+    }
+
+    void pop()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Either thread. Only a snapshot, the other side keeps moving.
+    uint32_t size() const
+    {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+
+private:
+    T m_items[CAPACITY];
+    alignas(64) std::atomic<uint32_t> m_head = 0; // Written by the consumer only
+    alignas(64) std::atomic<uint32_t> m_tail = 0; // Written by the producer only
+};
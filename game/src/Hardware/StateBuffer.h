@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <memory.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+// Save files split a state in chunks: a tag, the size and the CRC32 of what follows. Each component
+// gets its own, so a loader can check them, and skip or migrate the ones it doesn't know.
+struct state_chunk_header_t
+{
+    uint32_t tag;
+    uint32_t size;
+    uint32_t crc32;
+};
+
+
+// Four characters, like "APU "
+constexpr uint32_t state_chunk_tag(const char (&name)[5])
+{
+    return (uint32_t)(uint8_t)name[0] | ((uint32_t)(uint8_t)name[1] << 8) | ((uint32_t)(uint8_t)name[2] << 16) | ((uint32_t)(uint8_t)name[3] << 24);
+}
+
+
+// Same as zlib's crc32(), the core doesn't link it
+inline uint32_t state_crc32(const uint8_t* data, size_t size)
+{
+    static const struct crc_table_t
+    {
+        uint32_t entries[256];
+        crc_table_t()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t crc = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+                entries[i] = crc;
+            }
+        }
+    } table;
+
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; ++i)
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
+
+
+// Save states are serialized to memory. A file is then written or read in one go, and rewind,
+// run-ahead or slot switching can snapshot without touching the disk.
+//
+// The writer keeps its storage between snapshots, clear() it and reuse it to never allocate.
+class StateWriter final
+{
+public:
+    StateWriter(size_t capacity = 0) { m_data.resize(capacity); }
+
+    void write(const void* data, size_t size)
+    {
+        if (m_size + size > m_data.size())
+            m_data.resize(std::max(m_data.size() * 2, m_size + size));
+        memcpy(m_data.data() + m_size, data, size);
+        m_size += size;
+    }
+
+    // What's written in between goes in a chunk with that tag. They don't nest.
+    void begin_chunk(uint32_t tag)
+    {
+        state_chunk_header_t header = { tag, 0, 0 };
+        m_chunk_start = m_size;
+        write(&header, sizeof(header));
+    }
+
+    void end_chunk()
+    {
+        state_chunk_header_t header;
+        memcpy(&header, m_data.data() + m_chunk_start, sizeof(header));
+        header.size = (uint32_t)(m_size - m_chunk_start - sizeof(header));
+        header.crc32 = state_crc32(m_data.data() + m_chunk_start + sizeof(header), header.size);
+        memcpy(m_data.data() + m_chunk_start, &header, sizeof(header));
+    }
+
+    void clear() { m_size = 0; }
+
+    const uint8_t* get_data() const { return m_data.data(); }
+    size_t get_size() const { return m_size; }
+
+private:
+    std::vector<uint8_t> m_data;
+    size_t m_size = 0;
+    size_t m_chunk_start = 0;
+};
+
+
+// Reads back what a StateWriter wrote. Like fread() at the end of a file, reading past the end
+// leaves the destination as it was, and the reader is flagged.
+class StateReader final
+{
+public:
+    StateReader(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+
+    size_t read(void* data, size_t size)
+    {
+        if (size > m_size - m_position)
+        {
+            m_position = m_size;
+            m_overrun = true;
+            return 0;
+        }
+        memcpy(data, m_data + m_position, size);
+        m_position += size;
+        return size;
+    }
+
+    // The next chunk's tag, and a reader over its data. False at the end, or when what's left is cut
+    // short or fails its checksum.
+    bool read_chunk(uint32_t* out_tag, StateReader* out_chunk)
+    {
+        state_chunk_header_t header;
+        if (m_size - m_position < sizeof(header)) return false;
+        memcpy(&header, m_data + m_position, sizeof(header));
+        if (header.size > m_size - m_position - sizeof(header)) return false;
+
+        const uint8_t* data = m_data + m_position + sizeof(header);
+        if (state_crc32(data, header.size) != header.crc32) return false;
+
+        m_position += sizeof(header) + header.size;
+        *out_tag = header.tag;
+        *out_chunk = StateReader(data, header.size);
+        return true;
+    }
+
+    size_t get_position() const { return m_position; }
+    size_t get_size() const { return m_size; }
+    bool has_overrun() const { return m_overrun; }
+
+private:
+    const uint8_t* m_data;
+    size_t m_size;
+    size_t m_position = 0;
+    bool m_overrun = false;
+};
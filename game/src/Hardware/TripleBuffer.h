@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+
+// Lock-free hand-off of whole values from one producer thread to one consumer thread. The producer
+// fills get_back() and publish()es it. The consumer's acquire() returns the latest published value.
+// Neither side ever waits, the consumer only misses values it was too slow to see. Slots are reused,
+// so the producer finds whatever it wrote there two publishes ago.
+template<typename T>
+class TripleBuffer final
+{
+public:
+    // Producer
+    T& get_back() { return m_slots[m_back]; }
+
+    void publish()
+    {
+        m_back = m_middle.exchange(m_back | NEW_BIT, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Consumer. The returned value stays valid until the next acquire().
+    const T& acquire()
+    {
+        if (m_middle.load(std::memory_order_relaxed) & NEW_BIT)
+            m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & INDEX_MASK;
+        return m_slots[m_front];
+    }
+
+private:
+    static const uint8_t INDEX_MASK = 0b011;
+    static const uint8_t NEW_BIT = 0b100; // The middle slot wasn't acquired yet
+
+    T m_slots[3];
+    uint8_t m_back = 0; // Producer only
+    uint8_t m_front = 1; // Consumer only
+    std::atomic<uint8_t> m_middle = 2;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "ControllerInputs.h"
+
 #include <onut/GamePad.h>
 #include <onut/Input.h>
 
@@ -7,19 +9,6 @@
 static const int INPUT_STATE_COUNT = 8;
 
 
-struct inputs_t
-{
-    bool left = false;
-    bool right = false;
-    bool up = false;
-    bool down = false;
-    bool select = false;
-    bool start = false;
-    bool a = false;
-    bool b = false;
-};
-
-
 class Input
 {
 public:
@@ -61,12 +50,3 @@ public:
     void from_setting_value(int index, const std::string& value);
     InputAction filter(const std::vector<InputAction>& filters);
 };
-
-
-class InputContext
-{
-public:
-    virtual ~InputContext() {}
-
-    virtual inputs_t read_inputs(int controller_id) = 0;
-};
@@ -0,0 +1,232 @@
+// Headless music/SFX renderer. Drives the ROM's sound engine through NSFRenderer and writes each
+// track to a mono 16 bits WAV file, much faster than real time.
+//
+// Usage: RenderAudio [options]
+//     --rom <file>      ROM to read the sound engine from (default: "Faxanadu (U).nes")
+//     --out <dir>       Output directory (default: "audio")
+//     --music <id|all>  Music track to render, 0 to 15. Can be repeated.
+//     --sfx <id|all>    SFX to render, 0 to 27. Can be repeated.
+//     --seconds <n>     Longest a music track renders for, they usually loop (default: 180)
+//     --jobs <n>        Render on n threads, 0 for one per core (default: 1)
+//     --no-filter       Skip the NES output filters
+// Without --music or --sfx, everything is rendered. Each file is listed with the FNV-1a 64 hash of
+// its PCM data, for regression testing.
+
+#include "Cart.h"
+#include "ErrorHandler.h"
+#include "NSFRenderer.h"
+
+#include <chrono>
+#include <filesystem>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+
+static const int SFX_COUNT = 28;
+static const int SFX_SILENCE_SAMPLES = NSFRenderer::SAMPLE_RATE / 10;
+static const int MUSIC_SILENCE_SAMPLES = NSFRenderer::SAMPLE_RATE * 2; // Longer, tracks have rests
+static const int SFX_MAX_SAMPLES = NSFRenderer::SAMPLE_RATE * 60;
+
+
+struct wav_header_t
+{
+    char riff[4] = { 'R', 'I', 'F', 'F' };
+    uint32_t riff_size = 0;
+    char wave[4] = { 'W', 'A', 'V', 'E' };
+    char fmt[4] = { 'f', 'm', 't', ' ' };
+    uint32_t fmt_size = 16;
+    uint16_t format = 1; // PCM
+    uint16_t channel_count = 1;
+    uint32_t sample_rate = NSFRenderer::SAMPLE_RATE;
+    uint32_t byte_rate = NSFRenderer::SAMPLE_RATE * 2;
+    uint16_t block_align = 2;
+    uint16_t bits_per_sample = 16;
+    char data[4] = { 'd', 'a', 't', 'a' };
+    uint32_t data_size = 0;
+};
+static_assert(sizeof(wav_header_t) == 44, "WAV header must not be padded");
+
+
+struct track_t
+{
+    std::string filename;
+    int sound_id;
+    bool is_music;
+};
+
+
+static std::vector<int16_t> to_pcm16(const std::vector<float>& samples)
+{
+    std::vector<int16_t> pcm(samples.size());
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        float sample = samples[i] * 32767.0f;
+        if (sample > 32767.0f) sample = 32767.0f;
+        if (sample < -32768.0f) sample = -32768.0f;
+        pcm[i] = (int16_t)lroundf(sample);
+    }
+    return pcm;
+}
+
+
+static uint64_t hash_pcm(const std::vector<int16_t>& pcm)
+{
+    // FNV-1a, over the bytes as they are in the file
+    uint64_t hash = 0xCBF29CE484222325ull;
+    const uint8_t* bytes = (const uint8_t*)pcm.data();
+    for (size_t i = 0; i < pcm.size() * sizeof(int16_t); ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ull;
+    }
+    return hash;
+}
+
+
+static bool write_wav(const std::string& filename, const std::vector<int16_t>& pcm)
+{
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f) return false;
+
+    wav_header_t header;
+    header.data_size = (uint32_t)(pcm.size() * sizeof(int16_t));
+    header.riff_size = header.data_size + sizeof(wav_header_t) - 8;
+    bool success = fwrite(&header, sizeof(header), 1, f) == 1;
+    success = success && fwrite(pcm.data(), sizeof(int16_t), pcm.size(), f) == pcm.size();
+    success = fclose(f) == 0 && success;
+    return success;
+}
+
+
+static bool add_tracks(const char* arg, bool is_music, std::vector<track_t>& tracks)
+{
+    int count = is_music ? NSFRenderer::MUSIC_COUNT : SFX_COUNT;
+    int first = 0;
+    int last = count - 1;
+    if (strcmp(arg, "all") != 0)
+    {
+        char* end = nullptr;
+        first = last = (int)strtol(arg, &end, 10);
+        if (*end || first < 0 || first >= count)
+            return false;
+    }
+
+    for (int i = first; i <= last; ++i)
+    {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "%s_%02d.wav", is_music ? "music" : "sfx", i);
+        tracks.push_back({ filename, is_music ? i : NSFRenderer::MUSIC_COUNT + i, is_music });
+    }
+    return true;
+}
+
+
+static void print_usage()
+{
+    printf("Usage: RenderAudio [--rom <file>] [--out <dir>] [--music <id|all>] [--sfx <id|all>] [--seconds <n>] [--jobs <n>] [--no-filter]\n");
+}
+
+
+int main(int argc, char** argv)
+{
+    std::string rom_filename = "Faxanadu (U).nes";
+    std::string out_dir = "audio";
+    std::vector<track_t> tracks;
+    int music_seconds = 180;
+    int job_count = 1;
+    bool use_filter = true;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--rom") == 0 && has_value) rom_filename = argv[++i];
+        else if (strcmp(argv[i], "--out") == 0 && has_value) out_dir = argv[++i];
+        else if (strcmp(argv[i], "--seconds") == 0 && has_value) music_seconds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--jobs") == 0 && has_value) job_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-filter") == 0) use_filter = false;
+        else if ((strcmp(argv[i], "--music") == 0 || strcmp(argv[i], "--sfx") == 0) && has_value)
+        {
+            bool is_music = strcmp(argv[i], "--music") == 0;
+            if (!add_tracks(argv[++i], is_music, tracks))
+            {
+                fprintf(stderr, "Invalid %s id: %s\n", is_music ? "music" : "sfx", argv[i]);
+                return 1;
+            }
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    if (tracks.empty())
+    {
+        add_tracks("all", true, tracks);
+        add_tracks("all", false, tracks);
+    }
+    if (music_seconds <= 0)
+    {
+        print_usage();
+        return 1;
+    }
+
+    set_error_handler([](const std::string& title, const std::string& message)
+    {
+        fprintf(stderr, "%s: %s\n", title.c_str(), message.c_str());
+        exit(1);
+    });
+    Cart cart(rom_filename.c_str()); // Validates the rom
+
+    std::error_code ec;
+    std::filesystem::create_directories(out_dir, ec);
+
+    // Music and SFX end differently, render them as two batches
+    auto start_time = std::chrono::high_resolution_clock::now();
+    std::vector<std::vector<float>> samples(tracks.size());
+    for (int music = 0; music < 2; ++music)
+    {
+        std::vector<int> sound_ids;
+        std::vector<size_t> indices;
+        for (size_t i = 0; i < tracks.size(); ++i)
+        {
+            if (tracks[i].is_music != (music == 1)) continue;
+            sound_ids.push_back(tracks[i].sound_id);
+            indices.push_back(i);
+        }
+        if (sound_ids.empty()) continue;
+
+        int silence_samples = music ? MUSIC_SILENCE_SAMPLES : SFX_SILENCE_SAMPLES;
+        int max_samples = music ? NSFRenderer::SAMPLE_RATE * music_seconds : SFX_MAX_SAMPLES;
+        auto rendered = NSFRenderer::render_all(cart.get_prg_rom(), cart.get_prg_rom_size(), sound_ids, silence_samples, max_samples, job_count, use_filter);
+        for (size_t i = 0; i < indices.size(); ++i)
+            samples[indices[i]] = std::move(rendered[i]);
+    }
+    auto end_time = std::chrono::high_resolution_clock::now();
+
+    int result = 0;
+    size_t total_samples = 0;
+    for (size_t i = 0; i < tracks.size(); ++i)
+    {
+        auto pcm = to_pcm16(samples[i]);
+        std::string filename = out_dir + "/" + tracks[i].filename;
+        if (!write_wav(filename, pcm))
+        {
+            fprintf(stderr, "Failed to write %s\n", filename.c_str());
+            result = 1;
+            continue;
+        }
+        total_samples += pcm.size();
+        printf("%s %016llx %.2fs\n", tracks[i].filename.c_str(), (unsigned long long)hash_pcm(pcm), (double)pcm.size() / (double)NSFRenderer::SAMPLE_RATE);
+    }
+
+    double render_seconds = std::chrono::duration<double>(end_time - start_time).count();
+    double audio_seconds = (double)total_samples / (double)NSFRenderer::SAMPLE_RATE;
+    printf("Rendered %.1fs of audio in %.2fs (%.0fx real time)\n", audio_seconds, render_seconds, render_seconds > 0.0 ? audio_seconds / render_seconds : 0.0);
+
+    return result;
+}
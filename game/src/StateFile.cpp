@@ -0,0 +1,48 @@
+#include "StateFile.h"
+
+#include <memory.h>
+#include <zlib.h>
+
+
+static const uint8_t MAGIC[4] = { 'D', 'A', 'X', 'S' };
+static const size_t HEADER_SIZE = sizeof(MAGIC) + sizeof(uint32_t);
+static const uint32_t MAX_STATE_SIZE = 16 * 1024 * 1024; // So a corrupt size doesn't allocate the world
+
+
+bool StateFile::compress(const uint8_t* state, size_t size, std::vector<uint8_t>* out_file)
+{
+    if (size > MAX_STATE_SIZE) return false; // Couldn't be loaded back
+
+    // Written on the I/O thread, it can take its time
+    uLongf compressed_size = compressBound((uLong)size);
+    out_file->resize(HEADER_SIZE + compressed_size);
+
+    uint32_t state_size = (uint32_t)size;
+    memcpy(out_file->data(), MAGIC, sizeof(MAGIC));
+    memcpy(out_file->data() + sizeof(MAGIC), &state_size, sizeof(state_size));
+    if (compress2(out_file->data() + HEADER_SIZE, &compressed_size, state, (uLong)size, Z_BEST_COMPRESSION) != Z_OK)
+        return false;
+    out_file->resize(HEADER_SIZE + compressed_size);
+    return true;
+}
+
+
+bool StateFile::is_compressed(const uint8_t* file, size_t size)
+{
+    return size >= HEADER_SIZE && memcmp(file, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+
+bool StateFile::decompress(const uint8_t* file, size_t size, std::vector<uint8_t>* out_state)
+{
+    if (!is_compressed(file, size)) return false;
+
+    uint32_t state_size;
+    memcpy(&state_size, file + sizeof(MAGIC), sizeof(state_size));
+    if (state_size > MAX_STATE_SIZE) return false;
+
+    out_state->resize(state_size);
+    uLongf decompressed_size = state_size;
+    int result = uncompress(out_state->data(), &decompressed_size, file + HEADER_SIZE, (uLong)(size - HEADER_SIZE));
+    return result == Z_OK && decompressed_size == state_size;
+}
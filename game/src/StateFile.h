@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+
+// Save files on disk: "DAXS", the state's size, then the state compressed with zlib. Files from
+// before state version 9 are the raw, uncompressed state.
+class StateFile final
+{
+public:
+    static bool compress(const uint8_t* state, size_t size, std::vector<uint8_t>* out_file); // False if zlib fails
+    static bool is_compressed(const uint8_t* file, size_t size);
+    static bool decompress(const uint8_t* file, size_t size, std::vector<uint8_t>* out_state); // False if corrupt
+};
@@ -0,0 +1,123 @@
+#include "StateFileWriter.h"
+#include "StateFile.h"
+
+#include <filesystem>
+#include <stdio.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+
+StateFileWriter::StateFileWriter()
+{
+    m_thread = std::thread([this]() { run(); });
+}
+
+
+StateFileWriter::~StateFileWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_job_condition.notify_one();
+    m_thread.join();
+}
+
+
+void StateFileWriter::write(const std::string& filename, const uint8_t* data, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // Only the newest matters
+        job_t* job = nullptr;
+        for (auto& queued_job : m_jobs)
+            if (queued_job.filename == filename)
+                job = &queued_job;
+        if (!job)
+        {
+            m_jobs.push_back({ filename, {} });
+            job = &m_jobs.back();
+        }
+        job->data.assign(data, data + size);
+    }
+    m_job_condition.notify_one();
+}
+
+
+void StateFileWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle_condition.wait(lock, [this]() { return m_jobs.empty() && !m_busy; });
+}
+
+
+bool StateFileWriter::pop_error(std::string* out_filename)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_errors.empty()) return false;
+
+    *out_filename = m_errors.front();
+    m_errors.erase(m_errors.begin());
+    return true;
+}
+
+
+void StateFileWriter::run()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_job_condition.wait(lock, [this]() { return !m_jobs.empty() || m_stopping; });
+        if (m_jobs.empty()) break; // Stopping, and nothing left to write
+
+        job_t job = std::move(m_jobs.front());
+        m_jobs.pop_front();
+        m_busy = true;
+
+        lock.unlock();
+        bool success = write_file(job);
+        lock.lock();
+
+        if (!success)
+            m_errors.push_back(job.filename);
+        m_busy = false;
+        if (m_jobs.empty())
+            m_idle_condition.notify_all();
+    }
+}
+
+
+bool StateFileWriter::write_file(const job_t& job)
+{
+    auto temp_filename = job.filename + ".tmp";
+
+    // Nothing is written then, the previous save stays
+    std::vector<uint8_t> file;
+    if (!StateFile::compress(job.data.data(), job.data.size(), &file)) return false;
+
+    FILE* f = fopen(temp_filename.c_str(), "wb");
+    if (!f) return false;
+
+    // Make sure it reached the disk before it replaces anything
+    bool success = fwrite(file.data(), 1, file.size(), f) == file.size() && fflush(f) == 0;
+#if defined(_WIN32)
+    success = success && _commit(_fileno(f)) == 0;
+#else
+    success = success && fsync(fileno(f)) == 0;
+#endif
+    success = fclose(f) == 0 && success;
+
+    std::error_code ec;
+    if (success)
+        std::filesystem::rename(temp_filename, job.filename, ec); // Replaces it atomically
+    if (!success || ec)
+    {
+        std::filesystem::remove(temp_filename, ec);
+        return false;
+    }
+    return true;
+}
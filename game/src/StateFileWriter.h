@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Writes save states on a thread of its own, so a slow disk never holds up a frame. Each one is compressed
+// (see StateFile), goes to a temporary file next to it first, then replaces the old file in a single rename:
+// a crash or power loss mid-write leaves the previous save as it was.
+class StateFileWriter final
+{
+public:
+    StateFileWriter();
+    ~StateFileWriter(); // Finishes what's queued
+
+    // Copies data, returns right away. A write still queued for the same file is replaced.
+    void write(const std::string& filename, const uint8_t* data, size_t size);
+
+    // Waits until everything queued is on disk, before reading one back
+    void flush();
+
+    // Files that failed to write, one per call, so the main thread can report them
+    bool pop_error(std::string* out_filename);
+
+private:
+    struct job_t
+    {
+        std::string filename;
+        std::vector<uint8_t> data;
+    };
+
+    void run();
+    static bool write_file(const job_t& job);
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_job_condition; // Wakes the thread
+    std::condition_variable m_idle_condition; // Wakes flush()
+    std::deque<job_t> m_jobs;
+    std::vector<std::string> m_errors;
+    bool m_busy = false; // The thread is writing one it took off the queue
+    bool m_stopping = false;
+};
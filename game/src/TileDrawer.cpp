@@ -1,4 +1,6 @@
 #include "TileDrawer.h"
+#include "CHRCache.h"
+#include "PixelKernels.h"
 #include "PPU.h"
 
 #include <onut/Dialogs.h>
@@ -22,12 +24,11 @@ TileDrawer::TileDrawer(const uint8_t* rom, PPU* ppu)
     // Load palette from the ROM file
     uint8_t colors[192];
     uint8_t indexed_palette[4];
-    uint8_t palette[4 * 3];
+    uint32_t palette[4];
     load_colors(colors);
     memcpy(indexed_palette, &rom[0x0002C000 + 12], 4);
     for (int i = 0; i < 4; ++i)
-        for (int j = 0; j < 3; ++j)
-            palette[i * 3 + j] = colors[indexed_palette[i] * 3 + j];
+        palette[i] = pack_rgba(colors[indexed_palette[i] * 3 + 0], colors[indexed_palette[i] * 3 + 1], colors[indexed_palette[i] * 3 + 2], 255);
 
     // Load tilesets
     load_tileset_range(rom, tileset_data, palette, 0x00028000, 80, 0);
@@ -62,12 +63,11 @@ void TileDrawer::load_colors(uint8_t* colors)
 
 void TileDrawer::load_tileset_range(const uint8_t* rom,
                                     uint8_t* out,
-                                    const uint8_t* palette,
+                                    const uint32_t* palette,
                                     int addr, int count, int offset)
 {
     const int x_tile_count = TILESET_W / 8;
-    const int dst_x_inc = 4;
-    const int dst_y_inc = TILESET_W * 4 - 8 * 4;
+    const auto& kernels = get_pixel_kernels();
 
     for (int i = 0; i < count; ++i)
     {
@@ -76,27 +76,27 @@ void TileDrawer::load_tileset_range(const uint8_t* rom,
         int dst_tile_y = dst_tile / x_tile_count;
         int dst_k = dst_tile_y * TILESET_W * 4 * 8 + dst_tile_x * 8 * 4;
 
-        auto src_data = &rom[addr + i * 16];
+        uint8_t tile[CHRCache::TILE_SIZE];
+        CHRCache::decode_tile(&rom[addr + i * 16], tile);
         auto dst_data = &out[dst_k];
 
-        for (int y = 0; y < 8; ++y, dst_data += dst_y_inc)
+        for (int y = 0; y < 8; ++y, dst_data += TILESET_W * 4)
         {
-            for (int x = 0; x < 8; ++x, dst_data += dst_x_inc)
-            {
-                int b1 = (src_data[y] >> (7 - x)) & 1;
-                int b2 = (src_data[y + 8] >> (7 - x)) & 1;
-                int col = (b1) | (b2 << 1);
-
-                dst_data[0] = palette[col * 3 + 0];
-                dst_data[1] = palette[col * 3 + 1];
-                dst_data[2] = palette[col * 3 + 2];
-                dst_data[3] = 255;
-            }
+            kernels.expand_row(tile + y * 8, palette, dst_data);
         }
     }
 }
 
 
+Color TileDrawer::get_ppu_color(int idx) const
+{
+    uint8_t rgba[4];
+    uint32_t packed = m_ppu->get_rgba_color(idx);
+    memcpy(rgba, &packed, 4);
+    return Color((float)rgba[0] / 255.0f, (float)rgba[1] / 255.0f, (float)rgba[2] / 255.0f, 1.0f);
+}
+
+
 void TileDrawer::draw_tile_fine(int tile_id, int x, int y)
 {
     const int x_tile_count = TILESET_W / 8;
@@ -196,9 +196,9 @@ void TileDrawer::draw_text(int x, int y, const char* text, const Color& tint)
         {
             c = *text++;
             if (c == '\0') break;
-            if (c == '0') color = m_ppu->get_color(0x0F);
-            else if (c == '1') color = m_ppu->get_color(0x15);
-            else if (c == '2') color = m_ppu->get_color(0x19);
+            if (c == '0') color = get_ppu_color(0x0F);
+            else if (c == '1') color = get_ppu_color(0x15);
+            else if (c == '2') color = get_ppu_color(0x19);
             else if (c == '3') color = Color::White;
             color *= tint;
             continue;
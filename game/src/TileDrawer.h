@@ -24,9 +24,10 @@ private:
     static void load_colors(uint8_t* colors);
     static void load_tileset_range(const uint8_t* rom,
                                    uint8_t* out,
-                                   const uint8_t* palette,
+                                   const uint32_t* palette,
                                    int addr, int count, int offset);
 
+    Color get_ppu_color(int idx) const;
     void draw_tile(int tile_id, int x, int y, const Color& color = Color::White);
     void draw_tile_fine(int tile_id, int x, int y);
 
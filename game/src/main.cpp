@@ -1,6 +1,8 @@
 #include "Daxanadu.h"
+#include "ErrorHandler.h"
 #include "version.h"
 
+#include <onut/Dialogs.h>
 #include <onut/onut.h>
 #include <onut/Files.h>
 #include <onut/Settings.h>
@@ -45,6 +47,20 @@ void initSettings()
     oSettings->setUserSettingDefault("ap_slot", "John Doe");
     oSettings->setUserSettingDefault("ap_password", "");
     oSettings->setUserSettingDefault("fast_cpu", "0");
+    oSettings->setUserSettingDefault("software_compositor", "1");
+    oSettings->setUserSettingDefault("frame_pacing", "0");
+    oSettings->setUserSettingDefault("frame_skip", "2"); // Frames run without being shown per refresh, when late
+    oSettings->setUserSettingDefault("emulation_thread", "0"); // Run the emulation off the render loop
+    oSettings->setUserSettingDefault("turbo_render_interval", "8"); // While fast forwarding, rasterize one frame in this many
+    oSettings->setUserSettingDefault("turbo_audio_stretch", "0"); // Squeeze the audio into real time instead of muting it
+    oSettings->setUserSettingDefault("rewind", "0"); // Hold backspace
+    oSettings->setUserSettingDefault("rewind_interval", "1"); // Frames between snapshots
+    oSettings->setUserSettingDefault("rewind_buffer_mb", "32");
+    oSettings->setUserSettingDefault("run_ahead", "0"); // Frames shown ahead of the emulation, to hide the game's input lag
+    oSettings->setUserSettingDefault("audio_stats", "0");
+    oSettings->setUserSettingDefault("audio_adaptive_latency", "0");
+    oSettings->setUserSettingDefault("audio_target_latency", "25"); // ms
+    oSettings->setUserSettingDefault("audio_clock_master", "0"); // Emulation follows the audio device instead of wall time
 }
 
 
@@ -52,6 +68,11 @@ void init()
 {
     //oTiming->setUpdateFps(60.0988);
 
+    set_error_handler([](const std::string& title, const std::string& message)
+    {
+        onut::showMessageBox(title, message);
+    });
+
     daxanadu = new Daxanadu();
 }
 